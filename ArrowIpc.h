@@ -0,0 +1,590 @@
+/*
+ * The Sleuth Kit
+ *
+ * Contact: Brian Carrier [carrier <at> sleuthkit [dot] org]
+ * Copyright (c) 2010-2012 Basis Technology Corporation. All Rights
+ * reserved.
+ *
+ * This software is distributed under the Common Public License 1.0
+ */
+
+/** \file ArrowIpc.h
+ * This file contains a writer for Apache Arrow IPC files (also known as
+ * Feather version 2 files), which the module writes its columnar export
+ * manifest as. The files can be read by pyarrow, pandas, polars, DuckDB and
+ * other Arrow based tools, which memory map them and read only the columns
+ * a query uses.
+ *
+ * An IPC file is the "ARROW1" magic, a stream of messages (a schema, then
+ * record batches of rows, each holding every column as contiguous buffers),
+ * and a footer locating the record batches. Message metadata is encoded as
+ * FlatBuffers tables, which are built here by a small builder rather than
+ * with the FlatBuffers library.
+ *
+ * The writer supports the column types the manifest needs: UTF-8 strings,
+ * 64-bit integers, doubles and timestamps in seconds, each optionally
+ * nullable. It writes metadata version 5 and no dictionaries.
+ */
+
+#ifndef _ARROW_IPC_H
+#define _ARROW_IPC_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <stdint.h>
+
+namespace ArrowIpc
+{
+    const char MAGIC[6] = { 'A', 'R', 'R', 'O', 'W', '1' };
+    const uint32_t CONTINUATION = 0xFFFFFFFF;
+    const int16_t METADATA_V5 = 4;
+
+    // Values of the Type and MessageHeader unions.
+    const uint8_t TYPE_INT = 2;
+    const uint8_t TYPE_FLOATING_POINT = 3;
+    const uint8_t TYPE_UTF8 = 5;
+    const uint8_t TYPE_TIMESTAMP = 10;
+    const uint8_t HEADER_SCHEMA = 1;
+    const uint8_t HEADER_RECORD_BATCH = 3;
+
+    const int16_t PRECISION_DOUBLE = 2;
+    const int16_t TIME_UNIT_SECOND = 0;
+
+    /**
+     * Builds a FlatBuffers buffer back to front, as the FlatBuffers library
+     * does: objects are prepended, so an object must be built before the
+     * objects that refer to it, and positions are measured from the end of
+     * the buffer.
+     */
+    class FlatBufferBuilder
+    {
+    public:
+        FlatBufferBuilder() : minAlign(1), tableStart(0) {}
+
+        size_t size() const
+        {
+            return bytes.size();
+        }
+
+        /**
+         * Pads the front of the buffer so that it is aligned to the given size
+         * once the given number of bytes have been prepended.
+         */
+        void align(size_t alignment, size_t additionalBytes = 0)
+        {
+            minAlign = std::max(minAlign, alignment);
+            size_t padding = (alignment - (bytes.size() + additionalBytes) % alignment) % alignment;
+            bytes.insert(0, padding, '\0');
+        }
+
+        template <typename T>
+        void prepend(T value)
+        {
+            align(sizeof(T));
+            char little[sizeof(T)];
+            uint64_t bits = static_cast<uint64_t>(value);
+            for (size_t i = 0; i < sizeof(T); ++i)
+            {
+                little[i] = static_cast<char>((bits >> (8 * i)) & 0xff);
+            }
+            bytes.insert(0, little, sizeof(T));
+        }
+
+        /**
+         * Prepends a reference to an object built earlier.
+         */
+        void prependOffset(uint32_t object)
+        {
+            align(4);
+            prepend(static_cast<uint32_t>(bytes.size() + 4 - object));
+        }
+
+        uint32_t createString(const std::string &value)
+        {
+            align(4, value.size() + 1);
+            bytes.insert(0, 1, '\0');
+            bytes.insert(0, value);
+            prepend(static_cast<uint32_t>(value.size()));
+            return static_cast<uint32_t>(bytes.size());
+        }
+
+        uint32_t createOffsetVector(const std::vector<uint32_t> &objects)
+        {
+            align(4, 4 * objects.size());
+            for (std::vector<uint32_t>::const_reverse_iterator object = objects.rbegin(); object != objects.rend(); ++object)
+            {
+                prependOffset(*object);
+            }
+            prepend(static_cast<uint32_t>(objects.size()));
+            return static_cast<uint32_t>(bytes.size());
+        }
+
+        /**
+         * Creates a vector of structs from their little-endian bytes, which
+         * hold count structs that are all 8-byte aligned.
+         */
+        uint32_t createStructVector(const std::string &structs, size_t count)
+        {
+            align(8, structs.size());
+            bytes.insert(0, structs);
+            prepend(static_cast<uint32_t>(count));
+            return static_cast<uint32_t>(bytes.size());
+        }
+
+        void startTable()
+        {
+            fields.clear();
+            tableStart = bytes.size();
+        }
+
+        template <typename T>
+        void addField(uint16_t field, T value)
+        {
+            prepend(value);
+            fields.push_back(std::make_pair(field, static_cast<uint32_t>(bytes.size())));
+        }
+
+        void addOffsetField(uint16_t field, uint32_t object)
+        {
+            prependOffset(object);
+            fields.push_back(std::make_pair(field, static_cast<uint32_t>(bytes.size())));
+        }
+
+        /**
+         * Ends a table, prepending its vtable, which gives the offset of
+         * each field present from the start of the table.
+         */
+        uint32_t endTable()
+        {
+            prepend(static_cast<int32_t>(0));
+            const uint32_t table = static_cast<uint32_t>(bytes.size());
+
+            uint16_t fieldCount = 0;
+            for (std::vector<std::pair<uint16_t, uint32_t> >::const_iterator field = fields.begin(); field != fields.end(); ++field)
+            {
+                fieldCount = std::max<uint16_t>(fieldCount, static_cast<uint16_t>((*field).first + 1));
+            }
+            std::vector<uint16_t> vtable(2 + fieldCount, 0);
+            vtable[0] = static_cast<uint16_t>(2 * vtable.size());
+            vtable[1] = static_cast<uint16_t>(table - tableStart);
+            for (std::vector<std::pair<uint16_t, uint32_t> >::const_iterator field = fields.begin(); field != fields.end(); ++field)
+            {
+                vtable[2 + (*field).first] = static_cast<uint16_t>(table - (*field).second);
+            }
+            for (std::vector<uint16_t>::const_reverse_iterator entry = vtable.rbegin(); entry != vtable.rend(); ++entry)
+            {
+                prepend(*entry);
+            }
+
+            // The table starts with the offset back to its vtable.
+            int32_t vtableOffset = static_cast<int32_t>(bytes.size() - table);
+            size_t tableIndex = bytes.size() - table;
+            for (size_t i = 0; i < 4; ++i)
+            {
+                bytes[tableIndex + i] = static_cast<char>((vtableOffset >> (8 * i)) & 0xff);
+            }
+            fields.clear();
+            return table;
+        }
+
+        /**
+         * Finishes the buffer with a reference to its root table, padding it
+         * to a multiple of 8 bytes so that it can be followed by a message 
+         * body.
+         */
+        const std::string &finish(uint32_t root)
+        {
+            align(std::max<size_t>(minAlign, 8), 4);
+            prependOffset(root);
+            return bytes;
+        }
+
+    private:
+        std::string bytes;
+        size_t minAlign;
+        size_t tableStart;
+        std::vector<std::pair<uint16_t, uint32_t> > fields;
+    };
+
+    inline void appendLittle(std::string &out, uint64_t value, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            out += static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+    }
+
+    enum ColumnType
+    {
+        UTF8,
+        INT64,
+        UINT64,
+        DOUBLE,
+        TIMESTAMP_SECONDS
+    };
+
+    struct Column
+    {
+        Column(const std::string &name, ColumnType type, bool nullable) : name(name), type(type), nullable(nullable) {}
+
+        std::string name;
+        ColumnType type;
+        bool nullable;
+    };
+
+    /**
+     * Writes an Arrow IPC file of rows with the given columns. Rows are added
+     * a value at a time, in column order, and written out as a record batch
+     * by writeBatch().
+     */
+    class FileWriter
+    {
+    public:
+        FileWriter(std::ostream &stream, const std::vector<Column> &columns)
+            : stream(stream), columns(columns), values(columns.size()), position(0), column(0), rowCount(0)
+        {
+            clearValues();
+            write(MAGIC, sizeof(MAGIC));
+            write("\0\0", 2);
+
+            FlatBufferBuilder builder;
+            uint32_t schema = createSchema(builder);
+            builder.startTable();
+            builder.addField(3, static_cast<int64_t>(0));
+            builder.addOffsetField(2, schema);
+            builder.addField(1, HEADER_SCHEMA);
+            builder.addField(0, METADATA_V5);
+            writeMessage(builder.finish(builder.endTable()), "");
+        }
+
+        void appendString(const std::string &value)
+        {
+            ColumnValues &columnValues = nextColumn(UTF8);
+            columnValues.data += value;
+            appendLittle(columnValues.offsets, columnValues.data.size(), 4);
+            columnValues.valid.push_back(true);
+        }
+
+        void appendInt64(int64_t value)
+        {
+            ColumnValues &columnValues = nextColumn(INT64);
+            appendLittle(columnValues.data, static_cast<uint64_t>(value), 8);
+            columnValues.valid.push_back(true);
+        }
+
+        void appendTimestamp(int64_t secondsSinceEpoch)
+        {
+            ColumnValues &columnValues = nextColumn(TIMESTAMP_SECONDS);
+            appendLittle(columnValues.data, static_cast<uint64_t>(secondsSinceEpoch), 8);
+            columnValues.valid.push_back(true);
+        }
+
+        void appendUInt64(uint64_t value)
+        {
+            ColumnValues &columnValues = nextColumn(UINT64);
+            appendLittle(columnValues.data, value, 8);
+            columnValues.valid.push_back(true);
+        }
+
+        void appendDouble(double value)
+        {
+            ColumnValues &columnValues = nextColumn(DOUBLE);
+            uint64_t bits = 0;
+            memcpy(&bits, &value, sizeof(bits));
+            appendLittle(columnValues.data, bits, 8);
+            columnValues.valid.push_back(true);
+        }
+
+        void appendNull()
+        {
+            if (!columns[column].nullable)
+            {
+                throw std::logic_error("null value for column " + columns[column].name);
+            }
+            const ColumnType type = columns[column].type;
+            ColumnValues &columnValues = nextColumn(type);
+            if (type == UTF8)
+            {
+                appendLittle(columnValues.offsets, columnValues.data.size(), 4);
+            }
+            else
+            {
+                columnValues.data.append(8, '\0');
+            }
+            columnValues.valid.push_back(false);
+            ++columnValues.nullCount;
+        }
+
+        /**
+         * @return The number of complete rows not yet written.
+         */
+        size_t getPendingRows() const
+        {
+            return column == 0 ? rowCount : rowCount - 1;
+        }
+
+        /**
+         * Writes the complete rows added since the last batch as a record
+         * batch.
+         */
+        void writeBatch()
+        {
+            if (column != 0)
+            {
+                throw std::logic_error("record batch written part way through a row");
+            }
+            if (rowCount == 0)
+            {
+                return;
+            }
+
+            // Lay out the body: each column's validity bitmap (empty if it has no nulls), then its offsets if it is a
+            // string column, then its values, each padded to 8 bytes.
+            std::string body;
+            std::string nodes;
+            std::string buffers;
+            for (std::vector<ColumnValues>::const_iterator columnValues = values.begin(); columnValues != values.end(); ++columnValues)
+            {
+                appendLittle(nodes, rowCount, 8);
+                appendLittle(nodes, (*columnValues).nullCount, 8);
+
+                std::string validity;
+                if ((*columnValues).nullCount != 0)
+                {
+                    validity.assign((rowCount + 7) / 8, '\0');
+                    for (size_t row = 0; row < rowCount; ++row)
+                    {
+                        if ((*columnValues).valid[row])
+                        {
+                            validity[row / 8] = static_cast<char>(validity[row / 8] | (1 << (row % 8)));
+                        }
+                    }
+                }
+                appendBuffer(body, buffers, validity);
+                if (columns[columnValues - values.begin()].type == UTF8)
+                {
+                    appendBuffer(body, buffers, (*columnValues).offsets);
+                }
+                appendBuffer(body, buffers, (*columnValues).data);
+            }
+
+            FlatBufferBuilder builder;
+            uint32_t buffersVector = builder.createStructVector(buffers, buffers.size() / 16);
+            uint32_t nodesVector = builder.createStructVector(nodes, nodes.size() / 16);
+            builder.startTable();
+            builder.addField(0, static_cast<int64_t>(rowCount));
+            builder.addOffsetField(2, buffersVector);
+            builder.addOffsetField(1, nodesVector);
+            uint32_t recordBatch = builder.endTable();
+            builder.startTable();
+            builder.addField(3, static_cast<int64_t>(body.size()));
+            builder.addOffsetField(2, recordBatch);
+            builder.addField(1, HEADER_RECORD_BATCH);
+            builder.addField(0, METADATA_V5);
+
+            Block block;
+            block.offset = position;
+            block.metadataLength = writeMessage(builder.finish(builder.endTable()), body);
+            block.bodyLength = body.size();
+            blocks.push_back(block);
+
+            rowCount = 0;
+            clearValues();
+        }
+
+        /**
+         * Writes any pending rows, the end of the stream and the footer.
+         */
+        void finish()
+        {
+            writeBatch();
+            std::string endOfStream;
+            appendLittle(endOfStream, CONTINUATION, 4);
+            appendLittle(endOfStream, 0, 4);
+            write(endOfStream.data(), endOfStream.size());
+
+            FlatBufferBuilder builder;
+            std::string blockStructs;
+            for (std::vector<Block>::const_iterator block = blocks.begin(); block != blocks.end(); ++block)
+            {
+                appendLittle(blockStructs, (*block).offset, 8);
+                appendLittle(blockStructs, (*block).metadataLength, 4);
+                appendLittle(blockStructs, 0, 4);
+                appendLittle(blockStructs, (*block).bodyLength, 8);
+            }
+            uint32_t recordBatches = builder.createStructVector(blockStructs, blocks.size());
+            uint32_t dictionaries = builder.createStructVector("", 0);
+            uint32_t schema = createSchema(builder);
+            builder.startTable();
+            builder.addOffsetField(3, recordBatches);
+            builder.addOffsetField(2, dictionaries);
+            builder.addOffsetField(1, schema);
+            builder.addField(0, METADATA_V5);
+            const std::string &footer = builder.finish(builder.endTable());
+            write(footer.data(), footer.size());
+
+            std::string trailer;
+            appendLittle(trailer, footer.size(), 4);
+            trailer.append(MAGIC, sizeof(MAGIC));
+            write(trailer.data(), trailer.size());
+            stream.flush();
+        }
+
+    private:
+        FileWriter(const FileWriter &);
+        FileWriter &operator=(const FileWriter &);
+
+        struct ColumnValues
+        {
+            ColumnValues() : nullCount(0) {}
+
+            std::string data;
+            std::string offsets;
+            std::vector<bool> valid;
+            uint64_t nullCount;
+        };
+
+        struct Block
+        {
+            uint64_t offset;
+            uint32_t metadataLength;
+            uint64_t bodyLength;
+        };
+
+        void write(const char *data, size_t length)
+        {
+            stream.write(data, static_cast<std::streamsize>(length));
+            if (!stream)
+            {
+                throw std::runtime_error("failed to write Arrow IPC file");
+            }
+            position += length;
+        }
+
+        void clearValues()
+        {
+            for (size_t i = 0; i < values.size(); ++i)
+            {
+                values[i] = ColumnValues();
+                if (columns[i].type == UTF8)
+                {
+                    appendLittle(values[i].offsets, 0, 4);
+                }
+            }
+        }
+
+        ColumnValues &nextColumn(ColumnType type)
+        {
+            if (columns[column].type != type)
+            {
+                throw std::logic_error("wrong value type for column " + columns[column].name);
+            }
+            if (column == 0)
+            {
+                ++rowCount;
+            }
+            ColumnValues &columnValues = values[column];
+            column = (column + 1) % columns.size();
+            return columnValues;
+        }
+
+        static void appendBuffer(std::string &body, std::string &buffers, const std::string &buffer)
+        {
+            appendLittle(buffers, body.size(), 8);
+            appendLittle(buffers, buffer.size(), 8);
+            body += buffer;
+            body.append((8 - body.size() % 8) % 8, '\0');
+        }
+
+        uint32_t createSchema(FlatBufferBuilder &builder) const
+        {
+            std::vector<uint32_t> fields;
+            for (std::vector<Column>::const_iterator column = columns.begin(); column != columns.end(); ++column)
+            {
+                uint8_t typeType = TYPE_UTF8;
+                uint32_t type = 0;
+                if ((*column).type == UTF8)
+                {
+                    builder.startTable();
+                    type = builder.endTable();
+                }
+                else if ((*column).type == INT64 || (*column).type == UINT64)
+                {
+                    typeType = TYPE_INT;
+                    builder.startTable();
+                    builder.addField(1, static_cast<uint8_t>((*column).type == INT64 ? 1 : 0));
+                    builder.addField(0, static_cast<int32_t>(64));
+                    type = builder.endTable();
+                }
+                else if ((*column).type == DOUBLE)
+                {
+                    typeType = TYPE_FLOATING_POINT;
+                    builder.startTable();
+                    builder.addField(0, PRECISION_DOUBLE);
+                    type = builder.endTable();
+                }
+                else
+                {
+                    typeType = TYPE_TIMESTAMP;
+                    uint32_t timezone = builder.createString("UTC");
+                    builder.startTable();
+                    builder.addOffsetField(1, timezone);
+                    builder.addField(0, TIME_UNIT_SECOND);
+                    type = builder.endTable();
+                }
+
+                uint32_t name = builder.createString((*column).name);
+                uint32_t children = builder.createOffsetVector(std::vector<uint32_t>());
+                builder.startTable();
+                builder.addOffsetField(0, name);
+                builder.addOffsetField(3, type);
+                builder.addOffsetField(5, children);
+                builder.addField(2, typeType);
+                builder.addField(1, static_cast<uint8_t>((*column).nullable ? 1 : 0));
+                fields.push_back(builder.endTable());
+            }
+
+            uint32_t fieldsVector = builder.createOffsetVector(fields);
+            builder.startTable();
+            builder.addOffsetField(1, fieldsVector);
+            builder.addField(0, static_cast<int16_t>(0));
+            return builder.endTable();
+        }
+
+        /**
+         * Writes an encapsulated message: the continuation marker, the
+         * metadata length, the metadata and the body.
+         *
+         * @return The length of the message up to the body.
+         */
+        uint32_t writeMessage(const std::string &metadata, const std::string &body)
+        {
+            std::string prefix;
+            appendLittle(prefix, CONTINUATION, 4);
+            appendLittle(prefix, metadata.size(), 4);
+            write(prefix.data(), prefix.size());
+            write(metadata.data(), metadata.size());
+            write(body.data(), body.size());
+            return static_cast<uint32_t>(prefix.size() + metadata.size());
+        }
+
+        std::ostream &stream;
+        std::vector<Column> columns;
+        std::vector<ColumnValues> values;
+        uint64_t position;
+
+        // The column the next value is for.
+        size_t column;
+
+        // Rows added since the last batch, including any part way through.
+        size_t rowCount;
+
+        std::vector<Block> blocks;
+    };
+}
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ * The Sleuth Kit
+ *
+ * Contact: Brian Carrier [carrier <at> sleuthkit [dot] org]
+ * Copyright (c) 2010-2012 Basis Technology Corporation. All Rights
+ * reserved.
+ *
+ * This software is distributed under the Common Public License 1.0
+ */
+
+/** \file ChunkStore.h
+ * This file contains the content-defined chunk store the module saves large
+ * files to when given the chunkdedup option. Files such as virtual machine
+ * disks, mailboxes and databases are often mostly identical across versions
+ * and hosts but differ as whole files, so they are cut into chunks at points
+ * chosen by their content, and each distinct chunk is stored once.
+ *
+ * Chunk boundaries are found with FastCDC (Xia et al., USENIX ATC 2016): a
+ * gear rolling hash is computed over the content, no cut is considered
+ * before the minimum chunk size (so those bytes are not hashed at all), a
+ * stricter mask is used below the average chunk size and a looser one above
+ * it to keep chunk sizes close to the average, and chunks are cut at the
+ * maximum size regardless. Since the cut points depend only on the nearby
+ * content, an insertion or deletion changes the chunks around it rather than
+ * every chunk after it. The gear table is derived from a fixed seed, so the
+ * same content is cut the same way in every run and chunks are shared across
+ * runs that use the same store.
+ *
+ * Chunks are stored in <store>/<xx>/<sha1>, where <sha1> is the SHA-1 of the
+ * chunk's content in hex and <xx> its first two digits. Each chunked file is
+ * saved as a recipe: a text file with a comment line followed by a line of
+ * "<sha1>\t<length>" per chunk, in order. A file is restored by
+ * concatenating its chunks, e.g.:
+ *
+ *      grep -v '^#' file.chunks | while read h n; do cat store/${h:0:2}/$h; done > file
+ */
+
+#ifndef _CHUNK_STORE_H
+#define _CHUNK_STORE_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <stdint.h>
+
+#include "Poco/File.h"
+#include "Poco/Path.h"
+#include "Poco/FileStream.h"
+#include "Poco/SHA1Engine.h"
+#include "Poco/DigestEngine.h"
+#include "Poco/Exception.h"
+
+namespace Chunking
+{
+    const size_t DEFAULT_AVERAGE_CHUNK_SIZE = 1024 * 1024;
+
+    // The first line of a recipe.
+    const char *const RECIPE_HEADER = "# SaveInterestingFilesModule chunk recipe 1: <sha1>\\t<length> per chunk";
+
+    /**
+     * Finds content-defined cut points in a stream of bytes with FastCDC.
+     */
+    class Chunker
+    {
+    public:
+        /**
+         * @param averageSize The average chunk size, a power of two of at
+         * least 64 bytes. Chunks are between a quarter of it and four times
+         * it long.
+         */
+        explicit Chunker(size_t averageSize = DEFAULT_AVERAGE_CHUNK_SIZE)
+            : minSize(averageSize / 4), averageSize(averageSize), maxSize(averageSize * 4)
+        {
+            if (averageSize < 64 || (averageSize & (averageSize - 1)) != 0)
+            {
+                throw Poco::InvalidArgumentException("chunk size must be a power of two of at least 64 bytes");
+            }
+
+            unsigned int bits = 0;
+            while ((static_cast<size_t>(1) << bits) < averageSize)
+            {
+                ++bits;
+            }
+            // Normalized chunking, level 2: two more bits must be zero to cut below the average size, two fewer above it.
+            strictMask = spreadMask(bits + 2);
+            looseMask = spreadMask(bits - 2);
+
+            // A fixed table, so that chunks are cut the same way in every run.
+            uint64_t state = 0x5361766543444321ULL;
+            for (int i = 0; i < 256; ++i)
+            {
+                state += 0x9e3779b97f4a7c15ULL;
+                uint64_t z = state;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                gear[i] = z ^ (z >> 31);
+            }
+        }
+
+        size_t getAverageSize() const
+        {
+            return averageSize;
+        }
+
+        size_t getMaxSize() const
+        {
+            return maxSize;
+        }
+
+        /**
+         * Finds the first cut point in data, which must start at a chunk
+         * boundary.
+         *
+         * @return The length of the first chunk, or 0 if there is no cut
+         * point in fewer than length bytes and more data may follow.
+         */
+        size_t findCutPoint(const unsigned char *data, size_t length) const
+        {
+            if (length >= maxSize)
+            {
+                length = maxSize;
+            }
+            else if (length <= minSize)
+            {
+                return 0;
+            }
+
+            uint64_t hash = 0;
+            size_t i = minSize;
+            const size_t normalEnd = std::min(length, averageSize);
+            for (; i < normalEnd; ++i)
+            {
+                hash = (hash << 1) + gear[data[i]];
+                if ((hash & strictMask) == 0)
+                {
+                    return i + 1;
+                }
+            }
+            for (; i < length; ++i)
+            {
+                hash = (hash << 1) + gear[data[i]];
+                if ((hash & looseMask) == 0)
+                {
+                    return i + 1;
+                }
+            }
+            return length == maxSize ? maxSize : 0;
+        }
+
+    private:
+        /**
+         * @return A mask of the given number of bits spread over the upper
+         * 48 bits of the hash, which depend on more of the preceding bytes
+         * than the lowest bits do.
+         */
+        static uint64_t spreadMask(unsigned int bits)
+        {
+            uint64_t mask = 0;
+            for (unsigned int i = 0; i < bits; ++i)
+            {
+                mask |= static_cast<uint64_t>(1) << (63 - (i * 48) / bits);
+            }
+            return mask;
+        }
+
+        size_t minSize;
+        size_t averageSize;
+        size_t maxSize;
+        uint64_t strictMask;
+        uint64_t looseMask;
+        uint64_t gear[256];
+    };
+
+    /**
+     * A folder of chunks stored by content.
+     */
+    class Store
+    {
+    public:
+        Store() : chunksStored(0), bytesStored(0), bytesDeduplicated(0) {}
+
+        /**
+         * Opens a store, creating its folder if necessary. Chunks already in
+         * the folder, e.g. from earlier runs, are shared with this run's.
+         */
+        void open(const std::string &path)
+        {
+            folderPath = Poco::Path::forDirectory(path).toString();
+            Poco::File(folderPath).createDirectories();
+            knownChunks.clear();
+            createdFolders.clear();
+            chunksStored = 0;
+            bytesStored = 0;
+            bytesDeduplicated = 0;
+        }
+
+        void close()
+        {
+            folderPath.clear();
+            knownChunks.clear();
+            createdFolders.clear();
+        }
+
+        bool isOpen() const
+        {
+            return !folderPath.empty();
+        }
+
+        const std::string &getPath() const
+        {
+            return folderPath;
+        }
+
+        /**
+         * Stores a chunk if it is not already in the store.
+         *
+         * @return The chunk's SHA-1 in hex.
+         */
+        std::string put(const char *data, size_t length)
+        {
+            Poco::SHA1Engine digest;
+            digest.update(data, static_cast<unsigned int>(length));
+            const std::string hash = Poco::DigestEngine::digestToHex(digest.digest());
+            if (knownChunks.find(hash) != knownChunks.end())
+            {
+                bytesDeduplicated += length;
+                return hash;
+            }
+
+            const std::string subfolderPath = folderPath + hash.substr(0, 2) + Poco::Path::separator();
+            const std::string chunkPath = subfolderPath + hash;
+            if (createdFolders.insert(hash.substr(0, 2)).second)
+            {
+                Poco::File(subfolderPath).createDirectories();
+            }
+            if (Poco::File(chunkPath).exists())
+            {
+                bytesDeduplicated += length;
+            }
+            else
+            {
+                // Write the chunk under a temporary name first, so that a chunk that is present is always complete.
+                const std::string tempPath = chunkPath + ".tmp";
+                Poco::FileOutputStream stream(tempPath, std::ios::out | std::ios::trunc | std::ios::binary);
+                stream.write(data, static_cast<std::streamsize>(length));
+                stream.close();
+                if (!stream)
+                {
+                    throw Poco::WriteFileException(tempPath);
+                }
+                Poco::File(tempPath).renameTo(chunkPath);
+                ++chunksStored;
+                bytesStored += length;
+            }
+            knownChunks.insert(hash);
+            return hash;
+        }
+
+        unsigned long getChunksStored() const
+        {
+            return chunksStored;
+        }
+
+        uint64_t getBytesStored() const
+        {
+            return bytesStored;
+        }
+
+        uint64_t getBytesDeduplicated() const
+        {
+            return bytesDeduplicated;
+        }
+
+    private:
+        Store(const Store &);
+        Store &operator=(const Store &);
+
+        std::string folderPath;
+        std::set<std::string> knownChunks;
+        std::set<std::string> createdFolders;
+        unsigned long chunksStored;
+        uint64_t bytesStored;
+        uint64_t bytesDeduplicated;
+    };
+
+    /**
+     * Writes a file to a store as chunks and a recipe.
+     */
+    class RecipeWriter
+    {
+    public:
+        RecipeWriter(Store &store, const Chunker &chunker, const std::string &recipePath)
+            : store(store), chunker(chunker), recipePath(recipePath),
+            recipe(recipePath, std::ios::out | std::ios::trunc | std::ios::binary)
+        {
+            recipe << RECIPE_HEADER << "\n";
+            if (!recipe)
+            {
+                throw Poco::CreateFileException(recipePath);
+            }
+        }
+
+        void write(const char *data, size_t length)
+        {
+            pending.insert(pending.end(), data, data + length);
+            cutChunks(false);
+        }
+
+        void close()
+        {
+            cutChunks(true);
+            recipe.close();
+            if (!recipe)
+            {
+                throw Poco::WriteFileException(recipePath);
+            }
+        }
+
+    private:
+        RecipeWriter(const RecipeWriter &);
+        RecipeWriter &operator=(const RecipeWriter &);
+
+        /**
+         * Stores the chunks found in the pending data, and the rest of it as
+         * a final chunk if the file is complete.
+         */
+        void cutChunks(bool final)
+        {
+            // Cut points are only looked for once a whole maximum sized chunk is pending, so that each byte is hashed
+            // about once however the data arrives.
+            size_t start = 0;
+            while (start < pending.size() && (final || pending.size() - start >= chunker.getMaxSize()))
+            {
+                size_t length = chunker.findCutPoint(reinterpret_cast<const unsigned char*>(&pending[start]), pending.size() - start);
+                if (length == 0)
+                {
+                    length = pending.size() - start;
+                }
+                recipe << store.put(&pending[start], length) << "\t" << length << "\n";
+                start += length;
+            }
+            pending.erase(pending.begin(), pending.begin() + start);
+            if (!recipe)
+            {
+                throw Poco::WriteFileException(recipePath);
+            }
+        }
+
+        Store &store;
+        const Chunker &chunker;
+        std::string recipePath;
+        Poco::FileOutputStream recipe;
+        std::vector<char> pending;
+    };
+}
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ * The Sleuth Kit
+ *
+ * Contact: Brian Carrier [carrier <at> sleuthkit [dot] org]
+ * Copyright (c) 2010-2012 Basis Technology Corporation. All Rights
+ * reserved.
+ *
+ * This software is distributed under the Common Public License 1.0
+ */
+
+/** \file ReadTrace.h
+ * This file defines the format of the evidence read traces that the module
+ * records when given the readtrace option, and that ReadTraceReplay replays.
+ *
+ * A trace starts with a header:
+ *
+ *      "SIFTRACE"                      8 bytes
+ *      version                         4 bytes, little-endian
+ *      number of image files           varint
+ *      image file names                varint length + UTF-8 bytes, each
+ *
+ * followed by one record per read. To keep traces compact, each field of a
+ * record is a varint holding the difference from the previous record:
+ *
+ *      (image index << 1) | mapped     varint
+ *      timestamp delta (us)            varint
+ *      offset - end of previous read   zigzag varint
+ *      length                          varint
+ *      file id delta                   zigzag varint
+ *
+ * Reads of file content that is not stored in plain sector runs (e.g.,
+ * resident or compressed data) are recorded unmapped, with an offset within
+ * the file rather than the image. Unmapped reads do not update the previous
+ * read end used for offsets.
+ *
+ * The image files are the segments of the image (e.g., the .E01, .E02, ...
+ * files of an EWF image), and mapped offsets are offsets in the logical image
+ * they make up. The image index of records is reserved for traces spanning
+ * several images and is currently always 0.
+ */
+
+#ifndef _READ_TRACE_H
+#define _READ_TRACE_H
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <stdint.h>
+
+namespace ReadTrace
+{
+    const char MAGIC[8] = { 'S', 'I', 'F', 'T', 'R', 'A', 'C', 'E' };
+    const uint32_t VERSION = 1;
+
+    /**
+     * A read of evidence data.
+     */
+    struct Record
+    {
+        Record() : image(0), mapped(true), offset(0), length(0), fileId(0), timestamp(0) {}
+
+        // Index of the image the read was from.
+        uint32_t image;
+
+        // True if offset is an offset in the image, false if it is an offset in the file.
+        bool mapped;
+
+        uint64_t offset;
+        uint64_t length;
+        uint64_t fileId;
+
+        // Microseconds since the start of the trace.
+        uint64_t timestamp;
+    };
+
+    inline void writeVarint(std::ostream &stream, uint64_t value)
+    {
+        char bytes[10];
+        int count = 0;
+        do
+        {
+            bytes[count] = static_cast<char>(value & 0x7f);
+            value >>= 7;
+            if (value != 0)
+            {
+                bytes[count] |= 0x80;
+            }
+            ++count;
+        }
+        while (value != 0);
+        stream.write(bytes, count);
+    }
+
+    inline bool readVarint(std::istream &stream, uint64_t &value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            int byte = stream.get();
+            if (byte == EOF)
+            {
+                return false;
+            }
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline uint64_t zigzag(int64_t value)
+    {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    inline int64_t unzigzag(uint64_t value)
+    {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    /**
+     * Writes a trace to a binary stream.
+     */
+    class Writer
+    {
+    public:
+        Writer(std::ostream &stream, const std::vector<std::string> &images)
+            : stream(stream), lastTimestamp(0), lastEnd(0), lastFileId(0)
+        {
+            stream.write(MAGIC, sizeof(MAGIC));
+            char version[4] = { static_cast<char>(VERSION & 0xff), static_cast<char>((VERSION >> 8) & 0xff),
+                                static_cast<char>((VERSION >> 16) & 0xff), static_cast<char>((VERSION >> 24) & 0xff) };
+            stream.write(version, sizeof(version));
+            writeVarint(stream, images.size());
+            for (std::vector<std::string>::const_iterator image = images.begin(); image != images.end(); ++image)
+            {
+                writeVarint(stream, (*image).size());
+                stream.write((*image).data(), static_cast<std::streamsize>((*image).size()));
+            }
+        }
+
+        void write(const Record &record)
+        {
+            writeVarint(stream, (static_cast<uint64_t>(record.image) << 1) | (record.mapped ? 1 : 0));
+            writeVarint(stream, record.timestamp - lastTimestamp);
+            writeVarint(stream, zigzag(static_cast<int64_t>(record.offset - (record.mapped ? lastEnd : 0))));
+            writeVarint(stream, record.length);
+            writeVarint(stream, zigzag(static_cast<int64_t>(record.fileId - lastFileId)));
+
+            lastTimestamp = record.timestamp;
+            lastFileId = record.fileId;
+            if (record.mapped)
+            {
+                lastEnd = record.offset + record.length;
+            }
+        }
+
+    private:
+        Writer(const Writer &);
+        Writer &operator=(const Writer &);
+
+        std::ostream &stream;
+        uint64_t lastTimestamp;
+        uint64_t lastEnd;
+        uint64_t lastFileId;
+    };
+
+    /**
+     * Reads a trace from a binary stream.
+     */
+    class Reader
+    {
+    public:
+        /**
+         * Reads the trace header. isValid() returns false afterwards if the 
+         * stream does not hold a trace of a supported version.
+         */
+        explicit Reader(std::istream &stream) : stream(stream), valid(false), lastTimestamp(0), lastEnd(0), lastFileId(0)
+        {
+            char magic[sizeof(MAGIC)];
+            unsigned char version[4];
+            uint64_t imageCount = 0;
+            if (!stream.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+                !stream.read(reinterpret_cast<char*>(version), sizeof(version)) ||
+                (version[0] | (version[1] << 8) | (version[2] << 16) | (static_cast<uint32_t>(version[3]) << 24)) != VERSION ||
+                !readVarint(stream, imageCount))
+            {
+                return;
+            }
+
+            for (uint64_t i = 0; i < imageCount; ++i)
+            {
+                uint64_t length = 0;
+                if (!readVarint(stream, length))
+                {
+                    return;
+                }
+                std::string name(static_cast<size_t>(length), '\0');
+                if (length != 0 && !stream.read(&name[0], static_cast<std::streamsize>(length)))
+                {
+                    return;
+                }
+                images.push_back(name);
+            }
+            valid = true;
+        }
+
+        bool isValid() const
+        {
+            return valid;
+        }
+
+        const std::vector<std::string> &getImages() const
+        {
+            return images;
+        }
+
+        /**
+         * @return False at the end of the trace.
+         */
+        bool read(Record &record)
+        {
+            uint64_t imageAndMapped, timestampDelta, offsetDelta, length, fileIdDelta;
+            if (!valid || !readVarint(stream, imageAndMapped) || !readVarint(stream, timestampDelta) || !readVarint(stream, offsetDelta) ||
+                !readVarint(stream, length) || !readVarint(stream, fileIdDelta))
+            {
+                return false;
+            }
+
+            record.image = static_cast<uint32_t>(imageAndMapped >> 1);
+            record.mapped = (imageAndMapped & 1) != 0;
+            record.timestamp = lastTimestamp + timestampDelta;
+            record.offset = (record.mapped ? lastEnd : 0) + static_cast<uint64_t>(unzigzag(offsetDelta));
+            record.length = length;
+            record.fileId = lastFileId + static_cast<uint64_t>(unzigzag(fileIdDelta));
+
+            lastTimestamp = record.timestamp;
+            lastFileId = record.fileId;
+            if (record.mapped)
+            {
+                lastEnd = record.offset + record.length;
+            }
+            return true;
+        }
+
+    private:
+        Reader(const Reader &);
+        Reader &operator=(const Reader &);
+
+        std::istream &stream;
+        bool valid;
+        std::vector<std::string> images;
+        uint64_t lastTimestamp;
+        uint64_t lastEnd;
+        uint64_t lastFileId;
+    };
+}
+
+#endif
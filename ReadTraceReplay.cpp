@@ -0,0 +1,501 @@
+/*
+ * The Sleuth Kit
+ *
+ * Contact: Brian Carrier [carrier <at> sleuthkit [dot] org]
+ * Copyright (c) 2010-2012 Basis Technology Corporation. All Rights
+ * reserved.
+ *
+ * This software is distributed under the Common Public License 1.0
+ */
+
+/** \file ReadTraceReplay.cpp
+ * A command line tool that replays an evidence read trace recorded by
+ * SaveInterestingFilesModule (see ReadTrace.h) against the same image under
+ * different read orderings, block cache sizes and numbers of reading threads,
+ * and reports the throughput of each combination.
+ *
+ * Usage:
+ *      ReadTraceReplay [-o orders] [-c cacheSizes] [-t threadCounts]
+ *                      [-i imageFile]... trace
+ *
+ *      -o  Comma-separated read orderings: recorded (the order of the trace),
+ *          offset (ascending image offset) and file (the reads of each file
+ *          together, files in the order they were first read). Default:
+ *          recorded,offset,file.
+ *      -c  Comma-separated block cache sizes in megabytes, 0 for no cache.
+ *          Default: 0.
+ *      -t  Comma-separated numbers of reading threads. Default: 1.
+ *      -i  An image file to use instead of those named in the trace, for
+ *          evidence that has moved. Repeat for each segment of a split image.
+ *
+ * Only reads recorded with image offsets are replayed. The operating system's
+ * cache is not flushed between combinations, so for representative results
+ * replay against evidence much larger than memory or flush the cache between
+ * runs.
+ */
+
+// TSK includes
+#include "tsk3/libtsk.h"
+
+// Poco includes
+#include "Poco/Thread.h"
+#include "Poco/Runnable.h"
+#include "Poco/Mutex.h"
+#include "Poco/Timestamp.h"
+#include "Poco/StringTokenizer.h"
+#include "Poco/NumberParser.h"
+#include "Poco/NumberFormatter.h"
+#include "Poco/FileStream.h"
+#include "Poco/Exception.h"
+
+// Module includes
+#include "ReadTrace.h"
+
+// System includes
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <map>
+#include <iostream>
+#include <algorithm>
+
+namespace
+{
+    // Size of the blocks the cache holds and reads are made in when caching.
+    const uint64_t CACHE_BLOCK_SIZE = 64 * 1024;
+
+    void usage()
+    {
+        std::cerr << "Usage: ReadTraceReplay [-o orders] [-c cacheSizes] [-t threadCounts] [-i imageFile]... trace" << std::endl;
+        std::cerr << "  -o  Comma-separated read orderings: recorded, offset, file (default: all)" << std::endl;
+        std::cerr << "  -c  Comma-separated block cache sizes in MB, 0 for no cache (default: 0)" << std::endl;
+        std::cerr << "  -t  Comma-separated numbers of reading threads (default: 1)" << std::endl;
+        std::cerr << "  -i  Image file to use instead of those in the trace, repeated for each segment" << std::endl;
+    }
+
+    std::vector<unsigned int> parseList(const std::string &list)
+    {
+        std::vector<unsigned int> values;
+        Poco::StringTokenizer tokenizer(list, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+        for (Poco::StringTokenizer::Iterator token = tokenizer.begin(); token != tokenizer.end(); ++token)
+        {
+            values.push_back(Poco::NumberParser::parseUnsigned(*token));
+        }
+        return values;
+    }
+
+    bool hasLowerOffset(const ReadTrace::Record &first, const ReadTrace::Record &second)
+    {
+        return first.offset < second.offset;
+    }
+
+    /**
+     * Orders the reads of each file together, files in the order they were
+     * first read.
+     */
+    void orderByFile(std::vector<ReadTrace::Record> &reads)
+    {
+        std::map<uint64_t, size_t> fileRanks;
+        for (std::vector<ReadTrace::Record>::const_iterator read = reads.begin(); read != reads.end(); ++read)
+        {
+            fileRanks.insert(std::make_pair((*read).fileId, fileRanks.size()));
+        }
+
+        std::vector<std::vector<ReadTrace::Record> > readsByFile(fileRanks.size());
+        for (std::vector<ReadTrace::Record>::const_iterator read = reads.begin(); read != reads.end(); ++read)
+        {
+            readsByFile[fileRanks[(*read).fileId]].push_back(*read);
+        }
+
+        reads.clear();
+        for (std::vector<std::vector<ReadTrace::Record> >::const_iterator fileReads = readsByFile.begin(); fileReads != readsByFile.end(); ++fileReads)
+        {
+            reads.insert(reads.end(), (*fileReads).begin(), (*fileReads).end());
+        }
+    }
+
+    /**
+     * A least recently used cache of image blocks shared by the reading
+     * threads. Only the block numbers are kept; the cache models which reads
+     * would be served from memory.
+     */
+    class BlockCache
+    {
+    public:
+        explicit BlockCache(uint64_t capacity) : capacity(capacity), hits(0), misses(0) {}
+
+        /**
+         * @return True if the block was cached, false if it was added.
+         */
+        bool lookup(uint64_t block)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            std::map<uint64_t, std::list<uint64_t>::iterator>::iterator entry = entries.find(block);
+            if (entry != entries.end())
+            {
+                recency.splice(recency.begin(), recency, entry->second);
+                ++hits;
+                return true;
+            }
+
+            ++misses;
+            recency.push_front(block);
+            entries[block] = recency.begin();
+            if (entries.size() > capacity)
+            {
+                entries.erase(recency.back());
+                recency.pop_back();
+            }
+            return false;
+        }
+
+        uint64_t getHits() const
+        {
+            return hits;
+        }
+
+        uint64_t getMisses() const
+        {
+            return misses;
+        }
+
+    private:
+        Poco::FastMutex mutex;
+        uint64_t capacity;
+        std::list<uint64_t> recency;
+        std::map<uint64_t, std::list<uint64_t>::iterator> entries;
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    /**
+     * Reads taken in turn from a shared list, with its own image handle so
+     * that threads do not serialize on one handle's lock.
+     */
+    class ReplayWorker : public Poco::Runnable
+    {
+    public:
+        ReplayWorker(const std::vector<std::string> &imageFiles, const std::vector<ReadTrace::Record> &reads, size_t &nextRead,
+            Poco::FastMutex &nextReadLock, BlockCache *cache)
+            : reads(reads), nextRead(nextRead), nextReadLock(nextReadLock), cache(cache), image(NULL), bytesRead(0), failedReads(0)
+        {
+            std::vector<const char*> names;
+            for (std::vector<std::string>::const_iterator imageFile = imageFiles.begin(); imageFile != imageFiles.end(); ++imageFile)
+            {
+                names.push_back((*imageFile).c_str());
+            }
+            image = tsk_img_open_utf8(static_cast<int>(names.size()), &names[0], TSK_IMG_TYPE_DETECT, 0);
+            if (image == NULL)
+            {
+                std::string message = tsk_error_get() != NULL ? tsk_error_get() : "unknown error";
+                tsk_error_reset();
+                throw Poco::OpenFileException("failed to open image " + imageFiles[0] + ": " + message);
+            }
+        }
+
+        ~ReplayWorker()
+        {
+            tsk_img_close(image);
+        }
+
+        void run()
+        {
+            std::vector<char> buffer(static_cast<size_t>(CACHE_BLOCK_SIZE));
+            for (;;)
+            {
+                const ReadTrace::Record *read = NULL;
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(nextReadLock);
+                    if (nextRead == reads.size())
+                    {
+                        return;
+                    }
+                    read = &reads[nextRead++];
+                }
+
+                if (cache == NULL)
+                {
+                    // Read the range as recorded, in pieces of at most the buffer size.
+                    for (uint64_t done = 0; done < read->length; )
+                    {
+                        size_t length = static_cast<size_t>(std::min(read->length - done, CACHE_BLOCK_SIZE));
+                        readImage(read->offset + done, &buffer[0], length);
+                        done += length;
+                    }
+                }
+                else
+                {
+                    for (uint64_t block = read->offset / CACHE_BLOCK_SIZE; block * CACHE_BLOCK_SIZE < read->offset + read->length; ++block)
+                    {
+                        if (!cache->lookup(block))
+                        {
+                            uint64_t offset = block * CACHE_BLOCK_SIZE;
+                            size_t length = static_cast<size_t>(std::min(CACHE_BLOCK_SIZE, static_cast<uint64_t>(image->size) - std::min(offset, static_cast<uint64_t>(image->size))));
+                            readImage(offset, &buffer[0], length);
+                        }
+                    }
+                }
+            }
+        }
+
+        uint64_t getBytesRead() const
+        {
+            return bytesRead;
+        }
+
+        uint64_t getFailedReads() const
+        {
+            return failedReads;
+        }
+
+    private:
+        ReplayWorker(const ReplayWorker &);
+        ReplayWorker &operator=(const ReplayWorker &);
+
+        void readImage(uint64_t offset, char *buffer, size_t length)
+        {
+            if (length == 0)
+            {
+                return;
+            }
+            ssize_t result = tsk_img_read(image, static_cast<TSK_OFF_T>(offset), buffer, length);
+            if (result < 0)
+            {
+                tsk_error_reset();
+                ++failedReads;
+                return;
+            }
+            bytesRead += static_cast<uint64_t>(result);
+        }
+
+        const std::vector<ReadTrace::Record> &reads;
+        size_t &nextRead;
+        Poco::FastMutex &nextReadLock;
+        BlockCache *cache;
+        TSK_IMG_INFO *image;
+        uint64_t bytesRead;
+        uint64_t failedReads;
+    };
+
+    /**
+     * Replays the reads with the given cache size and number of threads and
+     * prints the throughput.
+     */
+    void replay(const std::string &order, const std::vector<std::string> &imageFiles, const std::vector<ReadTrace::Record> &reads,
+        unsigned int cacheMegabytes, unsigned int threadCount)
+    {
+        std::auto_ptr<BlockCache> cache;
+        if (cacheMegabytes > 0)
+        {
+            cache.reset(new BlockCache(static_cast<uint64_t>(cacheMegabytes) * 1024 * 1024 / CACHE_BLOCK_SIZE));
+        }
+
+        size_t nextRead = 0;
+        Poco::FastMutex nextReadLock;
+        std::vector<ReplayWorker*> workers;
+        std::vector<Poco::Thread*> threads;
+        uint64_t bytesRead = 0;
+        uint64_t failedReads = 0;
+        Poco::Timestamp::TimeDiff elapsed = 0;
+        try
+        {
+            for (unsigned int i = 0; i < threadCount; ++i)
+            {
+                workers.push_back(new ReplayWorker(imageFiles, reads, nextRead, nextReadLock, cache.get()));
+                threads.push_back(new Poco::Thread());
+            }
+
+            Poco::Timestamp start;
+            for (unsigned int i = 0; i < threadCount; ++i)
+            {
+                threads[i]->start(*workers[i]);
+            }
+            for (unsigned int i = 0; i < threadCount; ++i)
+            {
+                threads[i]->join();
+                bytesRead += workers[i]->getBytesRead();
+                failedReads += workers[i]->getFailedReads();
+            }
+            elapsed = start.elapsed();
+        }
+        catch (...)
+        {
+            for (size_t i = 0; i < workers.size(); ++i)
+            {
+                delete threads[i];
+                delete workers[i];
+            }
+            throw;
+        }
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            delete threads[i];
+            delete workers[i];
+        }
+
+        double seconds = static_cast<double>(elapsed) / 1000000.0;
+        std::cout << order << "\t" << cacheMegabytes << "\t" << threadCount << "\t" << bytesRead << "\t"
+                  << Poco::NumberFormatter::format(seconds, 3) << "\t"
+                  << Poco::NumberFormatter::format(seconds > 0 ? static_cast<double>(bytesRead) / (1024 * 1024) / seconds : 0.0, 1);
+        if (cache.get() != NULL)
+        {
+            uint64_t lookups = cache->getHits() + cache->getMisses();
+            std::cout << "\t" << Poco::NumberFormatter::format(lookups > 0 ? 100.0 * static_cast<double>(cache->getHits()) / static_cast<double>(lookups) : 0.0, 1);
+        }
+        else
+        {
+            std::cout << "\t-";
+        }
+        std::cout << "\t" << failedReads << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> orders;
+    std::vector<unsigned int> cacheSizes(1, 0);
+    std::vector<unsigned int> threadCounts(1, 1);
+    std::vector<std::string> imageFiles;
+    std::string tracePath;
+
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if ((arg == "-o" || arg == "-c" || arg == "-t" || arg == "-i") && i + 1 < argc)
+            {
+                std::string value = argv[++i];
+                if (arg == "-o")
+                {
+                    Poco::StringTokenizer tokenizer(value, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+                    orders.assign(tokenizer.begin(), tokenizer.end());
+                }
+                else if (arg == "-c")
+                {
+                    cacheSizes = parseList(value);
+                }
+                else if (arg == "-t")
+                {
+                    threadCounts = parseList(value);
+                }
+                else
+                {
+                    imageFiles.push_back(value);
+                }
+            }
+            else if (tracePath.empty() && !arg.empty() && arg[0] != '-')
+            {
+                tracePath = arg;
+            }
+            else
+            {
+                usage();
+                return 1;
+            }
+        }
+    }
+    catch (Poco::SyntaxException &ex)
+    {
+        std::cerr << ex.displayText() << std::endl;
+        usage();
+        return 1;
+    }
+
+    if (tracePath.empty() || cacheSizes.empty() || threadCounts.empty() || std::find(threadCounts.begin(), threadCounts.end(), 0U) != threadCounts.end())
+    {
+        usage();
+        return 1;
+    }
+    if (orders.empty())
+    {
+        orders.push_back("recorded");
+        orders.push_back("offset");
+        orders.push_back("file");
+    }
+    for (std::vector<std::string>::const_iterator order = orders.begin(); order != orders.end(); ++order)
+    {
+        if (*order != "recorded" && *order != "offset" && *order != "file")
+        {
+            std::cerr << "Unknown order: " << *order << std::endl;
+            usage();
+            return 1;
+        }
+    }
+
+    try
+    {
+        Poco::FileInputStream stream(tracePath, std::ios::in | std::ios::binary);
+        ReadTrace::Reader reader(stream);
+        if (!reader.isValid())
+        {
+            std::cerr << tracePath << " is not a read trace" << std::endl;
+            return 1;
+        }
+        if (imageFiles.empty())
+        {
+            imageFiles = reader.getImages();
+        }
+        if (imageFiles.empty())
+        {
+            std::cerr << "The trace does not name its image files; give them with -i" << std::endl;
+            return 1;
+        }
+
+        std::vector<ReadTrace::Record> reads;
+        uint64_t unmappedReads = 0;
+        uint64_t recordedBytes = 0;
+        uint64_t recordedDuration = 0;
+        ReadTrace::Record record;
+        while (reader.read(record))
+        {
+            recordedDuration = record.timestamp;
+            if (!record.mapped)
+            {
+                ++unmappedReads;
+                continue;
+            }
+            reads.push_back(record);
+            recordedBytes += record.length;
+        }
+
+        std::cout << "Trace: " << reads.size() << " reads of " << recordedBytes << " bytes over "
+                  << Poco::NumberFormatter::format(static_cast<double>(recordedDuration) / 1000000.0, 3) << " s; "
+                  << unmappedReads << " reads without image offsets not replayed" << std::endl;
+        std::cout << "order\tcache_mb\tthreads\tbytes\tseconds\tmb_per_s\tcache_hit_pct\tfailed_reads" << std::endl;
+
+        for (std::vector<std::string>::const_iterator order = orders.begin(); order != orders.end(); ++order)
+        {
+            std::vector<ReadTrace::Record> orderedReads(reads);
+            if (*order == "offset")
+            {
+                std::stable_sort(orderedReads.begin(), orderedReads.end(), hasLowerOffset);
+            }
+            else if (*order == "file")
+            {
+                orderByFile(orderedReads);
+            }
+
+            for (std::vector<unsigned int>::const_iterator cacheSize = cacheSizes.begin(); cacheSize != cacheSizes.end(); ++cacheSize)
+            {
+                for (std::vector<unsigned int>::const_iterator threadCount = threadCounts.begin(); threadCount != threadCounts.end(); ++threadCount)
+                {
+                    replay(*order, imageFiles, orderedReads, *cacheSize, *threadCount);
+                }
+            }
+        }
+    }
+    catch (Poco::Exception &ex)
+    {
+        std::cerr << ex.displayText() << std::endl;
+        return 1;
+    }
+    catch (std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
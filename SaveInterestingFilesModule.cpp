@@ -15,13 +15,28 @@
 
 // Framework includes
 #include "TskModuleDev.h"
+#include "tsk3/libtsk.h"
+#include "tsk3/auto/sqlite3.h"
 
 // Poco includes
 #include "Poco/Path.h"
 #include "Poco/File.h"
 #include "Poco/FileStream.h"
+#include "Poco/NumberFormatter.h"
+#include "Poco/Process.h"
 #include "Poco/Exception.h"
+#include "Poco/String.h"
+#include "Poco/StringTokenizer.h"
+#include "Poco/Timestamp.h"
+#include "Poco/Mutex.h"
+#include "Poco/Event.h"
+#include "Poco/Condition.h"
+#include "Poco/Thread.h"
+#include "Poco/Runnable.h"
+#include "Poco/Notification.h"
+#include "Poco/NotificationQueue.h"
 #include "Poco/XML/XMLWriter.h"
+#include "Poco/SAX/AttributesImpl.h"
 #include "Poco/DOM/AutoPtr.h"
 #include "Poco/DOM/Document.h"
 #include "Poco/DOM/Element.h"
@@ -30,183 +45,7178 @@
 #include "Poco/DOM/Text.h"
 #include "Poco/DOM/Text.h"
 #include "Poco/DOM/DOMException.h"
+#include "Poco/DOM/DOMParser.h"
+#include "Poco/DOM/NodeList.h"
+#include "Poco/Glob.h"
+#include "Poco/SharedPtr.h"
+#include "Poco/NumberParser.h"
+#include "Poco/Environment.h"
+
+// Module includes
+#include "ReadTrace.h"
+#include "SquashfsImage.h"
+#include "ArrowIpc.h"
+#include "ChunkStore.h"
 
 // System includes
 #include <string>
 #include <sstream>
 #include <vector>
+#include <list>
 #include <set>
 #include <map>
+#include <deque>
+#include <memory>
 #include <iostream>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <ctime>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <linux/fs.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+    const char *MODULE_NAME = "SaveInterestingFilesModule";
+    const char *MODULE_DESCRIPTION = "Saves files and directories that were flagged as being interesting to a location for further analysis";
+    const char *MODULE_VERSION = "1.1.0";
+
+    typedef std::map<std::string, std::string> FileSets; 
+    typedef std::multimap<std::string, TskBlackboardArtifact> FileSetHits;
+    typedef std::pair<FileSetHits::iterator, FileSetHits::iterator> FileSetHitsRange; 
+
+    std::string outputFolderPath;
+
+    /**
+     * Optional module settings, parsed from the arguments passed to initialize().
+     */
+    struct Options
+    {
+        enum ImageDbIndexMode
+        {
+            IMAGE_DB_INDEXES_OFF,
+            IMAGE_DB_INDEXES_CHECK,
+            IMAGE_DB_INDEXES_CREATE
+        };
+
+        Options() : perfCounters(false), saveSlack(false), minFreeSpace(0), stagingHighWater(0), replica(false), extentCopy(false), 
+            readWorkers(0), readAheadBytes(256 * 1024 * 1024), hardLinks(true), squashfsImages(false), 
+            compressWorkers(Poco::Environment::processorCount()), subsetImage(false), manifest(false), 
+            consolidateMaxFiles(0), imageDbIndexes(IMAGE_DB_INDEXES_CHECK), 
+            ioPressureThreshold(0), memoryPressureThreshold(0), cpuPressureThreshold(0), chunkDedupMinSize(0), 
+            chunkSize(Chunking::DEFAULT_AVERAGE_CHUNK_SIZE), publish(false), outliers(0), cacheFirst(false), 
+            decompressWorkers(0) {}
+
+        // Sample hardware and software performance counters around each phase of report().
+        bool perfCounters;
+
+        // Path of an XML file of per-set include/exclude filters, empty for none.
+        std::string filtersPath;
+
+        // Save the slack space after each saved file to <saved file path>.slack.
+        bool saveSlack;
+
+        // Free space to leave on the output volume when admitting a set for export.
+        uint64_t minFreeSpace;
+
+        // Folder to save sets that do not fit in the output folder to, empty for none.
+        std::string overflowFolderPath;
+
+        // Fast folder to save sets to before they are moved to the output folder in the background, empty for none.
+        std::string stagingFolderPath;
+
+        // Most bytes of sets waiting in the staging folder to be moved, 0 for 90% of the staging volume's free space.
+        uint64_t stagingHighWater;
+
+        // Path of a file to record the evidence reads of report() to, empty for none.
+        std::string readTracePath;
+
+        // Load the file records into memory at the start of report() and answer metadata queries from them.
+        bool replica;
+
+        // Copy the content of files straight from raw image files, inside the kernel, where possible.
+        bool extentCopy;
+
+        // Number of threads reading (and for compressed images, inflating) image blocks ahead of the export, 0 for none.
+        unsigned int readWorkers;
+
+        // Most bytes of image blocks to read ahead of the export.
+        uint64_t readAheadBytes;
+
+        // Hard link files saved more than once in a run to their first copy, rather than copying them.
+        bool hardLinks;
+
+        // Save each set as a compressed SquashFS image, <set>/<set>.sqsh, rather than as a folder of files.
+        bool squashfsImages;
+
+        // Number of threads compressing the blocks of SquashFS images, 0 to compress on the report thread.
+        unsigned int compressWorkers;
+
+        // Write a sparse image of the evidence holding only the sectors of the interesting files and the file system
+        // metadata needed to parse them.
+        bool subsetImage;
+
+        // Write a columnar manifest of the saved files, SaveInterestingFilesModule_manifest.arrow.
+        bool manifest;
+
+        // Save sets of at most this many files and directories together, with a shared report, 0 for never.
+        unsigned int consolidateMaxFiles;
+
+        // Whether to check, at the start of report(), that the image database has the indexes the module's queries 
+        // need, and whether to create any that are missing.
+        ImageDbIndexMode imageDbIndexes;
+
+        // Percentages of the last 10 seconds that tasks on the host may be stalled on I/O, memory and CPU before the 
+        // export backs off, 0 to ignore the resource.
+        unsigned int ioPressureThreshold;
+        unsigned int memoryPressureThreshold;
+        unsigned int cpuPressureThreshold;
+
+        // Save files of at least this many bytes as content-defined chunks in a chunk store shared by the run, and a 
+        // recipe, 0 for never.
+        uint64_t chunkDedupMinSize;
+
+        // Average size of the chunks, a power of two.
+        size_t chunkSize;
+
+        // Make each set durable and write its completion marker as soon as it is complete.
+        bool publish;
+
+        // Number of slowest file saves and directory queries per set to write to the outlier report, 0 for none.
+        unsigned int outliers;
+
+        // On raw evidence, save the files of each set whose content is in the page cache before the others.
+        bool cacheFirst;
+
+        // Number of threads inflating the content of files compressed by their file system, 0 for none.
+        unsigned int decompressWorkers;
+    };
+
+    Options options;
+
+    bool parseBoolOption(const std::string &name, const std::string &value)
+    {
+        std::string lowerValue = Poco::toLower(value);
+        if (lowerValue == "true" || lowerValue == "yes" || lowerValue == "on" || lowerValue == "1")
+        {
+            return true;
+        }
+        if (lowerValue == "false" || lowerValue == "no" || lowerValue == "off" || lowerValue == "0")
+        {
+            return false;
+        }
+        throw Poco::InvalidArgumentException("invalid value '" + value + "' for option '" + name + "'");
+    }
+
+    /**
+     * Parses a byte count, optionally suffixed with K, M, G or T (powers of 1024).
+     */
+    uint64_t parseSizeOption(const std::string &name, const std::string &value)
+    {
+        std::string digits = value;
+        uint64_t multiplier = 1;
+        if (!digits.empty())
+        {
+            switch (toupper(digits[digits.size() - 1]))
+            {
+            case 'K':
+                multiplier = 1024ULL;
+                break;
+            case 'M':
+                multiplier = 1024ULL * 1024;
+                break;
+            case 'G':
+                multiplier = 1024ULL * 1024 * 1024;
+                break;
+            case 'T':
+                multiplier = 1024ULL * 1024 * 1024 * 1024;
+                break;
+            }
+            if (multiplier != 1)
+            {
+                digits.erase(digits.size() - 1);
+            }
+        }
+
+        Poco::UInt64 size = 0;
+        if (!Poco::NumberParser::tryParseUnsigned64(digits, size) || size > std::numeric_limits<uint64_t>::max() / multiplier)
+        {
+            throw Poco::InvalidArgumentException("invalid value '" + value + "' for option '" + name + "'");
+        }
+        return size * multiplier;
+    }
+
+    unsigned int parseCountOption(const std::string &name, const std::string &value)
+    {
+        unsigned int count = 0;
+        if (!Poco::NumberParser::tryParseUnsigned(value, count))
+        {
+            throw Poco::InvalidArgumentException("invalid value '" + value + "' for option '" + name + "'");
+        }
+        return count;
+    }
+
+    /**
+     * Parses the module arguments. Arguments without an '=' are the output
+     * folder path, as given. Otherwise they are a semicolon-separated list 
+     * consisting of an optional output folder path and any number of 
+     * <name>=<value> options, e.g. "C:\out;perfcounters=true". The output
+     * folder path may instead be given as a last out=<path> option, whose 
+     * value is the rest of the arguments, so that it may contain ';' and '='.
+     *
+     * @param arguments The arguments passed to initialize().
+     * @param outputPath Receives the output folder path, empty if none was given.
+     */
+    void parseArguments(const std::string &arguments, std::string &outputPath)
+    {
+        options = Options();
+        outputPath.clear();
+
+        if (arguments.find('=') == std::string::npos)
+        {
+            outputPath = arguments;
+            return;
+        }
+
+        std::string::size_type start = 0;
+        while (start < arguments.size())
+        {
+            std::string::size_type end = arguments.find(';', start);
+            if (end == std::string::npos)
+            {
+                end = arguments.size();
+            }
+            const std::string::size_type tokenStart = start;
+            const std::string token = Poco::trim(arguments.substr(start, end - start));
+            start = end + 1;
+            if (token.empty())
+            {
+                continue;
+            }
+
+            std::string::size_type pos = token.find('=');
+            if (pos == std::string::npos)
+            {
+                if (!outputPath.empty())
+                {
+                    throw Poco::InvalidArgumentException("more than one output folder path given: '" + token + "'");
+                }
+                outputPath = token;
+                continue;
+            }
+
+            std::string name = Poco::toLower(Poco::trim(token.substr(0, pos)));
+            if (name == "out")
+            {
+                if (!outputPath.empty())
+                {
+                    throw Poco::InvalidArgumentException("more than one output folder path given: '" + token + "'");
+                }
+                outputPath = Poco::trim(arguments.substr(arguments.find('=', tokenStart) + 1));
+                break;
+            }
+
+            std::string value = Poco::trim(token.substr(pos + 1));
+            if (name == "perfcounters")
+            {
+                options.perfCounters = parseBoolOption(name, value);
+            }
+            else if (name == "filters")
+            {
+                options.filtersPath = value;
+            }
+            else if (name == "saveslack")
+            {
+                options.saveSlack = parseBoolOption(name, value);
+            }
+            else if (name == "minfreespace")
+            {
+                options.minFreeSpace = parseSizeOption(name, value);
+            }
+            else if (name == "overflow")
+            {
+                options.overflowFolderPath = Poco::Path::forDirectory(value).toString();
+            }
+            else if (name == "staging")
+            {
+                options.stagingFolderPath = Poco::Path::forDirectory(value).toString();
+            }
+            else if (name == "staginghighwater")
+            {
+                options.stagingHighWater = parseSizeOption(name, value);
+            }
+            else if (name == "readtrace")
+            {
+                options.readTracePath = value;
+            }
+            else if (name == "replica")
+            {
+                options.replica = parseBoolOption(name, value);
+            }
+            else if (name == "extentcopy")
+            {
+                options.extentCopy = parseBoolOption(name, value);
+            }
+            else if (name == "readworkers")
+            {
+                options.readWorkers = parseCountOption(name, value);
+            }
+            else if (name == "readahead")
+            {
+                options.readAheadBytes = parseSizeOption(name, value);
+            }
+            else if (name == "hardlinks")
+            {
+                options.hardLinks = parseBoolOption(name, value);
+            }
+            else if (name == "format")
+            {
+                std::string lowerValue = Poco::toLower(value);
+                if (lowerValue != "files" && lowerValue != "squashfs")
+                {
+                    throw Poco::InvalidArgumentException("invalid value '" + value + "' for option '" + name + "'");
+                }
+                options.squashfsImages = lowerValue == "squashfs";
+            }
+            else if (name == "compressworkers")
+            {
+                options.compressWorkers = parseCountOption(name, value);
+            }
+            else if (name == "decompressworkers")
+            {
+                options.decompressWorkers = parseCountOption(name, value);
+            }
+            else if (name == "subsetimage")
+            {
+                options.subsetImage = parseBoolOption(name, value);
+            }
+            else if (name == "manifest")
+            {
+                options.manifest = parseBoolOption(name, value);
+            }
+            else if (name == "consolidate")
+            {
+                options.consolidateMaxFiles = parseCountOption(name, value);
+            }
+            else if (name == "iopressure")
+            {
+                options.ioPressureThreshold = parseCountOption(name, value);
+            }
+            else if (name == "memorypressure")
+            {
+                options.memoryPressureThreshold = parseCountOption(name, value);
+            }
+            else if (name == "cpupressure")
+            {
+                options.cpuPressureThreshold = parseCountOption(name, value);
+            }
+            else if (name == "chunkdedup")
+            {
+                options.chunkDedupMinSize = parseSizeOption(name, value);
+            }
+            else if (name == "chunksize")
+            {
+                uint64_t chunkSize = parseSizeOption(name, value);
+                if (chunkSize < 64 || chunkSize > 64 * 1024 * 1024 || (chunkSize & (chunkSize - 1)) != 0)
+                {
+                    throw Poco::InvalidArgumentException("invalid value '" + value + "' for option '" + name + "', must be a power of two from 64 to 64M");
+                }
+                options.chunkSize = static_cast<size_t>(chunkSize);
+            }
+            else if (name == "cachefirst")
+            {
+                options.cacheFirst = parseBoolOption(name, value);
+            }
+            else if (name == "outliers")
+            {
+                options.outliers = parseCountOption(name, value);
+            }
+            else if (name == "publish")
+            {
+                options.publish = parseBoolOption(name, value);
+            }
+            else if (name == "dbindexes")
+            {
+                std::string lowerValue = Poco::toLower(value);
+                if (lowerValue == "off")
+                {
+                    options.imageDbIndexes = Options::IMAGE_DB_INDEXES_OFF;
+                }
+                else if (lowerValue == "check")
+                {
+                    options.imageDbIndexes = Options::IMAGE_DB_INDEXES_CHECK;
+                }
+                else if (lowerValue == "create")
+                {
+                    options.imageDbIndexes = Options::IMAGE_DB_INDEXES_CREATE;
+                }
+                else
+                {
+                    throw Poco::InvalidArgumentException("invalid value '" + value + "' for option '" + name + "'");
+                }
+            }
+            else
+            {
+                throw Poco::InvalidArgumentException("unrecognized option '" + name + "'");
+            }
+        }
+    }
+
+    /**
+     * Hardware and software performance counters for the calling thread. On 
+     * Linux the counters are read via perf_event_open(2). Elsewhere, or when
+     * the kernel refuses an event (e.g., in a virtual machine or because of the
+     * perf_event_paranoid setting), the counter is reported as unavailable and
+     * reads as zero.
+     */
+    class PerfCounters
+    {
+    public:
+        enum Counter
+        {
+            CYCLES,
+            INSTRUCTIONS,
+            LLC_MISSES,
+            CONTEXT_SWITCHES,
+            PAGE_FAULTS,
+            NUM_COUNTERS
+        };
+
+        struct Sample
+        {
+            Sample() { memset(values, 0, sizeof(values)); }
+            uint64_t values[NUM_COUNTERS];
+        };
+
+        PerfCounters()
+        {
+            for (int i = 0; i < NUM_COUNTERS; ++i)
+            {
+                fds[i] = -1;
+            }
+        }
+
+        ~PerfCounters()
+        {
+            close();
+        }
+
+        /**
+         * Starts counting for the calling thread. Must be called on the thread 
+         * that is to be measured.
+         */
+        void open()
+        {
+            close();
+#if defined(__linux__)
+            fds[CYCLES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+            fds[INSTRUCTIONS] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+            fds[LLC_MISSES] = openEvent(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+            fds[CONTEXT_SWITCHES] = openEvent(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+            fds[PAGE_FAULTS] = openEvent(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+#endif
+        }
+
+        void close()
+        {
+            for (int i = 0; i < NUM_COUNTERS; ++i)
+            {
+#if defined(__linux__)
+                if (fds[i] != -1)
+                {
+                    ::close(fds[i]);
+                }
+#endif
+                fds[i] = -1;
+            }
+        }
+
+        bool isAvailable(Counter counter) const
+        {
+            return fds[counter] != -1;
+        }
+
+        void read(Sample &sample) const
+        {
+            for (int i = 0; i < NUM_COUNTERS; ++i)
+            {
+                sample.values[i] = readEvent(fds[i]);
+            }
+        }
+
+        static const char *counterName(int counter)
+        {
+            static const char *NAMES[NUM_COUNTERS] = { "cycles", "instructions", "LLC misses", "context switches", "page faults" };
+            return NAMES[counter];
+        }
+
+    private:
+        PerfCounters(const PerfCounters &);
+        PerfCounters &operator=(const PerfCounters &);
+
+#if defined(__linux__)
+        static int openEvent(uint32_t type, uint64_t config)
+        {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            // Count kernel time too if permitted, since much of the work of an export happens in the kernel.
+            int fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fd == -1)
+            {
+                attr.exclude_kernel = 1;
+                fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            }
+            return fd;
+        }
+#endif
+
+        static uint64_t readEvent(int fd)
+        {
+#if defined(__linux__)
+            if (fd != -1)
+            {
+                // Scale the raw count up if the kernel had to multiplex the counter.
+                uint64_t data[3];
+                if (::read(fd, data, sizeof(data)) == sizeof(data) && data[2] != 0)
+                {
+                    return data[2] == data[1] ? data[0] : static_cast<uint64_t>(static_cast<double>(data[0]) * data[1] / data[2]);
+                }
+            }
+#endif
+            return 0;
+        }
+
+        int fds[NUM_COUNTERS];
+    };
+
+    /**
+     * Wall clock time and performance counter deltas accumulated for a phase 
+     * of report() on a particular thread.
+     */
+    struct PhaseStatistics
+    {
+        PhaseStatistics() : count(0), elapsed(0) {}
+
+        unsigned long count;
+        Poco::Timestamp::TimeDiff elapsed;
+        PerfCounters::Sample counters;
+    };
+
+    // Keyed by "<thread>: <phase>".
+    typedef std::map<std::string, PhaseStatistics> PhaseStatisticsMap;
+
+    /**
+     * Statistics for a single run of report(), logged when the run completes.
+     */
+    struct RunStatistics
+    {
+        RunStatistics() : setsSaved(0), filesSaved(0), directoriesSaved(0), bytesSaved(0), filesExcluded(0), directoriesPruned(0), slackBytesSaved(0),
+            setsRerouted(0), setsDeferred(0), setsSkipped(0), setsStaged(0), filesFailed(0), filesExtentCopied(0), filesFannedOut(0),
+            imagesSaved(0), imageBytes(0), subsetImageBytes(0), setsConsolidated(0), 
+            pressureSamples(0), pressurePauses(0), filesChunked(0), chunksStored(0), 
+            chunkBytesStored(0), chunkBytesDeduplicated(0), setsPublished(0), 
+            filesCachedFirst(0), filesDecompressedInParallel(0)
+        {
+            for (int i = 0; i < PerfCounters::NUM_COUNTERS; ++i)
+            {
+                countersAvailable[i] = false;
+            }
+        }
+
+        unsigned long setsSaved;
+        unsigned long filesSaved;
+        unsigned long directoriesSaved;
+        uint64_t bytesSaved;
+        unsigned long filesExcluded;
+        unsigned long directoriesPruned;
+        uint64_t slackBytesSaved;
+        unsigned long setsRerouted;
+        unsigned long setsDeferred;
+        unsigned long setsSkipped;
+        unsigned long setsStaged;
+        unsigned long filesFailed;
+        unsigned long filesExtentCopied;
+        unsigned long filesFannedOut;
+        unsigned long imagesSaved;
+        uint64_t imageBytes;
+        uint64_t subsetImageBytes;
+        unsigned long setsConsolidated;
+        unsigned long pressureSamples;
+        unsigned long pressurePauses;
+        unsigned long filesChunked;
+        unsigned long chunksStored;
+        uint64_t chunkBytesStored;
+        uint64_t chunkBytesDeduplicated;
+        unsigned long setsPublished;
+        unsigned long filesCachedFirst;
+        unsigned long filesDecompressedInParallel;
+        PhaseStatisticsMap phases;
+        bool countersAvailable[PerfCounters::NUM_COUNTERS];
+    };
+
+    RunStatistics runStatistics;
+    Poco::FastMutex runStatisticsLock;
+
+    /**
+     * Accumulates the wall clock time and performance counter deltas between
+     * construction and destruction into the run statistics for a phase.
+     */
+    class PhaseTimer
+    {
+    public:
+        PhaseTimer(const std::string &thread, const std::string &phase, const PerfCounters &counters) 
+            : key(thread + ": " + phase), counters(counters)
+        {
+            if (options.perfCounters)
+            {
+                counters.read(start);
+            }
+        }
+
+        ~PhaseTimer()
+        {
+            Poco::Timestamp::TimeDiff elapsed = timer.elapsed();
+            PerfCounters::Sample end;
+            if (options.perfCounters)
+            {
+                counters.read(end);
+            }
+
+            Poco::ScopedLock<Poco::FastMutex> lock(runStatisticsLock);
+            PhaseStatistics &stats = runStatistics.phases[key];
+            ++stats.count;
+            stats.elapsed += elapsed;
+            for (int i = 0; i < PerfCounters::NUM_COUNTERS; ++i)
+            {
+                stats.counters.values[i] += end.values[i] - start.values[i];
+            }
+        }
+
+    private:
+        PhaseTimer(const PhaseTimer &);
+        PhaseTimer &operator=(const PhaseTimer &);
+
+        std::string key;
+        const PerfCounters &counters;
+        PerfCounters::Sample start;
+        Poco::Timestamp timer;
+    };
+
+    void logRunStatistics()
+    {
+        std::stringstream msg;
+        msg << "SaveInterestingFilesModule::report : saved " << runStatistics.filesSaved << " files and " << runStatistics.directoriesSaved 
+            << " directories (" << runStatistics.bytesSaved << " bytes) from " << runStatistics.setsSaved << " interesting file sets";
+        if (runStatistics.filesFailed != 0)
+        {
+            msg << ", " << runStatistics.filesFailed << " files could not be saved";
+        }
+        if (runStatistics.slackBytesSaved != 0)
+        {
+            msg << ", plus " << runStatistics.slackBytesSaved << " bytes of slack";
+        }
+        if (runStatistics.filesCachedFirst != 0)
+        {
+            msg << ", " << runStatistics.filesCachedFirst << " files were saved first because their content was in the page cache";
+        }
+        if (runStatistics.filesExtentCopied != 0)
+        {
+            msg << ", " << runStatistics.filesExtentCopied << " files were copied straight from the image files";
+        }
+        if (runStatistics.filesDecompressedInParallel != 0)
+        {
+            msg << ", " << runStatistics.filesDecompressedInParallel << " compressed files were inflated in parallel";
+        }
+        if (runStatistics.filesFannedOut != 0)
+        {
+            msg << ", " << runStatistics.filesFannedOut << " files were linked or copied from a copy saved earlier instead of being read again";
+        }
+        if (runStatistics.filesChunked != 0)
+        {
+            msg << ", " << runStatistics.filesChunked << " files were saved as chunk recipes, storing " << runStatistics.chunksStored 
+                << " new chunks (" << runStatistics.chunkBytesStored << " bytes) and deduplicating " << runStatistics.chunkBytesDeduplicated 
+                << " bytes";
+        }
+        if (runStatistics.imagesSaved != 0)
+        {
+            msg << ", " << runStatistics.imagesSaved << " sets were saved as SquashFS images totalling " << runStatistics.imageBytes << " bytes";
+        }
+        if (runStatistics.subsetImageBytes != 0)
+        {
+            msg << ", " << runStatistics.subsetImageBytes << " bytes of the evidence were written to the subset image";
+        }
+        if (runStatistics.filesExcluded != 0 || runStatistics.directoriesPruned != 0)
+        {
+            msg << ", filters excluded " << runStatistics.filesExcluded << " files and " << runStatistics.directoriesPruned << " directories";
+        }
+        if (runStatistics.setsConsolidated != 0)
+        {
+            msg << ", " << runStatistics.setsConsolidated << " small sets were saved together with a shared report";
+        }
+        if (runStatistics.pressureSamples != 0)
+        {
+            msg << ", the export backed off for " << runStatistics.pressureSamples << " seconds of host pressure, pausing " 
+                << runStatistics.pressurePauses << " times";
+        }
+        if (runStatistics.setsPublished != 0)
+        {
+            msg << ", " << runStatistics.setsPublished << " sets were published as they completed";
+        }
+        if (runStatistics.setsStaged != 0)
+        {
+            msg << ", " << runStatistics.setsStaged << " sets were staged";
+        }
+        if (runStatistics.setsDeferred != 0 || runStatistics.setsRerouted != 0 || runStatistics.setsSkipped != 0)
+        {
+            msg << ", for lack of space " << runStatistics.setsDeferred << " sets were deferred, " << runStatistics.setsRerouted 
+                << " rerouted to the overflow folder and " << runStatistics.setsSkipped << " skipped";
+        }
+        LOGINFO(msg.str());
+
+        for (PhaseStatisticsMap::const_iterator phase = runStatistics.phases.begin(); phase != runStatistics.phases.end(); ++phase)
+        {
+            std::stringstream phaseMsg;
+            phaseMsg << "SaveInterestingFilesModule::report : " << (*phase).first << ": " << (*phase).second.count << " calls, " 
+                     << (*phase).second.elapsed / 1000 << " ms";
+            if (options.perfCounters)
+            {
+                for (int i = 0; i < PerfCounters::NUM_COUNTERS; ++i)
+                {
+                    phaseMsg << ", " << PerfCounters::counterName(i) << " ";
+                    if (runStatistics.countersAvailable[i])
+                    {
+                        phaseMsg << (*phase).second.counters.values[i];
+                    }
+                    else
+                    {
+                        phaseMsg << "n/a";
+                    }
+                }
+            }
+            LOGINFO(phaseMsg.str());
+        }
+    }
+
+    // Minimum interval, in microseconds, between summaries of the errors of a run in the framework log.
+    const Poco::Timestamp::TimeDiff ERROR_SUMMARY_INTERVAL = 30 * 1000000;
+
+    // Number of example messages kept per error category for each summary.
+    const size_t ERROR_EXAMPLES_PER_SUMMARY = 3;
+
+    /**
+     * A line for the error detail file.
+     */
+    class ErrorDetailNotification : public Poco::Notification
+    {
+    public:
+        explicit ErrorDetailNotification(const std::string &line) : line(line) {}
+
+        std::string line;
+    };
+
+    /**
+     * Aggregates the errors for individual files and artifacts during a run,
+     * so that the framework log gets periodic per-category summaries (a count
+     * and a few examples) rather than a line per error. Every error is also
+     * written in full, as a tab-separated line, to an error detail file by a
+     * background thread so that the caller never waits on the file.
+     */
+    class ErrorLog : public Poco::Runnable
+    {
+    public:
+        ErrorLog() : errorCount(0), running(false) {}
+
+        /**
+         * Starts a run. The detail file is only created if there are errors.
+         */
+        void open(const std::string &path)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            detailPath = path;
+            errorCount = 0;
+            categories.clear();
+            lastSummary.update();
+        }
+
+        /**
+         * Records an error.
+         *
+         * @param category A short, fixed description of the kind of error.
+         * @param subject The set, file or artifact the error concerns.
+         * @param message The details of the error.
+         */
+        void error(const std::string &category, const std::string &subject, const std::string &message)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            ++errorCount;
+            CategoryStatistics &stats = categories[category];
+            ++stats.count;
+            if (stats.examples.size() < ERROR_EXAMPLES_PER_SUMMARY)
+            {
+                stats.examples.push_back(subject + ": " + message);
+            }
+
+            if (!running)
+            {
+                thread.start(*this);
+                running = true;
+            }
+            Poco::Timestamp now;
+            std::stringstream line;
+            line << now.epochMicroseconds() << '\t' << category << '\t' << subject << '\t' << message;
+            queue.enqueueNotification(new ErrorDetailNotification(line.str()));
+
+            if (lastSummary.isElapsed(ERROR_SUMMARY_INTERVAL))
+            {
+                logSummary();
+            }
+        }
+
+        /**
+         * Logs a final summary and waits for the error details to be written.
+         *
+         * @return The number of errors in the run.
+         */
+        unsigned long close()
+        {
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                logSummary();
+            }
+
+            if (running)
+            {
+                queue.enqueueNotification(new ErrorDetailNotification(""));
+                thread.join();
+                running = false;
+            }
+            return errorCount;
+        }
+
+        virtual void run()
+        {
+            PerfCounters counters;
+            if (options.perfCounters)
+            {
+                counters.open();
+            }
+
+            Poco::FileOutputStream detailFile(detailPath, std::ios::out | std::ios::app);
+            detailFile << "# time (us since epoch)\tcategory\tsubject\tmessage\n";
+            for (;;)
+            {
+                Poco::AutoPtr<Poco::Notification> notification(queue.waitDequeueNotification());
+                ErrorDetailNotification *detail = dynamic_cast<ErrorDetailNotification*>(notification.get());
+                if (detail == NULL || detail->line.empty())
+                {
+                    break;
+                }
+                PhaseTimer timer("error writer", "write error details", counters);
+                detailFile << detail->line << '\n';
+            }
+            detailFile.close();
+        }
+
+    private:
+        struct CategoryStatistics
+        {
+            CategoryStatistics() : count(0) {}
+
+            unsigned long count;
+            std::vector<std::string> examples;
+        };
+
+        // Must be called with the mutex locked.
+        void logSummary()
+        {
+            for (std::map<std::string, CategoryStatistics>::const_iterator category = categories.begin(); category != categories.end(); ++category)
+            {
+                std::stringstream msg;
+                msg << "SaveInterestingFilesModule::report : " << (*category).second.count << " x " << (*category).first << ", e.g. ";
+                for (std::vector<std::string>::const_iterator example = (*category).second.examples.begin(); example != (*category).second.examples.end(); ++example)
+                {
+                    msg << (example == (*category).second.examples.begin() ? "" : "; ") << *example;
+                }
+                msg << " (all errors are listed in " << detailPath << ")";
+                LOGERROR(msg.str());
+            }
+            categories.clear();
+            lastSummary.update();
+        }
+
+        Poco::FastMutex mutex;
+        std::string detailPath;
+        unsigned long errorCount;
+        std::map<std::string, CategoryStatistics> categories;
+        Poco::Timestamp lastSummary;
+        Poco::NotificationQueue queue;
+        Poco::Thread thread;
+        bool running;
+    };
+
+    ErrorLog errorLog;
+
+    /**
+     * A case-insensitive matcher for a list of file name globs. The patterns
+     * are compiled into the cheapest applicable form when added: exact names
+     * and "*.<ext>" patterns become set lookups and "<prefix>*" patterns 
+     * become prefix comparisons, so that only the remaining general patterns
+     * need to be run through Poco::Glob for each name.
+     */
+    class NamePatterns
+    {
+    public:
+        void add(const std::string &pattern)
+        {
+            std::string lowerPattern = Poco::toLower(pattern);
+            std::string::size_type firstWildcard = lowerPattern.find_first_of(WILDCARDS);
+            if (firstWildcard == std::string::npos)
+            {
+                exactNames.insert(lowerPattern);
+            }
+            else if (lowerPattern.compare(0, 2, "*.") == 0 && lowerPattern.find_first_of(WILDCARDS, 1) == std::string::npos && 
+                lowerPattern.find('.', 2) == std::string::npos)
+            {
+                // Only single extensions are looked up by the text after the last '.', so *.tar.gz is matched as a glob.
+                extensions.insert(lowerPattern.substr(2));
+            }
+            else if (firstWildcard == lowerPattern.size() - 1 && lowerPattern[firstWildcard] == '*')
+            {
+                prefixes.push_back(lowerPattern.substr(0, firstWildcard));
+            }
+            else
+            {
+                globs.push_back(new Poco::Glob(lowerPattern));
+            }
+        }
+
+        void addExtension(const std::string &extension)
+        {
+            std::string lowerExtension = Poco::toLower(extension);
+            if (!lowerExtension.empty() && lowerExtension[0] == '.')
+            {
+                lowerExtension.erase(0, 1);
+            }
+            if (lowerExtension.find('.') == std::string::npos)
+            {
+                extensions.insert(lowerExtension);
+            }
+            else
+            {
+                suffixes.push_back("." + lowerExtension);
+            }
+        }
+
+        bool empty() const
+        {
+            return exactNames.empty() && extensions.empty() && suffixes.empty() && prefixes.empty() && globs.empty();
+        }
+
+        bool matches(const std::string &name) const
+        {
+            std::string lowerName = Poco::toLower(name);
+            if (exactNames.count(lowerName) != 0)
+            {
+                return true;
+            }
+
+            std::string::size_type pos = lowerName.rfind('.');
+            if (pos != std::string::npos && !extensions.empty() && extensions.count(lowerName.substr(pos + 1)) != 0)
+            {
+                return true;
+            }
+
+            for (std::vector<std::string>::const_iterator suffix = suffixes.begin(); suffix != suffixes.end(); ++suffix)
+            {
+                if (lowerName.size() > (*suffix).size() && lowerName.compare(lowerName.size() - (*suffix).size(), (*suffix).size(), *suffix) == 0)
+                {
+                    return true;
+                }
+            }
+
+            for (std::vector<std::string>::const_iterator prefix = prefixes.begin(); prefix != prefixes.end(); ++prefix)
+            {
+                if (lowerName.compare(0, (*prefix).size(), *prefix) == 0)
+                {
+                    return true;
+                }
+            }
+
+            for (std::vector<Poco::SharedPtr<Poco::Glob> >::const_iterator glob = globs.begin(); glob != globs.end(); ++glob)
+            {
+                if ((*glob)->match(lowerName))
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+    private:
+        static const char *WILDCARDS;
+
+        std::set<std::string> exactNames;
+        std::set<std::string> extensions;
+
+        // Extensions with more than one part, e.g. ".tar.gz", matched against the end of the name.
+        std::vector<std::string> suffixes;
+
+        std::vector<std::string> prefixes;
+
+        // Shared, since filters are copied and Poco::Glob cannot be.
+        std::vector<Poco::SharedPtr<Poco::Glob> > globs;
+    };
+
+    const char *NamePatterns::WILDCARDS = "*?[\\";
+
+    /**
+     * The file system metadata a FileFilter is evaluated against. It can be 
+     * filled in from a file record, so that files can be filtered out before
+     * any TskFile is created for them.
+     */
+    struct FileMetadata
+    {
+        explicit FileMetadata(const TskFileRecord &fileRec)
+            : name(fileRec.name), 
+              isDirectory(fileRec.metaType == TSK_FS_META_TYPE_DIR),
+              size(fileRec.size),
+              isDeleted((fileRec.dirFlags & TSK_FS_NAME_FLAG_UNALLOC) != 0),
+              isUnallocated((fileRec.metaFlags & TSK_FS_META_FLAG_UNALLOC) != 0)
+        {
+        }
+
+        explicit FileMetadata(const TskFile &file)
+            : name(file.getName()), 
+              isDirectory(file.getMetaType() == TSK_FS_META_TYPE_DIR),
+              size(file.getSize()),
+              isDeleted((file.getDirFlags() & TSK_FS_NAME_FLAG_UNALLOC) != 0),
+              isUnallocated((file.getMetaFlags() & TSK_FS_META_FLAG_UNALLOC) != 0)
+        {
+        }
+
+        std::string name;
+        bool isDirectory;
+        TSK_OFF_T size;
+        bool isDeleted;
+        bool isUnallocated;
+    };
+
+    /**
+     * Include/exclude rules for the files saved for an interesting file set.
+     * Exclusions by name and by deleted/unallocated status apply to both files
+     * and directories; an excluded directory is pruned along with everything
+     * under it. Inclusions by name and the size range apply to files only.
+     */
+    class FileFilter
+    {
+    public:
+        FileFilter() : minSize(0), maxSize(-1), excludeDeleted(false), excludeUnallocated(false) {}
+
+        bool accepts(const FileMetadata &file) const
+        {
+            if ((excludeDeleted && file.isDeleted) || (excludeUnallocated && file.isUnallocated))
+            {
+                return false;
+            }
+
+            if (!excludes.empty() && excludes.matches(file.name))
+            {
+                return false;
+            }
+
+            if (file.isDirectory)
+            {
+                return true;
+            }
+
+            if (file.size < minSize || (maxSize >= 0 && file.size > maxSize))
+            {
+                return false;
+            }
+
+            return includes.empty() || includes.matches(file.name);
+        }
+
+        NamePatterns includes;
+        NamePatterns excludes;
+        TSK_OFF_T minSize;
+        TSK_OFF_T maxSize;
+        bool excludeDeleted;
+        bool excludeUnallocated;
+    };
+
+    typedef std::map<std::string, FileFilter> FileFilters;
+
+    // The filters for specific interesting file sets, and the filter for all other sets.
+    FileFilters fileFilters;
+    FileFilter defaultFileFilter;
+
+    // The path and modification time of the file the filters were loaded from, so that initialize() only reloads 
+    // them if they have changed.
+    std::string loadedFiltersPath;
+    Poco::Timestamp loadedFiltersModified;
+
+    const FileFilter &getFileFilter(const std::string &setName)
+    {
+        FileFilters::const_iterator filter = fileFilters.find(setName);
+        return filter != fileFilters.end() ? (*filter).second : defaultFileFilter;
+    }
+
+    /**
+     * Loads and compiles the per-set filters from an XML file of the form:
+     *
+     *  <SaveInterestingFilesFilters>
+     *      <Set name="Browser Artifacts">  <!-- name="*" for all other sets -->
+     *          <Include name="*.sqlite"/>
+     *          <Include extension="dat"/>
+     *          <Exclude name="Cache*"/>
+     *          <Size min="1" max="104857600"/>
+     *          <ExcludeDeleted/>
+     *          <ExcludeUnallocated/>
+     *      </Set>
+     *  </SaveInterestingFilesFilters>
+     */
+    void loadFileFilters(const std::string &path)
+    {
+        Poco::XML::DOMParser parser;
+        Poco::AutoPtr<Poco::XML::Document> filtersDoc = parser.parse(path);
+        Poco::AutoPtr<Poco::XML::NodeList> setElements = filtersDoc->getElementsByTagName("Set");
+        for (unsigned long i = 0; i < setElements->length(); ++i)
+        {
+            Poco::XML::Element *setElement = static_cast<Poco::XML::Element*>(setElements->item(i));
+            const std::string &setName = setElement->getAttribute("name");
+            FileFilter &filter = (setName == "*") ? defaultFileFilter : fileFilters[setName];
+
+            for (Poco::XML::Node *node = setElement->firstChild(); node != NULL; node = node->nextSibling())
+            {
+                if (node->nodeType() != Poco::XML::Node::ELEMENT_NODE)
+                {
+                    continue;
+                }
+
+                Poco::XML::Element *ruleElement = static_cast<Poco::XML::Element*>(node);
+                const std::string &rule = ruleElement->nodeName();
+                if (rule == "Include" || rule == "Exclude")
+                {
+                    NamePatterns &patterns = (rule == "Include") ? filter.includes : filter.excludes;
+                    if (ruleElement->hasAttribute("name"))
+                    {
+                        patterns.add(ruleElement->getAttribute("name"));
+                    }
+                    if (ruleElement->hasAttribute("extension"))
+                    {
+                        patterns.addExtension(ruleElement->getAttribute("extension"));
+                    }
+                }
+                else if (rule == "Size")
+                {
+                    if (ruleElement->hasAttribute("min"))
+                    {
+                        filter.minSize = Poco::NumberParser::parse64(ruleElement->getAttribute("min"));
+                    }
+                    if (ruleElement->hasAttribute("max"))
+                    {
+                        filter.maxSize = Poco::NumberParser::parse64(ruleElement->getAttribute("max"));
+                    }
+                }
+                else if (rule == "ExcludeDeleted")
+                {
+                    filter.excludeDeleted = true;
+                }
+                else if (rule == "ExcludeUnallocated")
+                {
+                    filter.excludeUnallocated = true;
+                }
+                else
+                {
+                    throw Poco::InvalidArgumentException("unrecognized filter rule '" + rule + "' in " + path);
+                }
+            }
+        }
+    }
+
+    /**
+     * A file type signature: the bytes a file of the type starts with, at the
+     * given offset.
+     */
+    struct FileSignature
+    {
+        size_t offset;
+        const char *magic;
+        size_t length;
+        const char *type;
+    };
+
+    // More specific signatures must precede less specific signatures that are prefixes of them.
+    const FileSignature FILE_SIGNATURES[] = 
+    {
+        { 0, "\x89PNG\r\n\x1a\n", 8, "image/png" },
+        { 0, "\xff\xd8\xff", 3, "image/jpeg" },
+        { 0, "GIF87a", 6, "image/gif" },
+        { 0, "GIF89a", 6, "image/gif" },
+        { 0, "II*\0", 4, "image/tiff" },
+        { 0, "MM\0*", 4, "image/tiff" },
+        { 0, "%PDF-", 5, "application/pdf" },
+        { 0, "{\\rtf", 5, "application/rtf" },
+        { 0, "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1", 8, "application/x-ole-storage" },
+        { 0, "PK\x03\x04", 4, "application/zip" },
+        { 0, "Rar!\x1a\x07", 6, "application/x-rar" },
+        { 0, "7z\xbc\xaf\x27\x1c", 6, "application/x-7z-compressed" },
+        { 0, "\x1f\x8b", 2, "application/gzip" },
+        { 0, "BZh", 3, "application/x-bzip2" },
+        { 0, "\xfd" "7zXZ\0", 6, "application/x-xz" },
+        { 257, "ustar", 5, "application/x-tar" },
+        { 0, "SQLite format 3\0", 16, "application/x-sqlite3" },
+        { 0, "regf", 4, "application/x-windows-registry" },
+        { 0, "ElfFile\0", 8, "application/x-windows-evtx" },
+        { 0, "!BDN", 4, "application/vnd.ms-outlook-pst" },
+        { 0, "L\0\0\0\x01\x14\x02\0", 8, "application/x-ms-shortcut" },
+        { 4, "SCCA", 4, "application/x-windows-prefetch" },
+        { 0, "MAM\x04", 4, "application/x-windows-prefetch" },
+        { 0, "MZ", 2, "application/x-dosexec" },
+        { 0, "\x7f" "ELF", 4, "application/x-executable" },
+        { 0, "\xca\xfe\xba\xbe", 4, "application/x-java-applet" },
+        { 0, "\xfe\xed\xfa\xce", 4, "application/x-mach-binary" },
+        { 0, "\xfe\xed\xfa\xcf", 4, "application/x-mach-binary" },
+        { 0, "\xce\xfa\xed\xfe", 4, "application/x-mach-binary" },
+        { 0, "\xcf\xfa\xed\xfe", 4, "application/x-mach-binary" },
+        { 0, "RIFF", 4, "application/x-riff" },
+        { 0, "ID3", 3, "audio/mpeg" },
+        { 0, "OggS", 4, "application/ogg" },
+        { 0, "BM", 2, "image/bmp" },
+        { 0, "<?xml", 5, "text/xml" },
+        { 0, "\xef\xbb\xbf", 3, "text/plain" },
+    };
+
+    /**
+     * File type, entropy and zero byte ratio of the content of a file, 
+     * accumulated from the buffers read while the file is being saved so that
+     * no second read of the file is needed.
+     */
+    class ContentStatistics
+    {
+    public:
+        ContentStatistics() : totalBytes(0), type("application/octet-stream"), measured(true)
+        {
+            memset(histogram, 0, sizeof(histogram));
+        }
+
+        void update(const unsigned char *buffer, size_t length)
+        {
+            if (totalBytes == 0)
+            {
+                detectType(buffer, length);
+            }
+
+            // Count into four interleaved histograms so that runs of equal bytes do not serialize the 
+            // increments on a single counter; this lets the compiler and CPU overlap the updates.
+            uint32_t counts[4][256];
+            memset(counts, 0, sizeof(counts));
+            size_t i = 0;
+            for (; i + 4 <= length; i += 4)
+            {
+                ++counts[0][buffer[i]];
+                ++counts[1][buffer[i + 1]];
+                ++counts[2][buffer[i + 2]];
+                ++counts[3][buffer[i + 3]];
+            }
+            for (; i < length; ++i)
+            {
+                ++counts[0][buffer[i]];
+            }
+            for (int b = 0; b < 256; ++b)
+            {
+                histogram[b] += static_cast<uint64_t>(counts[0][b]) + counts[1][b] + counts[2][b] + counts[3][b];
+            }
+
+            totalBytes += length;
+        }
+
+        /**
+         * Detects the type of content that is not read by the module (e.g.,
+         * content copied inside the kernel) from its first bytes. The entropy
+         * and zero byte ratio of the content are then unknown.
+         */
+        void identify(const unsigned char *buffer, size_t length)
+        {
+            detectType(buffer, length);
+            measured = false;
+        }
+
+        /**
+         * @return False if only the type of the content is known.
+         */
+        bool isMeasured() const
+        {
+            return measured;
+        }
+
+        const std::string &getType() const
+        {
+            return type;
+        }
+
+        /**
+         * @return Shannon entropy of the content in bits per byte, from 0.0 to 8.0.
+         */
+        double getEntropy() const
+        {
+            if (totalBytes == 0)
+            {
+                return 0.0;
+            }
+
+            double entropy = 0.0;
+            for (int b = 0; b < 256; ++b)
+            {
+                if (histogram[b] != 0)
+                {
+                    double p = static_cast<double>(histogram[b]) / totalBytes;
+                    entropy -= p * log(p);
+                }
+            }
+            return entropy / log(2.0);
+        }
+
+        double getZeroByteRatio() const
+        {
+            return totalBytes == 0 ? 0.0 : static_cast<double>(histogram[0]) / totalBytes;
+        }
+
+    private:
+        void detectType(const unsigned char *buffer, size_t length)
+        {
+            for (size_t i = 0; i < sizeof(FILE_SIGNATURES) / sizeof(FILE_SIGNATURES[0]); ++i)
+            {
+                const FileSignature &signature = FILE_SIGNATURES[i];
+                if (signature.offset + signature.length <= length && 
+                    memcmp(buffer + signature.offset, signature.magic, signature.length) == 0)
+                {
+                    type = signature.type;
+                    return;
+                }
+            }
+        }
+
+        uint64_t histogram[256];
+        uint64_t totalBytes;
+        std::string type;
+        bool measured;
+    };
+
+    // Size of the buffer used to copy the contents of files.
+    const size_t COPY_BUFFER_SIZE = 1024 * 1024;
+
+    // The unit of the sector runs recorded in the image database.
+    const uint64_t SECTOR_SIZE = 512;
+
+    // Files at least this large are written with direct I/O, when available, to keep them out of the page cache.
+    const uint64_t DIRECT_IO_THRESHOLD = 64 * 1024 * 1024;
+
+    /**
+     * The write mechanisms supported by the file system of the output folder,
+     * probed once by initialize().
+     */
+    struct OutputCapabilities
+    {
+        OutputCapabilities() 
+            : preallocate(false), punchHole(false), hardLinks(false), reflink(false), copyFileRange(false), 
+              sourceReflink(false), sourceCopyFileRange(false), directIoAlignment(0), blockSize(4096)
+        {
+        }
+
+        // Space for a file can be reserved before it is written (fallocate() on Linux).
+        bool preallocate;
+
+        // Holes can be punched in files, i.e., sparse output is possible.
+        bool punchHole;
+
+        // Hard links can be created in the output folder.
+        bool hardLinks;
+
+        // Extents can be shared between files in the output folder (FICLONE on Linux, block cloning on ReFS).
+        bool reflink;
+
+        // Data can be copied between files in the output folder inside the kernel (copy_file_range() on Linux).
+        bool copyFileRange;
+
+        // Extents can be shared, or data copied inside the kernel, from the evidence image files to the output folder.
+        bool sourceReflink;
+        bool sourceCopyFileRange;
+
+        // The buffer, offset and length alignment required for direct (unbuffered) I/O, 0 if it is not supported.
+        size_t directIoAlignment;
+
+        // The allocation unit of the output file system.
+        uint64_t blockSize;
+    };
+
+    OutputCapabilities outputCapabilities;
+
+#if defined(__linux__)
+    bool probeCopyFileRange(int sourceFd, int destFd, size_t length)
+    {
+#if defined(__NR_copy_file_range)
+        loff_t sourceOffset = 0;
+        loff_t destOffset = 0;
+        return syscall(__NR_copy_file_range, sourceFd, &sourceOffset, destFd, &destOffset, length, 0) == static_cast<long>(length);
+#else
+        return false;
+#endif
+    }
+
+    bool probeReflink(int sourceFd, int destFd, uint64_t length)
+    {
+#if defined(FICLONERANGE)
+        struct file_clone_range range;
+        memset(&range, 0, sizeof(range));
+        range.src_fd = sourceFd;
+        range.src_length = length;
+        return ioctl(destFd, FICLONERANGE, &range) == 0;
+#else
+        return false;
+#endif
+    }
+#endif
+
+    /**
+     * Probes the file system of the output folder for the write mechanisms it
+     * supports by trying each of them on scratch files.
+     */
+    OutputCapabilities probeOutputCapabilities(const std::string &folderPath)
+    {
+        OutputCapabilities capabilities;
+
+        Poco::Path probePath(Poco::Path::forDirectory(folderPath));
+        std::stringstream probeName;
+        probeName << ".capability_probe_" << Poco::Process::id();
+        probePath.setFileName(probeName.str());
+        const std::string sourcePath = probePath.toString() + "_a";
+        const std::string destPath = probePath.toString() + "_b";
+        const std::string linkPath = probePath.toString() + "_c";
+
+#if defined(_WIN32)
+        char volumePath[MAX_PATH + 1];
+        DWORD fileSystemFlags = 0;
+        if (GetVolumePathNameA(folderPath.c_str(), volumePath, sizeof(volumePath)) &&
+            GetVolumeInformationA(volumePath, NULL, 0, NULL, NULL, &fileSystemFlags, NULL, 0))
+        {
+            capabilities.preallocate = true;
+            capabilities.punchHole = (fileSystemFlags & FILE_SUPPORTS_SPARSE_FILES) != 0;
+#if defined(FILE_SUPPORTS_BLOCK_REFCOUNTING)
+            capabilities.reflink = (fileSystemFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING) != 0;
+#endif
+            DWORD sectorsPerCluster, bytesPerSector, freeClusters, totalClusters;
+            if (GetDiskFreeSpaceA(volumePath, &sectorsPerCluster, &bytesPerSector, &freeClusters, &totalClusters))
+            {
+                capabilities.directIoAlignment = bytesPerSector;
+                capabilities.blockSize = static_cast<uint64_t>(sectorsPerCluster) * bytesPerSector;
+            }
+        }
+
+        {
+            Poco::FileOutputStream sourceFile(sourcePath, std::ios::out | std::ios::trunc | std::ios::binary);
+            sourceFile << "probe";
+        }
+        capabilities.hardLinks = CreateHardLinkA(linkPath.c_str(), sourcePath.c_str(), NULL) != 0;
+#else
+        int sourceFd = open(sourcePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        int destFd = open(destPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (sourceFd != -1 && destFd != -1)
+        {
+            struct stat st;
+            size_t blockSize = (fstat(sourceFd, &st) == 0 && st.st_blksize > 0) ? static_cast<size_t>(st.st_blksize) : 4096;
+            capabilities.blockSize = blockSize;
+            std::vector<char> block(blockSize, 'p');
+            if (write(sourceFd, &block[0], blockSize) == static_cast<ssize_t>(blockSize) && fsync(sourceFd) == 0)
+            {
+#if defined(__linux__)
+                capabilities.preallocate = fallocate(destFd, FALLOC_FL_KEEP_SIZE, 0, blockSize) == 0;
+                capabilities.punchHole = fallocate(sourceFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, blockSize) == 0;
+                if (capabilities.punchHole && pwrite(sourceFd, &block[0], blockSize, 0) != static_cast<ssize_t>(blockSize))
+                {
+                    capabilities.punchHole = false;
+                }
+                capabilities.reflink = probeReflink(sourceFd, destFd, blockSize);
+                capabilities.copyFileRange = ftruncate(destFd, 0) == 0 && probeCopyFileRange(sourceFd, destFd, blockSize);
+
+                // Direct I/O alignment is usually the logical block size of the device; try the common sizes.
+                int directFd = open(linkPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+                if (directFd != -1)
+                {
+                    for (size_t alignment = 512; alignment <= 4096 && capabilities.directIoAlignment == 0; alignment *= 8)
+                    {
+                        void *alignedBlock = NULL;
+                        if (posix_memalign(&alignedBlock, alignment, alignment) == 0)
+                        {
+                            memset(alignedBlock, 0, alignment);
+                            if (pwrite(directFd, alignedBlock, alignment, 0) == static_cast<ssize_t>(alignment))
+                            {
+                                capabilities.directIoAlignment = alignment;
+                            }
+                            free(alignedBlock);
+                        }
+                    }
+                    close(directFd);
+                    unlink(linkPath.c_str());
+                }
+#endif
+                capabilities.hardLinks = link(sourcePath.c_str(), linkPath.c_str()) == 0;
+            }
+        }
+        if (sourceFd != -1)
+        {
+            close(sourceFd);
+        }
+        if (destFd != -1)
+        {
+            close(destFd);
+        }
+#endif
+
+        const std::string probePaths[] = { sourcePath, destPath, linkPath };
+        for (size_t i = 0; i < sizeof(probePaths) / sizeof(probePaths[0]); ++i)
+        {
+            try
+            {
+                Poco::File probeFile(probePaths[i]);
+                if (probeFile.exists())
+                {
+                    probeFile.remove();
+                }
+            }
+            catch (Poco::Exception &)
+            {
+            }
+        }
+
+        return capabilities;
+    }
+
+    void logOutputCapabilities(const std::string &folderPath, const OutputCapabilities &capabilities)
+    {
+        std::stringstream msg;
+        msg << "SaveInterestingFilesModule::initialize : output folder " << folderPath << ": ";
+        if (capabilities.directIoAlignment != 0)
+        {
+            msg << "direct I/O (" << capabilities.directIoAlignment << " byte alignment) for files of " << DIRECT_IO_THRESHOLD << " bytes or more";
+        }
+        else
+        {
+            msg << "buffered I/O";
+        }
+        msg << ", preallocation " << (capabilities.preallocate ? "on" : "off")
+            << ", sparse files " << (capabilities.punchHole ? "supported" : "not supported")
+            << ", hard links " << (capabilities.hardLinks ? "supported" : "not supported")
+            << ", reflink " << (capabilities.reflink ? "supported" : "not supported")
+            << ", copy_file_range " << (capabilities.copyFileRange ? "supported" : "not supported");
+        LOGINFO(msg.str());
+    }
+
+#if defined(__linux__)
+    /**
+     * Probes whether data can be moved from the first evidence image file to
+     * the output folder without passing through user space. This is done by
+     * report() rather than initialize(), since the image may not be open when
+     * the module is initialized (e.g., by SaveInterestingFilesService).
+     */
+    void probeSourceCapabilities(const std::string &folderPath, OutputCapabilities &capabilities)
+    {
+        capabilities.sourceReflink = false;
+        capabilities.sourceCopyFileRange = false;
+        std::vector<std::string> imageFileNames;
+        try
+        {
+            imageFileNames = TskServices::Instance().getImageFile().getFileNames();
+        }
+        catch (TskException &)
+        {
+        }
+        int imageFd = imageFileNames.empty() ? -1 : open(imageFileNames[0].c_str(), O_RDONLY);
+        if (imageFd == -1)
+        {
+            return;
+        }
+
+        std::stringstream probePath;
+        probePath << Poco::Path::forDirectory(folderPath).toString() << ".capability_probe_" << Poco::Process::id() << "_source";
+        int destFd = open(probePath.str().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (destFd != -1)
+        {
+            const size_t blockSize = static_cast<size_t>(capabilities.blockSize);
+            capabilities.sourceReflink = probeReflink(imageFd, destFd, blockSize);
+            capabilities.sourceCopyFileRange = ftruncate(destFd, 0) == 0 && probeCopyFileRange(imageFd, destFd, blockSize);
+            close(destFd);
+            unlink(probePath.str().c_str());
+        }
+        close(imageFd);
+
+        std::stringstream msg;
+        msg << "SaveInterestingFilesModule::report : from evidence to output folder " << folderPath << ": reflink " 
+            << (capabilities.sourceReflink ? "supported" : "not supported") << ", copy_file_range " 
+            << (capabilities.sourceCopyFileRange ? "supported" : "not supported");
+        LOGINFO(msg.str());
+    }
+#endif
+
+    // The capabilities of each output volume this process has probed, so that a process that runs the module for many
+    // cases (e.g., SaveInterestingFilesService) probes each volume once.
+    std::map<std::string, OutputCapabilities> probedVolumes;
+
+    /**
+     * @return An identifier of the volume holding a folder, or an empty 
+     * string if it cannot be determined.
+     */
+    std::string getVolumeId(const std::string &folderPath)
+    {
+#if defined(_WIN32)
+        char volumePath[MAX_PATH + 1];
+        if (GetVolumePathNameA(folderPath.c_str(), volumePath, sizeof(volumePath)))
+        {
+            return volumePath;
+        }
+#else
+        struct stat st;
+        if (stat(folderPath.c_str(), &st) == 0)
+        {
+            return Poco::NumberFormatter::format(static_cast<Poco::UInt64>(st.st_dev));
+        }
+#endif
+        return std::string();
+    }
+
+    /**
+     * The destination of the content of a saved file.
+     */
+    class FileSink
+    {
+    public:
+        virtual ~FileSink() {}
+        virtual void write(const char *data, size_t length) = 0;
+        virtual void close() = 0;
+    };
+
+    /**
+     * A file being written to the output folder, using the fastest write path
+     * the output file system was found to support: space is preallocated when
+     * the final size is known, and large files are written with direct I/O 
+     * through an aligned buffer.
+     */
+    class OutputFile : public FileSink
+    {
+    public:
+        OutputFile(const std::string &path, uint64_t expectedSize) 
+            : path(path)
+#if defined(__linux__)
+            , fd(-1), direct(false), alignedBuffer(NULL), bufferedBytes(0)
+#else
+            , stream(path, std::ios::out | std::ios::trunc | std::ios::binary)
+#endif
+        {
+#if defined(__linux__)
+            const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+            if (outputCapabilities.directIoAlignment != 0 && expectedSize >= DIRECT_IO_THRESHOLD &&
+                posix_memalign(reinterpret_cast<void**>(&alignedBuffer), outputCapabilities.directIoAlignment, COPY_BUFFER_SIZE) == 0)
+            {
+                fd = open(path.c_str(), flags | O_DIRECT, 0644);
+                direct = fd != -1;
+            }
+            if (fd == -1)
+            {
+                fd = open(path.c_str(), flags, 0644);
+            }
+            if (fd == -1)
+            {
+                free(alignedBuffer);
+                throw Poco::CreateFileException(path);
+            }
+
+            if (outputCapabilities.preallocate && expectedSize > 0)
+            {
+                // A failure here just means the file will be allocated as it is written.
+                fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(expectedSize));
+            }
+#else
+            if (!stream)
+            {
+                throw Poco::CreateFileException(path);
+            }
+#endif
+        }
+
+        ~OutputFile()
+        {
+#if defined(__linux__)
+            if (fd != -1)
+            {
+                ::close(fd);
+            }
+            free(alignedBuffer);
+#endif
+        }
+
+        void write(const char *data, size_t length)
+        {
+#if defined(__linux__)
+            if (!direct)
+            {
+                writeFully(data, length);
+                return;
+            }
+
+            while (length > 0)
+            {
+                size_t count = std::min(length, COPY_BUFFER_SIZE - bufferedBytes);
+                memcpy(alignedBuffer + bufferedBytes, data, count);
+                bufferedBytes += count;
+                data += count;
+                length -= count;
+                if (bufferedBytes == COPY_BUFFER_SIZE)
+                {
+                    writeFully(alignedBuffer, bufferedBytes);
+                    bufferedBytes = 0;
+                }
+            }
+#else
+            stream.write(data, static_cast<std::streamsize>(length));
+            if (!stream)
+            {
+                throw Poco::WriteFileException(path);
+            }
+#endif
+        }
+
+        void close()
+        {
+#if defined(__linux__)
+            if (direct && bufferedBytes > 0)
+            {
+                // Write the aligned part of the remaining data directly, then the unaligned tail through the page cache.
+                size_t alignedBytes = bufferedBytes - bufferedBytes % outputCapabilities.directIoAlignment;
+                writeFully(alignedBuffer, alignedBytes);
+                if (alignedBytes < bufferedBytes)
+                {
+                    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) == -1)
+                    {
+                        throw Poco::WriteFileException(path);
+                    }
+                    writeFully(alignedBuffer + alignedBytes, bufferedBytes - alignedBytes);
+                }
+                bufferedBytes = 0;
+            }
+            int result = ::close(fd);
+            fd = -1;
+            if (result != 0)
+            {
+                throw Poco::WriteFileException(path);
+            }
+#else
+            stream.close();
+#endif
+        }
+
+#if defined(__linux__)
+        /**
+         * Appends a byte range of another file without passing the data 
+         * through user space: extents are shared with the source where the 
+         * range is block aligned and the file systems support it, and the 
+         * rest is copied inside the kernel. Only for files opened without
+         * direct I/O.
+         *
+         * @param reflink True if extents can be shared with the source file.
+         * @param copyFileRange True if data can be copied from the source 
+         * file inside the kernel.
+         */
+        void copyFrom(int sourceFd, uint64_t sourceOffset, uint64_t length, bool reflink, bool copyFileRange)
+        {
+            off_t destOffset = lseek(fd, 0, SEEK_CUR);
+            if (destOffset == -1)
+            {
+                throw Poco::WriteFileException(path);
+            }
+
+#if defined(FICLONERANGE)
+            const uint64_t blockSize = outputCapabilities.blockSize;
+            uint64_t cloneLength = length - length % blockSize;
+            if (reflink && cloneLength > 0 && sourceOffset % blockSize == 0 && static_cast<uint64_t>(destOffset) % blockSize == 0)
+            {
+                struct file_clone_range range;
+                memset(&range, 0, sizeof(range));
+                range.src_fd = sourceFd;
+                range.src_offset = sourceOffset;
+                range.src_length = cloneLength;
+                range.dest_offset = static_cast<uint64_t>(destOffset);
+                if (ioctl(fd, FICLONERANGE, &range) == 0)
+                {
+                    sourceOffset += cloneLength;
+                    length -= cloneLength;
+                    destOffset += static_cast<off_t>(cloneLength);
+                    if (lseek(fd, destOffset, SEEK_SET) == -1)
+                    {
+                        throw Poco::WriteFileException(path);
+                    }
+                }
+            }
+#endif
+
+#if defined(__NR_copy_file_range)
+            while (length > 0 && copyFileRange)
+            {
+                loff_t offset = static_cast<loff_t>(sourceOffset);
+                long bytesCopied = syscall(__NR_copy_file_range, sourceFd, &offset, fd, NULL, static_cast<size_t>(std::min<uint64_t>(length, COPY_BUFFER_SIZE * 64)), 0);
+                if (bytesCopied < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (bytesCopied <= 0)
+                {
+                    // E.g., the range crosses into a file system that cannot copy it; finish through user space.
+                    break;
+                }
+                sourceOffset += static_cast<uint64_t>(bytesCopied);
+                length -= static_cast<uint64_t>(bytesCopied);
+            }
+#endif
+
+            std::vector<char> buffer(static_cast<size_t>(std::min<uint64_t>(length, COPY_BUFFER_SIZE)));
+            while (length > 0)
+            {
+                ssize_t bytesRead = pread(sourceFd, &buffer[0], static_cast<size_t>(std::min<uint64_t>(length, buffer.size())), static_cast<off_t>(sourceOffset));
+                if (bytesRead < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (bytesRead <= 0)
+                {
+                    throw Poco::ReadFileException("failed to read image file at offset " + Poco::NumberFormatter::format(sourceOffset));
+                }
+                writeFully(&buffer[0], static_cast<size_t>(bytesRead));
+                sourceOffset += static_cast<uint64_t>(bytesRead);
+                length -= static_cast<uint64_t>(bytesRead);
+            }
+        }
+
+        /**
+         * Appends zeros, as a hole where the file system supports sparse 
+         * files. Only for files opened without direct I/O.
+         */
+        void appendZeros(uint64_t length)
+        {
+            off_t offset = lseek(fd, 0, SEEK_CUR);
+            if (offset == -1 || ftruncate(fd, offset + static_cast<off_t>(length)) != 0 || 
+                lseek(fd, offset + static_cast<off_t>(length), SEEK_SET) == -1)
+            {
+                throw Poco::WriteFileException(path);
+            }
+        }
+#endif
+
+    private:
+        OutputFile(const OutputFile &);
+        OutputFile &operator=(const OutputFile &);
+
+#if defined(__linux__)
+        void writeFully(const char *data, size_t length)
+        {
+            while (length > 0)
+            {
+                ssize_t bytesWritten = ::write(fd, data, length);
+                if (bytesWritten < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (bytesWritten <= 0)
+                {
+                    throw Poco::WriteFileException(path);
+                }
+                data += bytesWritten;
+                length -= static_cast<size_t>(bytesWritten);
+            }
+        }
+#endif
+
+        std::string path;
+#if defined(__linux__)
+        int fd;
+        bool direct;
+        char *alignedBuffer;
+        size_t bufferedBytes;
+#else
+        Poco::FileOutputStream stream;
+#endif
+    };
+
+    /**
+     * A file being written into a SquashFS image. An image takes the content
+     * of one file at a time, so a buffered entry is kept in memory and added
+     * to the image when it is closed; this lets the slack of a file be 
+     * written while the file itself is open.
+     */
+    class ImageEntry : public FileSink
+    {
+    public:
+        ImageEntry(Squashfs::Writer &image, const std::string &path, std::time_t mtime, bool buffered)
+            : image(image), path(path), mtime(mtime), buffered(buffered), open(true)
+        {
+            if (!buffered)
+            {
+                image.beginFile(path, mtime);
+            }
+        }
+
+        ~ImageEntry()
+        {
+            // An entry abandoned part way through keeps the content written so far, like a partially written file.
+            if (open && !buffered)
+            {
+                try
+                {
+                    image.endFile();
+                }
+                catch (...)
+                {
+                }
+            }
+        }
+
+        void write(const char *data, size_t length)
+        {
+            if (buffered)
+            {
+                content.append(data, length);
+            }
+            else
+            {
+                image.write(data, length);
+            }
+        }
+
+        void close()
+        {
+            open = false;
+            if (buffered)
+            {
+                image.addFile(path, mtime, content);
+            }
+            else
+            {
+                image.endFile();
+            }
+        }
+
+    private:
+        ImageEntry(const ImageEntry &);
+        ImageEntry &operator=(const ImageEntry &);
+
+        Squashfs::Writer &image;
+        std::string path;
+        std::time_t mtime;
+        bool buffered;
+        bool open;
+        std::string content;
+    };
+
+    // The chunk store of the run, in the output folder, and the chunker that cuts files for it (see ChunkStore.h).
+    const std::string CHUNK_STORE_NAME = "SaveInterestingFilesModule_chunks";
+    const std::string CHUNK_RECIPE_SUFFIX = ".chunks";
+    Chunking::Store chunkStore;
+    std::auto_ptr<Chunking::Chunker> chunker;
+
+    /**
+     * A file being saved to the chunk store, as a recipe listing its chunks.
+     */
+    class ChunkedFile : public FileSink
+    {
+    public:
+        ChunkedFile(const std::string &recipePath) : writer(chunkStore, *chunker, recipePath) {}
+
+        void write(const char *data, size_t length)
+        {
+            writer.write(data, length);
+        }
+
+        void close()
+        {
+            writer.close();
+        }
+
+    private:
+        Chunking::RecipeWriter writer;
+    };
+
+    /**
+     * @return True if a file of the given size, not being written into a
+     * SquashFS image (which stores identical files once itself), is to be
+     * saved to the chunk store.
+     */
+    bool isChunked(const Squashfs::Writer *image, uint64_t size)
+    {
+        return image == NULL && chunkStore.isOpen() && size >= options.chunkDedupMinSize;
+    }
+
+    /**
+     * Creates the file a saved file's content is written to: an entry in
+     * the given SquashFS image if there is one, otherwise a file in the 
+     * output folder.
+     */
+    FileSink *createFileSink(Squashfs::Writer *image, const std::string &path, uint64_t expectedSize, std::time_t mtime, bool buffered)
+    {
+        if (image != NULL)
+        {
+            return new ImageEntry(*image, path, mtime, buffered);
+        }
+        return new OutputFile(path, expectedSize);
+    }
+
+    /**
+     * A file being written into a SquashFS image whose content is also 
+     * written to a spool file in the output folder, so that it can be added 
+     * to the images of other sets without reading the evidence again.
+     */
+    class SpooledEntry : public FileSink
+    {
+    public:
+        SpooledEntry(FileSink *entry, const std::string &spoolPath) : spool(spoolPath, 0), entry(entry) {}
+
+        void write(const char *data, size_t length)
+        {
+            entry->write(data, length);
+            spool.write(data, length);
+        }
+
+        void close()
+        {
+            entry->close();
+            spool.close();
+        }
+
+    private:
+        OutputFile spool;
+        std::auto_ptr<FileSink> entry;
+    };
+
+    /**
+     * @return The given sink, writing to the given spool file as well if a
+     * spool path is given.
+     */
+    FileSink *spoolFileSink(FileSink *sink, const std::string &spoolPath)
+    {
+        if (spoolPath.empty())
+        {
+            return sink;
+        }
+
+        std::auto_ptr<FileSink> ownedSink(sink);
+        FileSink *spooledSink = new SpooledEntry(ownedSink.get(), spoolPath);
+        ownedSink.release();
+        return spooledSink;
+    }
+
+#if defined(__linux__)
+    // Most bytes of an image file mapped at once to check which of them are in the page cache.
+    const uint64_t RESIDENCY_WINDOW = 64 * 1024 * 1024;
+
+    /**
+     * The evidence image files, if they are raw images (a single file or 
+     * numbered segments), so that ranges of the image can be copied straight
+     * from the image files.
+     */
+    class RawImage
+    {
+    public:
+        RawImage() {}
+
+        ~RawImage()
+        {
+            close();
+        }
+
+        /**
+         * Opens the image files and checks that they hold the image's sectors
+         * unencoded, by comparing sample sectors read from each of them with
+         * the same sectors read through the image file service.
+         *
+         * @return False if the image is not raw or cannot be opened.
+         */
+        bool open()
+        {
+            close();
+            std::vector<std::string> imageFileNames;
+            try
+            {
+                imageFileNames = TskServices::Instance().getImageFile().getFileNames();
+            }
+            catch (TskException &)
+            {
+                return false;
+            }
+
+            uint64_t imageOffset = 0;
+            for (std::vector<std::string>::const_iterator imageFileName = imageFileNames.begin(); imageFileName != imageFileNames.end(); ++imageFileName)
+            {
+                Segment segment;
+                segment.fd = ::open((*imageFileName).c_str(), O_RDONLY);
+                struct stat st;
+                if (segment.fd == -1 || fstat(segment.fd, &st) != 0 || st.st_size <= 0 || st.st_size % SECTOR_SIZE != 0)
+                {
+                    if (segment.fd != -1)
+                    {
+                        ::close(segment.fd);
+                    }
+                    close();
+                    return false;
+                }
+                segment.imageOffset = imageOffset;
+                segment.size = static_cast<uint64_t>(st.st_size);
+                segments.push_back(segment);
+                imageOffset += segment.size;
+            }
+
+            // Compare the first, middle and last sectors of each segment.
+            TskImageFile &imageFile = TskServices::Instance().getImageFile();
+            char expected[SECTOR_SIZE];
+            char actual[SECTOR_SIZE];
+            for (std::vector<Segment>::const_iterator segment = segments.begin(); segment != segments.end(); ++segment)
+            {
+                const uint64_t sectorCount = (*segment).size / SECTOR_SIZE;
+                const uint64_t samples[] = { 0, sectorCount / 2, sectorCount - 1 };
+                for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); ++i)
+                {
+                    const uint64_t offset = samples[i] * SECTOR_SIZE;
+                    if (imageFile.getSectorData(((*segment).imageOffset + offset) / SECTOR_SIZE, 1, expected) != 1 ||
+                        pread((*segment).fd, actual, SECTOR_SIZE, static_cast<off_t>(offset)) != static_cast<ssize_t>(SECTOR_SIZE) ||
+                        memcmp(expected, actual, SECTOR_SIZE) != 0)
+                    {
+                        close();
+                        return false;
+                    }
+                }
+            }
+            return !segments.empty();
+        }
+
+        bool isOpen() const
+        {
+            return !segments.empty();
+        }
+
+        void close()
+        {
+            for (std::vector<Segment>::const_iterator segment = segments.begin(); segment != segments.end(); ++segment)
+            {
+                ::close((*segment).fd);
+            }
+            segments.clear();
+        }
+
+        /**
+         * Finds the image file holding an offset in the image.
+         *
+         * @param imageOffset The offset in the image.
+         * @param fd Set to the descriptor of the image file.
+         * @param fileOffset Set to the offset in the image file.
+         * @return The number of bytes of the image from imageOffset in the 
+         * image file, 0 if the offset is past the end of the image.
+         */
+        uint64_t locate(uint64_t imageOffset, int &fd, uint64_t &fileOffset) const
+        {
+            for (std::vector<Segment>::const_iterator segment = segments.begin(); segment != segments.end(); ++segment)
+            {
+                if (imageOffset >= (*segment).imageOffset && imageOffset < (*segment).imageOffset + (*segment).size)
+                {
+                    fd = (*segment).fd;
+                    fileOffset = imageOffset - (*segment).imageOffset;
+                    return (*segment).size - fileOffset;
+                }
+            }
+            return 0;
+        }
+
+        /**
+         * Counts the bytes of a range of the image that are resident in the
+         * page cache, by mapping the range of each image file and asking 
+         * mincore(2), which neither reads nor faults in any of it.
+         */
+        uint64_t countResidentBytes(uint64_t imageOffset, uint64_t length) const
+        {
+            static const uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+            uint64_t residentBytes = 0;
+            std::vector<unsigned char> pages;
+            while (length > 0)
+            {
+                int fd = -1;
+                uint64_t fileOffset = 0;
+                uint64_t available = locate(imageOffset, fd, fileOffset);
+                if (available == 0)
+                {
+                    break;
+                }
+
+                // Map at most RESIDENCY_WINDOW bytes at a time, from the start of the page holding the range.
+                const uint64_t count = std::min(std::min(length, available), RESIDENCY_WINDOW);
+                const uint64_t mapOffset = fileOffset - fileOffset % pageSize;
+                const size_t mapLength = static_cast<size_t>(fileOffset - mapOffset + count);
+                void *address = mmap(NULL, mapLength, PROT_READ, MAP_SHARED, fd, static_cast<off_t>(mapOffset));
+                if (address == MAP_FAILED)
+                {
+                    break;
+                }
+                pages.resize((mapLength + pageSize - 1) / pageSize);
+                if (mincore(address, mapLength, &pages[0]) == 0)
+                {
+                    for (size_t page = 0; page < pages.size(); ++page)
+                    {
+                        if (pages[page] & 1)
+                        {
+                            // Count only the part of the page inside the range.
+                            const uint64_t pageStart = std::max(mapOffset + page * pageSize, fileOffset);
+                            const uint64_t pageEnd = std::min(mapOffset + (page + 1) * pageSize, fileOffset + count);
+                            residentBytes += pageEnd - pageStart;
+                        }
+                    }
+                }
+                munmap(address, mapLength);
+
+                imageOffset += count;
+                length -= count;
+            }
+            return residentBytes;
+        }
+
+    private:
+        RawImage(const RawImage &);
+        RawImage &operator=(const RawImage &);
+
+        struct Segment
+        {
+            Segment() : fd(-1), imageOffset(0), size(0) {}
+
+            int fd;
+            uint64_t imageOffset;
+            uint64_t size;
+        };
+
+        std::vector<Segment> segments;
+    };
+
+    RawImage rawImage;
+
+    // True if file content is copied straight from the raw image files, rather than the raw image only being used to 
+    // check which files are in the page cache.
+    bool extentCopying = false;
+#endif
+
+    /**
+     * The results of saving the contents of a file.
+     */
+    struct SavedFile
+    {
+        SavedFile() : slackBytes(0), extentCopied(false), decompressedInParallel(false), fannedOut(false), openTime(0), runsTime(0), contentTime(0), slackTime(0), 
+            fragments(0) {}
+
+        ContentStatistics stats;
+        std::string slackPath;
+        uint64_t slackBytes;
+
+        // The path of the file's chunk recipe, if it was saved to the chunk store rather than as a file.
+        std::string chunkRecipePath;
+
+        // True if the content was copied straight from the image files.
+        bool extentCopied;
+
+        // True if the file system compressed content was inflated by the parallel decompressor.
+        bool decompressedInParallel;
+
+        // True if the file was linked or copied from a copy saved earlier in the run.
+        bool fannedOut;
+
+        // Wall clock time, in microseconds, spent getting the file, looking up its sector runs, saving its content 
+        // (or linking or copying an earlier copy) and saving its slack.
+        Poco::Timestamp::TimeDiff openTime;
+        Poco::Timestamp::TimeDiff runsTime;
+        Poco::Timestamp::TimeDiff contentTime;
+        Poco::Timestamp::TimeDiff slackTime;
+
+        // The number of sector runs the file's content is stored in, 0 if they were not looked up.
+        size_t fragments;
+    };
+
+    /**
+     * A run of image sectors holding part of the content of a file.
+     */
+    struct SectorRun
+    {
+        SectorRun(TSK_OFF_T logicalOffset, uint64_t sector, uint64_t count) : logicalOffset(logicalOffset), sector(sector), count(count) {}
+
+        // Offset within the file of the first byte of the run.
+        TSK_OFF_T logicalOffset;
+
+        uint64_t sector;
+        uint64_t count;
+    };
+
+    typedef std::vector<SectorRun> SectorRunList;
+
+    /**
+     * Reads the sector runs of a file from the image database, in file order.
+     */
+    void querySectorRuns(uint64_t fileId, SectorRunList &runs)
+    {
+        runs.clear();
+        std::auto_ptr<SectorRuns> sectorRuns(TskServices::Instance().getImgDB().getFileSectors(fileId));
+        if (sectorRuns.get() == NULL || sectorRuns->begin() == -1)
+        {
+            return;
+        }
+
+        TSK_OFF_T runOffset = 0;
+        do
+        {
+            runs.push_back(SectorRun(runOffset, sectorRuns->getDataStart(), sectorRuns->getDataLen()));
+            runOffset += static_cast<TSK_OFF_T>(sectorRuns->getDataLen() * SECTOR_SIZE);
+        }
+        while (sectorRuns->next() != -1);
+    }
+
+    bool hasLowerFileId(const TskFileRecord &left, const TskFileRecord &right)
+    {
+        return left.fileId < right.fileId;
+    }
+
+    // Maximum number of file ids in a single file record query.
+    const size_t MAX_IDS_PER_QUERY = 500;
+
+    /**
+     * A read-only, in-memory copy of the parts of the image database the 
+     * module queries while saving files: the file records, with their hashes,
+     * of the files hit by the sets and of everything below the directories
+     * hit, indexed by id and by parent, and the sector runs of the files to 
+     * be saved. When loaded, the module's metadata queries about these files
+     * are answered from it rather than from the database, so that they do 
+     * not compete with reads of the evidence.
+     */
+    class MetadataReplica
+    {
+    public:
+        MetadataReplica() : loaded(false) {}
+
+        /**
+         * Loads the file records of the given files and of the contents of
+         * those that are directories, a level of the directory trees at a 
+         * time, in queries of up to MAX_IDS_PER_QUERY ids.
+         */
+        void load(const std::vector<uint64_t> &hitFileIds)
+        {
+            clear();
+            std::set<uint64_t> loadedFileIds;
+            std::vector<uint64_t> dirIds;
+            queryRecords("file_id", hitFileIds, loadedFileIds, dirIds);
+            while (!dirIds.empty())
+            {
+                std::vector<uint64_t> parentIds;
+                parentIds.swap(dirIds);
+                queryRecords("par_file_id", parentIds, loadedFileIds, dirIds);
+                loadedDirIds.insert(parentIds.begin(), parentIds.end());
+            }
+            std::sort(records.begin(), records.end(), hasLowerFileId);
+
+            // Index the records by parent. Sorting by (parent, index) keeps the children of each directory in file id 
+            // order, as the database returns them.
+            children.reserve(records.size());
+            for (size_t i = 0; i < records.size(); ++i)
+            {
+                children.push_back(std::make_pair(records[i].parentFileId, i));
+            }
+            std::sort(children.begin(), children.end());
+            loaded = true;
+        }
+
+        /**
+         * Loads the sector runs of the given files, so that they are not 
+         * queried while the files are being read.
+         */
+        void loadSectorRuns(const std::vector<uint64_t> &fileIds)
+        {
+            for (std::vector<uint64_t>::const_iterator fileId = fileIds.begin(); fileId != fileIds.end(); ++fileId)
+            {
+                if (sectorRuns.find(*fileId) == sectorRuns.end())
+                {
+                    querySectorRuns(*fileId, sectorRuns[*fileId]);
+                }
+            }
+        }
+
+        void clear()
+        {
+            loaded = false;
+            std::vector<TskFileRecord>().swap(records);
+            std::vector<std::pair<uint64_t, size_t> >().swap(children);
+            loadedDirIds.clear();
+            sectorRuns.clear();
+        }
+
+        bool isLoaded() const
+        {
+            return loaded;
+        }
+
+        size_t getRecordCount() const
+        {
+            return records.size();
+        }
+
+        /**
+         * @return The record of the file, or NULL if there is none.
+         */
+        const TskFileRecord *findFileRecord(uint64_t fileId) const
+        {
+            TskFileRecord key;
+            key.fileId = fileId;
+            std::vector<TskFileRecord>::const_iterator record = std::lower_bound(records.begin(), records.end(), key, hasLowerFileId);
+            return record != records.end() && (*record).fileId == fileId ? &*record : NULL;
+        }
+
+        /**
+         * Gets the records of the files in a directory, in file id order.
+         *
+         * @return False if the contents of the directory were not loaded.
+         */
+        bool getChildren(uint64_t dirId, std::vector<const TskFileRecord*> &childRecords) const
+        {
+            childRecords.clear();
+            if (loadedDirIds.find(dirId) == loadedDirIds.end())
+            {
+                return false;
+            }
+
+            std::vector<std::pair<uint64_t, size_t> >::const_iterator child = std::lower_bound(children.begin(), children.end(), std::make_pair(dirId, static_cast<size_t>(0)));
+            for (; child != children.end() && (*child).first == dirId; ++child)
+            {
+                childRecords.push_back(&records[(*child).second]);
+            }
+            return true;
+        }
+
+        /**
+         * @return False if the sector runs of the file were not loaded.
+         */
+        bool findSectorRuns(uint64_t fileId, SectorRunList &runs) const
+        {
+            std::map<uint64_t, SectorRunList>::const_iterator fileRuns = sectorRuns.find(fileId);
+            if (fileRuns == sectorRuns.end())
+            {
+                return false;
+            }
+            runs = (*fileRuns).second;
+            return true;
+        }
+
+    private:
+        MetadataReplica(const MetadataReplica &);
+        MetadataReplica &operator=(const MetadataReplica &);
+
+        /**
+         * Adds the records of the files whose given column is one of the 
+         * given ids, skipping files already loaded, and collects the ids of
+         * the directories among them.
+         */
+        void queryRecords(const std::string &column, const std::vector<uint64_t> &ids, std::set<uint64_t> &loadedFileIds, 
+            std::vector<uint64_t> &dirIds)
+        {
+            for (size_t first = 0; first < ids.size(); first += MAX_IDS_PER_QUERY)
+            {
+                std::stringstream condition;
+                condition << "WHERE " << column << " IN (";
+                for (size_t i = first; i < ids.size() && i < first + MAX_IDS_PER_QUERY; ++i)
+                {
+                    condition << (i == first ? "" : ", ") << ids[i];
+                }
+                condition << ")";
+
+                std::vector<const TskFileRecord> batch = TskServices::Instance().getImgDB().getFileRecords(condition.str());
+                for (std::vector<const TskFileRecord>::const_iterator record = batch.begin(); record != batch.end(); ++record)
+                {
+                    if (!loadedFileIds.insert((*record).fileId).second)
+                    {
+                        continue;
+                    }
+                    records.push_back(*record);
+                    if ((*record).metaType == TSK_FS_META_TYPE_DIR)
+                    {
+                        dirIds.push_back((*record).fileId);
+                    }
+                }
+            }
+        }
+
+        bool loaded;
+
+        // The loaded file records, in file id order.
+        std::vector<TskFileRecord> records;
+
+        // (parent file id, index in records) pairs, in order.
+        std::vector<std::pair<uint64_t, size_t> > children;
+
+        // The directories whose contents were loaded.
+        std::set<uint64_t> loadedDirIds;
+
+        std::map<uint64_t, SectorRunList> sectorRuns;
+    };
+
+    MetadataReplica metadataReplica;
+
+    /**
+     * Handles on the file systems of the image, opened through the Sleuth Kit
+     * directly, for the file details and reads that the image database and 
+     * the file manager do not provide. TSK file system handles are not safe 
+     * to share between threads, so each thread that needs them has its own.
+     */
+    class FileSystemHandles
+    {
+    public:
+        FileSystemHandles() : image(NULL), file(NULL), fileSystemOffset(0), fileSystemFileId(0) {}
+
+        ~FileSystemHandles()
+        {
+            close();
+        }
+
+        /**
+         * Opens the image. File systems are opened as their files are.
+         *
+         * @return False if the image could not be opened.
+         */
+        bool open(const std::vector<std::string> &imageFileNames)
+        {
+            close();
+            if (imageFileNames.empty())
+            {
+                return false;
+            }
+            std::vector<const char*> names;
+            for (std::vector<std::string>::const_iterator imageFileName = imageFileNames.begin(); imageFileName != imageFileNames.end(); ++imageFileName)
+            {
+                names.push_back((*imageFileName).c_str());
+            }
+            image = tsk_img_open_utf8(static_cast<int>(names.size()), &names[0], TSK_IMG_TYPE_DETECT, 0);
+            if (image == NULL)
+            {
+                tsk_error_reset();
+                return false;
+            }
+            return true;
+        }
+
+        bool isOpen() const
+        {
+            return image != NULL;
+        }
+
+        void close()
+        {
+            if (file != NULL)
+            {
+                tsk_fs_file_close(file);
+                file = NULL;
+            }
+            for (std::map<TSK_OFF_T, TSK_FS_INFO*>::iterator fileSystem = fileSystems.begin(); fileSystem != fileSystems.end(); ++fileSystem)
+            {
+                if ((*fileSystem).second != NULL)
+                {
+                    tsk_fs_close((*fileSystem).second);
+                }
+            }
+            fileSystems.clear();
+            if (image != NULL)
+            {
+                tsk_img_close(image);
+                image = NULL;
+            }
+        }
+
+        /**
+         * Opens a file by its metadata address. The file stays open until 
+         * another file is opened, so that a file used several times in a row
+         * is opened once.
+         *
+         * @param fsOffset The byte offset in the image of the file's file system.
+         * @param fsFileId The file's metadata address in its file system.
+         * @return The file, or NULL if it could not be opened.
+         */
+        TSK_FS_FILE *openFile(TSK_OFF_T fsOffset, TSK_INUM_T fsFileId)
+        {
+            if (file != NULL && fileSystemOffset == fsOffset && fileSystemFileId == fsFileId)
+            {
+                return file;
+            }
+            if (file != NULL)
+            {
+                tsk_fs_file_close(file);
+                file = NULL;
+            }
+            if (image == NULL)
+            {
+                return NULL;
+            }
+
+            std::map<TSK_OFF_T, TSK_FS_INFO*>::iterator fileSystem = fileSystems.find(fsOffset);
+            if (fileSystem == fileSystems.end())
+            {
+                // A file system that fails to open is remembered as NULL, so that it is not opened again.
+                fileSystem = fileSystems.insert(std::make_pair(fsOffset, tsk_fs_open_img(image, fsOffset, TSK_FS_TYPE_DETECT))).first;
+            }
+            if ((*fileSystem).second != NULL)
+            {
+                file = tsk_fs_file_open_meta((*fileSystem).second, NULL, fsFileId);
+            }
+            if (file == NULL)
+            {
+                tsk_error_reset();
+                return NULL;
+            }
+            fileSystemOffset = fsOffset;
+            fileSystemFileId = fsFileId;
+            return file;
+        }
+
+    private:
+        FileSystemHandles(const FileSystemHandles &);
+        FileSystemHandles &operator=(const FileSystemHandles &);
+
+        TSK_IMG_INFO *image;
+        std::map<TSK_OFF_T, TSK_FS_INFO*> fileSystems;
+
+        // The last file opened.
+        TSK_FS_FILE *file;
+        TSK_OFF_T fileSystemOffset;
+        TSK_INUM_T fileSystemFileId;
+    };
+
+    // True while report() runs if the image has an NTFS file system, and the report thread's handles on the image's
+    // file systems, to look up the initialized sizes of its files.
+    bool checkInitializedSizes = false;
+    FileSystemHandles reportFileSystems;
+
+    /**
+     * Gets the initialized size of a file's content. NTFS files can be 
+     * allocated, and sized, beyond their initialized size (the valid data 
+     * length), past which they read as zeros whatever their sectors hold, so
+     * their sector runs only hold their content up to it.
+     *
+     * @return False if the initialized size could not be determined.
+     */
+    bool getInitializedSize(uint64_t fileId, TSK_OFF_T size, TSK_OFF_T &initializedSize)
+    {
+        initializedSize = size;
+        if (!checkInitializedSizes)
+        {
+            return true;
+        }
+
+        uint64_t fsOffset = 0;
+        uint64_t fsFileId = 0;
+        int attrType = 0;
+        int attrId = 0;
+        if (TskServices::Instance().getImgDB().getFileUniqueIdentifiers(fileId, fsOffset, fsFileId, attrType, attrId) != 0)
+        {
+            return false;
+        }
+        TSK_FS_FILE *file = reportFileSystems.openFile(static_cast<TSK_OFF_T>(fsOffset), static_cast<TSK_INUM_T>(fsFileId));
+        if (file == NULL)
+        {
+            return false;
+        }
+        if (!TSK_FS_TYPE_ISNTFS(file->fs_info->ftype))
+        {
+            return true;
+        }
+        const TSK_FS_ATTR *attribute = tsk_fs_file_attr_get_type(file, static_cast<TSK_FS_ATTR_TYPE_ENUM>(attrType), static_cast<uint16_t>(attrId), 1);
+        if (attribute == NULL)
+        {
+            tsk_error_reset();
+            return false;
+        }
+        if ((attribute->flags & TSK_FS_ATTR_NONRES) != 0 && attribute->nrd.initsize < size)
+        {
+            initializedSize = attribute->nrd.initsize;
+        }
+        return true;
+    }
+
+    /**
+     * Prepares to look up initialized sizes if the image has an NTFS file 
+     * system, whose files may be only partly initialized. If the image 
+     * cannot be opened, no initialized size can be determined, and files on
+     * it are read through the file system layer.
+     */
+    void openReportFileSystems()
+    {
+        std::list<TskFsInfoRecord> fileSystems;
+        TskServices::Instance().getImgDB().getFsInfo(fileSystems);
+        for (std::list<TskFsInfoRecord>::const_iterator fileSystem = fileSystems.begin(); fileSystem != fileSystems.end(); ++fileSystem)
+        {
+            if (TSK_FS_TYPE_ISNTFS((*fileSystem).fs_type))
+            {
+                checkInitializedSizes = true;
+                try
+                {
+                    reportFileSystems.open(TskServices::Instance().getImageFile().getFileNames());
+                }
+                catch (TskException &)
+                {
+                    // The handles stay closed, and no initialized size can be determined.
+                }
+                return;
+            }
+        }
+    }
+
+    void closeReportFileSystems()
+    {
+        reportFileSystems.close();
+        checkInitializedSizes = false;
+    }
+
+    /**
+     * Gets the runs of image sectors allocated to a file, in file order.
+     *
+     * @return False if the file's content cannot be mapped directly to image
+     * sectors (e.g., it is resident, compressed, sparse or not a file system
+     * file).
+     */
+    bool getFileSectorRuns(uint64_t fileId, TskImgDB::FILE_TYPES typeId, TSK_FS_META_FLAG_ENUM metaFlags, TSK_OFF_T size, SectorRunList &runs)
+    {
+        runs.clear();
+        if (typeId != TskImgDB::IMGDB_FILES_TYPE_FS || size <= 0 || (metaFlags & TSK_FS_META_FLAG_COMP) != 0)
+        {
+            return false;
+        }
+
+        if (!metadataReplica.findSectorRuns(fileId, runs))
+        {
+            querySectorRuns(fileId, runs);
+        }
+        if (runs.empty())
+        {
+            return false;
+        }
+
+        // Sparse runs are not recorded in the image database, so runs that do not cover the whole file cannot be 
+        // mapped to file offsets.
+        const SectorRun &lastRun = runs.back();
+        return lastRun.logicalOffset + static_cast<TSK_OFF_T>(lastRun.count * SECTOR_SIZE) >= size;
+    }
+
+    bool getFileSectorRuns(const TskFile &file, SectorRunList &runs)
+    {
+        return getFileSectorRuns(file.getId(), file.getTypeId(), file.getMetaFlags(), file.getSize(), runs);
+    }
+
+    /**
+     * The location in the image of the last sector holding data of a file and
+     * of the slack space that follows it.
+     */
+    struct FileTail
+    {
+        FileTail() : logicalOffset(0), sector(0), sectorCount(0) {}
+
+        // Offset within the file of the start of the last sector holding data.
+        TSK_OFF_T logicalOffset;
+
+        // The run of sectors from the last sector holding data to the end of its sector run.
+        uint64_t sector;
+        uint64_t sectorCount;
+
+        // Any further sector runs allocated to the file, which are entirely slack.
+        std::vector<std::pair<uint64_t, uint64_t> > slackRuns;
+    };
+
+    /**
+     * Locates the tail of a file in the image from its sector runs. 
+     */
+    void locateFileTail(const TskFile &file, const SectorRunList &runs, FileTail &tail)
+    {
+        const TSK_OFF_T lastDataSectorOffset = ((file.getSize() - 1) / SECTOR_SIZE) * SECTOR_SIZE;
+        bool tailFound = false;
+        for (SectorRunList::const_iterator run = runs.begin(); run != runs.end(); ++run)
+        {
+            if (tailFound)
+            {
+                tail.slackRuns.push_back(std::make_pair((*run).sector, (*run).count));
+            }
+            else if (lastDataSectorOffset < (*run).logicalOffset + static_cast<TSK_OFF_T>((*run).count * SECTOR_SIZE))
+            {
+                uint64_t sectorInRun = static_cast<uint64_t>(lastDataSectorOffset - (*run).logicalOffset) / SECTOR_SIZE;
+                tail.logicalOffset = lastDataSectorOffset;
+                tail.sector = (*run).sector + sectorInRun;
+                tail.sectorCount = (*run).count - sectorInRun;
+                tailFound = true;
+            }
+        }
+    }
+
+    /**
+     * Records the evidence reads made by report() to a read trace file (see
+     * ReadTrace.h), mapping reads of file content to image offsets through the
+     * files' sector runs.
+     */
+    class ReadTraceLog
+    {
+    public:
+        ReadTraceLog() {}
+
+        void open(const std::string &path)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            std::vector<std::string> imageFileNames;
+            try
+            {
+                imageFileNames = TskServices::Instance().getImageFile().getFileNames();
+            }
+            catch (TskException &)
+            {
+                // Without an image file service the image names are unknown; the trace is still useful for analysis.
+            }
+            stream.reset(new Poco::FileOutputStream(path, std::ios::out | std::ios::trunc | std::ios::binary));
+            writer.reset(new ReadTrace::Writer(*stream, imageFileNames));
+            start.update();
+        }
+
+        bool isOpen() const
+        {
+            return writer.get() != NULL;
+        }
+
+        void close()
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            writer.reset();
+            if (stream.get() != NULL)
+            {
+                stream->close();
+                stream.reset();
+            }
+        }
+
+        /**
+         * Records a read of file content.
+         *
+         * @param fileId The id of the file.
+         * @param runs The sector runs of the file, or NULL if its content is 
+         * not stored in plain sector runs.
+         * @param offset The offset of the read within the file.
+         * @param length The number of bytes read.
+         */
+        void traceFileRead(uint64_t fileId, const SectorRunList *runs, TSK_OFF_T offset, uint64_t length)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            ReadTrace::Record record;
+            record.fileId = fileId;
+            record.timestamp = static_cast<uint64_t>(start.elapsed());
+            if (runs == NULL)
+            {
+                record.mapped = false;
+                record.offset = static_cast<uint64_t>(offset);
+                record.length = length;
+                writer->write(record);
+                return;
+            }
+
+            // Split the read at run boundaries.
+            const TSK_OFF_T end = offset + static_cast<TSK_OFF_T>(length);
+            for (SectorRunList::const_iterator run = runs->begin(); run != runs->end(); ++run)
+            {
+                TSK_OFF_T runEnd = (*run).logicalOffset + static_cast<TSK_OFF_T>((*run).count * SECTOR_SIZE);
+                TSK_OFF_T overlapStart = std::max(offset, (*run).logicalOffset);
+                TSK_OFF_T overlapEnd = std::min(end, runEnd);
+                if (overlapStart < overlapEnd)
+                {
+                    record.offset = (*run).sector * SECTOR_SIZE + static_cast<uint64_t>(overlapStart - (*run).logicalOffset);
+                    record.length = static_cast<uint64_t>(overlapEnd - overlapStart);
+                    writer->write(record);
+                }
+            }
+        }
+
+        /**
+         * Records a read of image sectors on behalf of a file.
+         */
+        void traceImageRead(uint64_t fileId, uint64_t sector, uint64_t sectorCount)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            ReadTrace::Record record;
+            record.fileId = fileId;
+            record.timestamp = static_cast<uint64_t>(start.elapsed());
+            record.offset = sector * SECTOR_SIZE;
+            record.length = sectorCount * SECTOR_SIZE;
+            writer->write(record);
+        }
+
+    private:
+        ReadTraceLog(const ReadTraceLog &);
+        ReadTraceLog &operator=(const ReadTraceLog &);
+
+        Poco::FastMutex mutex;
+        std::auto_ptr<Poco::FileOutputStream> stream;
+        std::auto_ptr<ReadTrace::Writer> writer;
+        Poco::Timestamp start;
+    };
+
+    ReadTraceLog readTraceLog;
+
+    // Size of the image blocks read ahead by the read workers. EWF images are compressed in 32 KB chunks by default, 
+    // so each block is one chunk to inflate.
+    const uint64_t READ_AHEAD_BLOCK_SIZE = 32 * 1024;
+
+    /**
+     * A pool of worker threads whose number working at once can be limited,
+     * e.g., by the pressure monitor while the host is under pressure.
+     */
+    class ThrottledPool
+    {
+    public:
+        virtual ~ThrottledPool() {}
+
+        /**
+         * Sets the number of workers that may work at once.
+         */
+        virtual void setAllowedWorkers(unsigned int workerCount) = 0;
+    };
+
+    /**
+     * Reads the image blocks holding the content of the files about to be 
+     * saved ahead of the export, on a pool of worker threads that each have 
+     * their own image handle, and caches them until the files are saved. For
+     * compressed images (e.g., E01) this spreads the inflation of chunks, 
+     * which the image layer does one at a time on a single handle, across 
+     * cores.
+     */
+    class ReadAhead : public Poco::Runnable, public ThrottledPool
+    {
+    public:
+        ReadAhead() : stopping(false), cachedBlocks(0), workersRunning(0), allowedWorkers(0), busyWorkers(0) {}
+
+        ~ReadAhead()
+        {
+            stop();
+        }
+
+        /**
+         * Starts the given number of workers on the image files.
+         */
+        void start(unsigned int workerCount)
+        {
+            stop();
+            stopping = false;
+            try
+            {
+                imageFileNames = TskServices::Instance().getImageFile().getFileNames();
+            }
+            catch (TskException &)
+            {
+                imageFileNames.clear();
+            }
+            if (imageFileNames.empty())
+            {
+                return;
+            }
+            workersRunning = workerCount;
+            allowedWorkers = workerCount;
+            for (unsigned int i = 0; i < workerCount; ++i)
+            {
+                threads.push_back(new Poco::Thread());
+                threads.back()->start(*this);
+            }
+        }
+
+        /**
+         * Stops the workers and empties the cache.
+         */
+        void stop()
+        {
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                stopping = true;
+                blockAvailable.broadcast();
+            }
+            for (std::vector<Poco::Thread*>::iterator thread = threads.begin(); thread != threads.end(); ++thread)
+            {
+                (*thread)->join();
+                delete *thread;
+            }
+            threads.clear();
+
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            queue.clear();
+            blocks.clear();
+            files.clear();
+            cachedBlocks = 0;
+        }
+
+        bool isRunning() const
+        {
+            return !threads.empty();
+        }
+
+        /**
+         * Sets the number of workers that may read blocks at once. With no
+         * workers allowed, files are read through the image file service.
+         */
+        void setAllowedWorkers(unsigned int workerCount)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            allowedWorkers = workerCount;
+            blockAvailable.broadcast();
+            blockRead.broadcast();
+        }
+
+        unsigned int getAllowedWorkers()
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            return allowedWorkers;
+        }
+
+        /**
+         * @return The number of bytes of blocks scheduled or cached.
+         */
+        uint64_t getCachedBytes()
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            return cachedBlocks * READ_AHEAD_BLOCK_SIZE;
+        }
+
+        /**
+         * Schedules the blocks holding the content of a file to be read.
+         */
+        void schedule(uint64_t fileId, const SectorRunList &runs, TSK_OFF_T size)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            if (files.find(fileId) != files.end())
+            {
+                // The file appears more than once in the plan.
+                return;
+            }
+            ScheduledFile &file = files[fileId];
+            file.runs = runs;
+            for (SectorRunList::const_iterator run = runs.begin(); run != runs.end() && (*run).logicalOffset < size; ++run)
+            {
+                uint64_t start = (*run).sector * SECTOR_SIZE;
+                uint64_t end = start + std::min<uint64_t>((*run).count * SECTOR_SIZE, static_cast<uint64_t>(size - (*run).logicalOffset));
+                for (uint64_t block = start / READ_AHEAD_BLOCK_SIZE; block * READ_AHEAD_BLOCK_SIZE < end; ++block)
+                {
+                    if (!file.blocks.empty() && file.blocks.back() == block)
+                    {
+                        continue;
+                    }
+                    file.blocks.push_back(block);
+                    CachedBlock &cachedBlock = blocks[block];
+                    if (cachedBlock.references++ == 0)
+                    {
+                        ++cachedBlocks;
+                        queue.push_back(block);
+                        blockAvailable.signal();
+                    }
+                }
+            }
+        }
+
+        /**
+         * @return True if the file was scheduled, in which case runs is set to
+         * its sector runs.
+         */
+        bool findScheduledFile(uint64_t fileId, SectorRunList &runs)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            std::map<uint64_t, ScheduledFile>::const_iterator file = files.find(fileId);
+            if (file == files.end())
+            {
+                return false;
+            }
+            runs = (*file).second.runs;
+            return true;
+        }
+
+        /**
+         * Copies image data from the cached blocks of a scheduled file, 
+         * waiting for blocks that have not been read yet. Blocks that are not
+         * cached, or that a worker failed to read, are read through the 
+         * image file service.
+         */
+        void read(uint64_t imageOffset, char *buffer, size_t length)
+        {
+            while (length > 0)
+            {
+                const uint64_t block = imageOffset / READ_AHEAD_BLOCK_SIZE;
+                const size_t offsetInBlock = static_cast<size_t>(imageOffset % READ_AHEAD_BLOCK_SIZE);
+                const size_t count = std::min(length, static_cast<size_t>(READ_AHEAD_BLOCK_SIZE) - offsetInBlock);
+                bool copied = false;
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    std::map<uint64_t, CachedBlock>::iterator cachedBlock = blocks.find(block);
+                    while (cachedBlock != blocks.end() && !(*cachedBlock).second.done && workersRunning > 0 && allowedWorkers > 0)
+                    {
+                        blockRead.wait(mutex);
+                        cachedBlock = blocks.find(block);
+                    }
+                    if (cachedBlock != blocks.end() && (*cachedBlock).second.done && offsetInBlock + count <= (*cachedBlock).second.data.size())
+                    {
+                        memcpy(buffer, &(*cachedBlock).second.data[offsetInBlock], count);
+                        copied = true;
+                    }
+                }
+                if (!copied)
+                {
+                    readThroughImageFile(imageOffset, buffer, count);
+                }
+                imageOffset += count;
+                buffer += count;
+                length -= count;
+            }
+        }
+
+        /**
+         * Releases the cached blocks of a file once it has been saved (or has
+         * failed to be).
+         */
+        void release(uint64_t fileId)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            std::map<uint64_t, ScheduledFile>::iterator file = files.find(fileId);
+            if (file == files.end())
+            {
+                return;
+            }
+            for (std::vector<uint64_t>::const_iterator block = (*file).second.blocks.begin(); block != (*file).second.blocks.end(); ++block)
+            {
+                std::map<uint64_t, CachedBlock>::iterator cachedBlock = blocks.find(*block);
+                if (cachedBlock != blocks.end() && --(*cachedBlock).second.references == 0)
+                {
+                    // A block that is still queued is dropped from the cache here and skipped by the workers.
+                    blocks.erase(cachedBlock);
+                    --cachedBlocks;
+                }
+            }
+            files.erase(file);
+        }
+
+        void run()
+        {
+            PerfCounters counters;
+            if (options.perfCounters)
+            {
+                counters.open();
+            }
+            PhaseTimer timer("read worker", "read blocks", counters);
+
+            std::vector<const char*> names;
+            for (std::vector<std::string>::const_iterator imageFileName = imageFileNames.begin(); imageFileName != imageFileNames.end(); ++imageFileName)
+            {
+                names.push_back((*imageFileName).c_str());
+            }
+
+            // Each worker opens its own handle, so that workers inflate chunks in parallel rather than in turn.
+            TSK_IMG_INFO *image = tsk_img_open_utf8(static_cast<int>(names.size()), &names[0], TSK_IMG_TYPE_DETECT, 0);
+            if (image == NULL)
+            {
+                tsk_error_reset();
+                workerStopped();
+                return;
+            }
+
+            std::vector<char> data(static_cast<size_t>(READ_AHEAD_BLOCK_SIZE));
+            for (;;)
+            {
+                uint64_t block = 0;
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    while ((queue.empty() || busyWorkers >= allowedWorkers) && !stopping)
+                    {
+                        blockAvailable.wait(mutex);
+                    }
+                    if (stopping)
+                    {
+                        break;
+                    }
+                    block = queue.front();
+                    queue.pop_front();
+                    if (blocks.find(block) == blocks.end())
+                    {
+                        // Released before it was read.
+                        continue;
+                    }
+                    ++busyWorkers;
+                }
+
+                TSK_OFF_T offset = static_cast<TSK_OFF_T>(block * READ_AHEAD_BLOCK_SIZE);
+                size_t length = static_cast<size_t>(std::min<TSK_OFF_T>(static_cast<TSK_OFF_T>(READ_AHEAD_BLOCK_SIZE), image->size - offset));
+                ssize_t bytesRead = length > 0 ? tsk_img_read(image, offset, &data[0], length) : -1;
+                if (bytesRead < 0)
+                {
+                    tsk_error_reset();
+                }
+
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                --busyWorkers;
+                blockAvailable.signal();
+                std::map<uint64_t, CachedBlock>::iterator cachedBlock = blocks.find(block);
+                if (cachedBlock != blocks.end())
+                {
+                    // A failed read leaves the block empty, and the reader reads it through the image file service.
+                    if (bytesRead > 0)
+                    {
+                        (*cachedBlock).second.data.assign(data.begin(), data.begin() + bytesRead);
+                    }
+                    (*cachedBlock).second.done = true;
+                    blockRead.broadcast();
+                }
+            }
+
+            tsk_img_close(image);
+            workerStopped();
+        }
+
+    private:
+        ReadAhead(const ReadAhead &);
+        ReadAhead &operator=(const ReadAhead &);
+
+        void workerStopped()
+        {
+            // Once no workers are left, readers stop waiting for blocks and read them through the image file service.
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            --workersRunning;
+            blockRead.broadcast();
+        }
+
+        void readThroughImageFile(uint64_t imageOffset, char *buffer, size_t length)
+        {
+            const uint64_t firstSector = imageOffset / SECTOR_SIZE;
+            const uint64_t sectorCount = (imageOffset + length + SECTOR_SIZE - 1) / SECTOR_SIZE - firstSector;
+            std::vector<char> sectors(static_cast<size_t>(sectorCount * SECTOR_SIZE));
+            if (TskServices::Instance().getImageFile().getSectorData(firstSector, sectorCount, &sectors[0]) != static_cast<int>(sectorCount))
+            {
+                throw Poco::ReadFileException("failed to read image at offset " + Poco::NumberFormatter::format(imageOffset));
+            }
+            memcpy(buffer, &sectors[static_cast<size_t>(imageOffset - firstSector * SECTOR_SIZE)], length);
+        }
+
+        struct CachedBlock
+        {
+            CachedBlock() : references(0), done(false) {}
+
+            // The number of scheduled files with content in the block.
+            unsigned int references;
+
+            // True once a worker has tried to read the block.
+            bool done;
+            std::vector<char> data;
+        };
+
+        struct ScheduledFile
+        {
+            SectorRunList runs;
+            std::vector<uint64_t> blocks;
+        };
+
+        Poco::FastMutex mutex;
+        Poco::Condition blockAvailable;
+        Poco::Condition blockRead;
+        bool stopping;
+        std::vector<std::string> imageFileNames;
+        std::vector<Poco::Thread*> threads;
+        std::deque<uint64_t> queue;
+        std::map<uint64_t, CachedBlock> blocks;
+        std::map<uint64_t, ScheduledFile> files;
+        uint64_t cachedBlocks;
+        unsigned int workersRunning;
+
+        // The number of workers that may read blocks at once, and the number reading blocks.
+        unsigned int allowedWorkers;
+        unsigned int busyWorkers;
+    };
+
+    ReadAhead readAhead;
+
+    // Bytes of a compressed file each decompression worker reads at a time. This is a whole number of compression 
+    // units on NTFS (16 clusters, 64 KB for 4 KB clusters) and HFS+ (64 KB blocks), so no unit is inflated twice.
+    const size_t DECOMPRESS_RANGE_SIZE = 1024 * 1024;
+
+    /**
+     * Reads the content of files compressed by their file system (NTFS 
+     * LZNT1 and LZX, HFS+ zlib and LZVN) in ranges of whole compression units
+     * on a pool of worker threads that each have their own image and file 
+     * system handles, so that the units are inflated across cores rather 
+     * than one at a time on the report thread. The ranges are written out in
+     * order as they complete, with a bounded number read ahead of the one 
+     * being written. Ranges the workers do not read, e.g., while the 
+     * pressure monitor holds them back, are read on the report thread.
+     */
+    class ParallelDecompressor : public Poco::Runnable, public ThrottledPool
+    {
+    public:
+        ParallelDecompressor() : stopping(false), workersRunning(0), allowedWorkers(0), busyWorkers(0), generation(0) {}
+
+        ~ParallelDecompressor()
+        {
+            stop();
+        }
+
+        /**
+         * Starts the given number of workers on the image files.
+         */
+        void start(unsigned int workerCount)
+        {
+            stop();
+            stopping = false;
+            try
+            {
+                imageFileNames = TskServices::Instance().getImageFile().getFileNames();
+            }
+            catch (TskException &)
+            {
+                imageFileNames.clear();
+            }
+            if (imageFileNames.empty())
+            {
+                return;
+            }
+            workersRunning = workerCount;
+            allowedWorkers = workerCount;
+            for (unsigned int i = 0; i < workerCount; ++i)
+            {
+                threads.push_back(new Poco::Thread());
+                threads.back()->start(*this);
+            }
+        }
+
+        /**
+         * Stops the workers.
+         */
+        void stop()
+        {
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                stopping = true;
+                rangeAvailable.broadcast();
+            }
+            for (std::vector<Poco::Thread*>::iterator thread = threads.begin(); thread != threads.end(); ++thread)
+            {
+                (*thread)->join();
+                delete *thread;
+            }
+            threads.clear();
+
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            queue.clear();
+            results.clear();
+        }
+
+        bool isRunning() const
+        {
+            return !threads.empty();
+        }
+
+        /**
+         * Sets the number of workers that may read ranges at once. With no
+         * workers allowed, ranges are read on the report thread.
+         */
+        void setAllowedWorkers(unsigned int workerCount)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            allowedWorkers = workerCount;
+            rangeAvailable.broadcast();
+            rangeRead.broadcast();
+        }
+
+        /**
+         * Reads the first bytes of a compressed file through the workers and
+         * writes them to an output file in order, accumulating content 
+         * statistics from the same buffers. Ranges the workers fail to read,
+         * or are not allowed to, are read through the file system layer.
+         *
+         * @return False if the file's identifiers could not be looked up, in
+         * which case nothing has been written and the file should be read 
+         * through the file system layer.
+         */
+        bool readFile(TskFile &file, TSK_OFF_T bytesToRead, FileSink &outputFile, SavedFile &savedFile)
+        {
+            uint64_t fsOffset = 0;
+            uint64_t fsFileId = 0;
+            int attrType = 0;
+            int attrId = 0;
+            if (TskServices::Instance().getImgDB().getFileUniqueIdentifiers(file.getId(), fsOffset, fsFileId, attrType, attrId) != 0)
+            {
+                return false;
+            }
+
+            Range range;
+            range.fsOffset = static_cast<TSK_OFF_T>(fsOffset);
+            range.fsFileId = static_cast<TSK_INUM_T>(fsFileId);
+            range.attrType = attrType;
+            range.attrId = attrId;
+
+            const size_t rangeCount = static_cast<size_t>((bytesToRead + DECOMPRESS_RANGE_SIZE - 1) / DECOMPRESS_RANGE_SIZE);
+            const size_t window = threads.size() * 2;
+            size_t rangesQueued = 0;
+            Result result;
+            bool fileOpen = false;
+            try
+            {
+                for (size_t index = 0; index < rangeCount; ++index)
+                {
+                    {
+                        Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                        range.generation = generation;
+                        for (; rangesQueued < rangeCount && rangesQueued < index + window; ++rangesQueued)
+                        {
+                            range.index = rangesQueued;
+                            range.offset = static_cast<TSK_OFF_T>(rangesQueued) * DECOMPRESS_RANGE_SIZE;
+                            range.length = static_cast<size_t>(std::min<TSK_OFF_T>(DECOMPRESS_RANGE_SIZE, bytesToRead - range.offset));
+                            queue.push_back(range);
+                            rangeAvailable.signal();
+                        }
+                        std::map<size_t, Result>::iterator done = results.find(index);
+                        while (done == results.end() && workersRunning > 0 && allowedWorkers > 0)
+                        {
+                            rangeRead.wait(mutex);
+                            done = results.find(index);
+                        }
+                        result.ok = false;
+                        if (done != results.end())
+                        {
+                            result.ok = (*done).second.ok;
+                            result.data.swap((*done).second.data);
+                            results.erase(done);
+                        }
+                    }
+
+                    if (!result.ok)
+                    {
+                        if (!fileOpen)
+                        {
+                            file.open();
+                            fileOpen = true;
+                        }
+                        const TSK_OFF_T rangeOffset = static_cast<TSK_OFF_T>(index) * DECOMPRESS_RANGE_SIZE;
+                        if (!readRange(file, rangeOffset, static_cast<size_t>(std::min<TSK_OFF_T>(DECOMPRESS_RANGE_SIZE, bytesToRead - rangeOffset)), 
+                            result.data))
+                        {
+                            throw Poco::ReadFileException("failed to decompress file with id " + Poco::NumberFormatter::format(file.getId()));
+                        }
+                    }
+                    if (readTraceLog.isOpen())
+                    {
+                        readTraceLog.traceFileRead(file.getId(), NULL, static_cast<TSK_OFF_T>(index) * DECOMPRESS_RANGE_SIZE, result.data.size());
+                    }
+                    savedFile.stats.update(reinterpret_cast<const unsigned char*>(&result.data[0]), result.data.size());
+                    outputFile.write(&result.data[0], result.data.size());
+                }
+            }
+            catch (...)
+            {
+                cancel();
+                if (fileOpen)
+                {
+                    file.close();
+                }
+                throw;
+            }
+            cancel();
+            if (fileOpen)
+            {
+                file.close();
+            }
+            return true;
+        }
+
+        void run()
+        {
+            PerfCounters counters;
+            if (options.perfCounters)
+            {
+                counters.open();
+            }
+            PhaseTimer timer("decompression worker", "decompress ranges", counters);
+
+            // Each worker opens its own image and file systems, since TSK file system handles are not safe to share 
+            // between threads. The last file stays open, since the ranges of a file are read one after another.
+            FileSystemHandles handles;
+            if (!handles.open(imageFileNames))
+            {
+                workerStopped();
+                return;
+            }
+
+            std::vector<char> data(DECOMPRESS_RANGE_SIZE);
+            for (;;)
+            {
+                Range range;
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    while ((queue.empty() || busyWorkers >= allowedWorkers) && !stopping)
+                    {
+                        rangeAvailable.wait(mutex);
+                    }
+                    if (stopping)
+                    {
+                        break;
+                    }
+                    range = queue.front();
+                    queue.pop_front();
+                    ++busyWorkers;
+                }
+
+                TSK_FS_FILE *fsFile = handles.openFile(range.fsOffset, range.fsFileId);
+                size_t bytesRead = 0;
+                while (fsFile != NULL && bytesRead < range.length)
+                {
+                    ssize_t count = tsk_fs_file_read_type(fsFile, static_cast<TSK_FS_ATTR_TYPE_ENUM>(range.attrType), static_cast<uint16_t>(range.attrId), 
+                        range.offset + static_cast<TSK_OFF_T>(bytesRead), &data[bytesRead], range.length - bytesRead, TSK_FS_FILE_READ_FLAG_NONE);
+                    if (count <= 0)
+                    {
+                        break;
+                    }
+                    bytesRead += static_cast<size_t>(count);
+                }
+                if (bytesRead < range.length)
+                {
+                    tsk_error_reset();
+                }
+
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                --busyWorkers;
+                rangeAvailable.signal();
+                if (range.generation == generation)
+                {
+                    Result &result = results[range.index];
+                    result.ok = bytesRead == range.length;
+                    if (result.ok)
+                    {
+                        result.data.assign(data.begin(), data.begin() + bytesRead);
+                    }
+                    rangeRead.broadcast();
+                }
+            }
+
+            handles.close();
+            workerStopped();
+        }
+
+    private:
+        ParallelDecompressor(const ParallelDecompressor &);
+        ParallelDecompressor &operator=(const ParallelDecompressor &);
+
+        /**
+         * Reads a range of a file through the file system layer on the 
+         * calling thread.
+         *
+         * @return False if the range could not be read whole.
+         */
+        static bool readRange(TskFile &file, TSK_OFF_T offset, size_t length, std::vector<char> &data)
+        {
+            if (file.seek(offset) != offset)
+            {
+                return false;
+            }
+            data.resize(length);
+            size_t bytesRead = 0;
+            while (bytesRead < length)
+            {
+                ssize_t count = file.read(&data[bytesRead], length - bytesRead);
+                if (count <= 0)
+                {
+                    return false;
+                }
+                bytesRead += static_cast<size_t>(count);
+            }
+            return true;
+        }
+
+        void workerStopped()
+        {
+            // Once no workers are left, readFile() stops waiting for ranges.
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            --workersRunning;
+            rangeRead.broadcast();
+        }
+
+        /**
+         * Drops the ranges of the current file that are queued or read, and 
+         * has the workers discard those being read.
+         */
+        void cancel()
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            queue.clear();
+            results.clear();
+            ++generation;
+        }
+
+        struct Range
+        {
+            Range() : generation(0), index(0), fsOffset(0), fsFileId(0), attrType(0), attrId(0), offset(0), length(0) {}
+
+            // The file the range belongs to, and its position among the file's ranges.
+            unsigned long generation;
+            size_t index;
+
+            TSK_OFF_T fsOffset;
+            TSK_INUM_T fsFileId;
+            int attrType;
+            int attrId;
+            TSK_OFF_T offset;
+            size_t length;
+        };
+
+        struct Result
+        {
+            Result() : ok(false) {}
+
+            bool ok;
+            std::vector<char> data;
+        };
+
+        Poco::FastMutex mutex;
+        Poco::Condition rangeAvailable;
+        Poco::Condition rangeRead;
+        bool stopping;
+        std::vector<std::string> imageFileNames;
+        std::vector<Poco::Thread*> threads;
+        std::deque<Range> queue;
+        std::map<size_t, Result> results;
+        unsigned int workersRunning;
+
+        // The number of workers that may read ranges at once, and the number reading.
+        unsigned int allowedWorkers;
+        unsigned int busyWorkers;
+        unsigned long generation;
+    };
+
+    ParallelDecompressor parallelDecompressor;
+
+    // Interval between samples of the host's pressure stall information.
+    const long PRESSURE_SAMPLE_INTERVAL_MS = 1000;
+
+    /**
+     * Backs the export off while the host is under I/O, memory or CPU 
+     * pressure from other jobs, as reported by Linux pressure stall 
+     * information (PSI): the share of the last 10 seconds in which some tasks
+     * were stalled waiting for each resource. Each second, if any share 
+     * exceeds its threshold, the number of file copies allowed in flight is
+     * halved; once all are below their thresholds it grows back by one per 
+     * second. The copies are the report thread's own and those of the 
+     * largest worker pool; each registered pool (the read workers, the 
+     * decompression workers and the image compression workers) is allowed 
+     * its share of the copies beyond the report thread's. With none allowed, the report thread waits for 
+     * the next sample before each file, so the export slows to a file a 
+     * second but never stops. The staging mover waits for the next sample 
+     * before each chunk it copies until all copies are allowed again. Where
+     * PSI is unavailable (other platforms, or kernels before 4.20 or built 
+     * without it), the monitor does not start.
+     */
+    class PressureMonitor : public Poco::Runnable
+    {
+    public:
+        PressureMonitor() : stopping(false), maxCopies(0), allowedCopies(0), samples(0), pauses(0) {}
+
+        ~PressureMonitor()
+        {
+            stop();
+        }
+
+        /**
+         * Starts sampling, if any threshold is set and the host reports PSI 
+         * for its resource. Logs a warning for each threshold that is set for
+         * a resource the host does not report.
+         *
+         * @param workerCount The number of workers in the largest pool to be
+         * registered.
+         */
+        void start(unsigned int workerCount)
+        {
+            stop();
+            const char *RESOURCES[] = { "io", "memory", "cpu" };
+            const unsigned int thresholds[] = { options.ioPressureThreshold, options.memoryPressureThreshold, options.cpuPressureThreshold };
+            bool available = false;
+            for (size_t i = 0; i < sizeof(thresholds) / sizeof(thresholds[0]); ++i)
+            {
+                double share = 0.0;
+                if (thresholds[i] == 0)
+                {
+                    continue;
+                }
+                if (readStallShare(RESOURCES[i], share))
+                {
+                    available = true;
+                }
+                else
+                {
+                    LOGWARN("SaveInterestingFilesModule::report : ignoring " + std::string(RESOURCES[i]) + 
+                        "pressure, since the host does not report pressure stall information in /proc/pressure/" + RESOURCES[i]);
+                }
+            }
+            if (!available)
+            {
+                return;
+            }
+            stopping = false;
+            maxCopies = workerCount + 1;
+            allowedCopies = maxCopies;
+            samples = 0;
+            pauses = 0;
+            thread.reset(new Poco::Thread());
+            thread->start(*this);
+        }
+
+        /**
+         * Stops sampling and adds the time spent backing off to the run 
+         * statistics.
+         */
+        void stop()
+        {
+            if (thread.get() == NULL)
+            {
+                return;
+            }
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                stopping = true;
+                sampled.broadcast();
+            }
+            thread->join();
+            thread.reset();
+
+            // Let the pools and the staging mover run at full speed again.
+            for (std::map<ThrottledPool*, unsigned int>::iterator pool = pools.begin(); pool != pools.end(); ++pool)
+            {
+                (*pool).first->setAllowedWorkers((*pool).second);
+            }
+            pools.clear();
+            allowedCopies = maxCopies;
+
+            Poco::ScopedLock<Poco::FastMutex> lock(runStatisticsLock);
+            runStatistics.pressureSamples += samples;
+            runStatistics.pressurePauses += pauses;
+        }
+
+        bool isRunning() const
+        {
+            return thread.get() != NULL;
+        }
+
+        /**
+         * Called by the report thread before it copies a file. Waits for the
+         * next sample if no copies are allowed.
+         */
+        void throttle()
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            if (allowedCopies == 0 && !stopping)
+            {
+                ++pauses;
+                sampled.tryWait(mutex, PRESSURE_SAMPLE_INTERVAL_MS);
+            }
+        }
+
+        /**
+         * Called by the staging mover before it copies a chunk of a file. 
+         * Waits for the next sample unless all copies are allowed.
+         */
+        void throttleBackground()
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            if (allowedCopies < maxCopies && !stopping)
+            {
+                sampled.tryWait(mutex, PRESSURE_SAMPLE_INTERVAL_MS);
+            }
+        }
+
+        /**
+         * Has a pool of workers throttled with the report thread until it is
+         * removed or the monitor stops. Does nothing if the monitor is not 
+         * running.
+         *
+         * @param workerCount The number of workers in the pool.
+         */
+        void addPool(ThrottledPool &pool, unsigned int workerCount)
+        {
+            if (thread.get() == NULL)
+            {
+                return;
+            }
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            pools[&pool] = workerCount;
+            pool.setAllowedWorkers(allowedWorkers(workerCount));
+        }
+
+        /**
+         * Stops throttling a pool, e.g., before it is destroyed. The pool is
+         * left with the workers it was last allowed.
+         */
+        void removePool(ThrottledPool &pool)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            pools.erase(&pool);
+        }
+
+        void run()
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            while (!stopping)
+            {
+                sampled.tryWait(mutex, PRESSURE_SAMPLE_INTERVAL_MS);
+                if (stopping)
+                {
+                    break;
+                }
+
+                bool underPressure = false;
+                {
+                    Poco::ScopedUnlock<Poco::FastMutex> unlock(mutex);
+                    underPressure = exceedsThreshold("io", options.ioPressureThreshold) || 
+                        exceedsThreshold("memory", options.memoryPressureThreshold) || 
+                        exceedsThreshold("cpu", options.cpuPressureThreshold);
+                }
+                if (underPressure)
+                {
+                    ++samples;
+                    allowedCopies /= 2;
+                }
+                else if (allowedCopies < maxCopies)
+                {
+                    ++allowedCopies;
+                }
+
+                for (std::map<ThrottledPool*, unsigned int>::iterator pool = pools.begin(); pool != pools.end(); ++pool)
+                {
+                    (*pool).first->setAllowedWorkers(allowedWorkers((*pool).second));
+                }
+                sampled.broadcast();
+            }
+        }
+
+    private:
+        PressureMonitor(const PressureMonitor &);
+        PressureMonitor &operator=(const PressureMonitor &);
+
+        /**
+         * @return The share of a pool's workers allowed to work. The report
+         * thread's copy is the first allowed, so the largest pool gets the 
+         * rest and smaller pools proportionally fewer.
+         */
+        unsigned int allowedWorkers(unsigned int workerCount) const
+        {
+            return static_cast<unsigned int>(static_cast<uint64_t>(workerCount) * allowedCopies / maxCopies);
+        }
+
+        static bool exceedsThreshold(const std::string &resource, unsigned int threshold)
+        {
+            double share = 0.0;
+            return threshold != 0 && readStallShare(resource, share) && share > threshold;
+        }
+
+        /**
+         * Reads the percentage of the last 10 seconds in which some tasks were
+         * stalled on a resource ("io", "memory" or "cpu").
+         *
+         * @return False if the host does not report it.
+         */
+        static bool readStallShare(const std::string &resource, double &share)
+        {
+#if defined(__linux__)
+            try
+            {
+                // E.g., "some avg10=1.53 avg60=0.87 avg300=0.21 total=2818291".
+                Poco::FileInputStream stream("/proc/pressure/" + resource);
+                std::string line;
+                while (std::getline(stream, line))
+                {
+                    Poco::StringTokenizer fields(line, " ", Poco::StringTokenizer::TOK_IGNORE_EMPTY);
+                    if (fields.count() < 2 || fields[0] != "some" || fields[1].compare(0, 6, "avg10=") != 0)
+                    {
+                        continue;
+                    }
+                    return Poco::NumberParser::tryParseFloat(fields[1].substr(6), share);
+                }
+            }
+            catch (Poco::Exception &)
+            {
+            }
+#endif
+            return false;
+        }
+
+        Poco::FastMutex mutex;
+        Poco::Condition sampled;
+        bool stopping;
+        std::auto_ptr<Poco::Thread> thread;
+
+        // The most file copies in flight (the largest pool's workers and the report thread) and the number now 
+        // allowed.
+        unsigned int maxCopies;
+        unsigned int allowedCopies;
+
+        // The registered pools and their numbers of workers.
+        std::map<ThrottledPool*, unsigned int> pools;
+
+        // The number of samples at which the host was under pressure, and the number of times the report thread 
+        // waited for a sample.
+        unsigned long samples;
+        unsigned long pauses;
+    };
+
+    PressureMonitor pressureMonitor;
+
+    /**
+     * Has the pressure monitor throttle the compression workers of a 
+     * SquashFS image while it is being written.
+     */
+    class ImageCompressors : public ThrottledPool
+    {
+    public:
+        ImageCompressors(Squashfs::Writer &image, unsigned int workerCount) : image(image)
+        {
+            pressureMonitor.addPool(*this, workerCount);
+        }
+
+        ~ImageCompressors()
+        {
+            pressureMonitor.removePool(*this);
+        }
+
+        void setAllowedWorkers(unsigned int workerCount)
+        {
+            image.setAllowedWorkers(workerCount);
+        }
+
+    private:
+        ImageCompressors(const ImageCompressors &);
+        ImageCompressors &operator=(const ImageCompressors &);
+
+        Squashfs::Writer &image;
+    };
+
+    /**
+     * Runs the compression workers of the SquashFS images under a phase 
+     * timer, so that each worker thread's performance counters are added to
+     * the run statistics.
+     */
+    class ImageCompressorRunner : public Squashfs::WorkerRunner
+    {
+    public:
+        void runWorker(Poco::Runnable &work)
+        {
+            PerfCounters counters;
+            if (options.perfCounters)
+            {
+                counters.open();
+            }
+            PhaseTimer timer("compression worker", "compress blocks", counters);
+            work.run();
+        }
+    };
+
+    ImageCompressorRunner imageCompressorRunner;
+
+    /**
+     * @return True if the sector runs of the files being saved will be used.
+     */
+    bool sectorRunsNeeded()
+    {
+#if defined(__linux__)
+        if (rawImage.isOpen())
+        {
+            return true;
+        }
+#endif
+        return options.saveSlack || readTraceLog.isOpen() || readAhead.isRunning();
+    }
+
+    /**
+     * Reads the first bytes of a file, whose content is the given sector runs
+     * of the image, from the read-ahead cache and writes them to an output 
+     * file, accumulating content statistics from the same buffers.
+     */
+    void readFileContentsAhead(const TskFile &file, const SectorRunList &runs, TSK_OFF_T bytesToRead, FileSink &outputFile, 
+        std::vector<char> &buffer, SavedFile &savedFile)
+    {
+        for (SectorRunList::const_iterator run = runs.begin(); run != runs.end() && (*run).logicalOffset < bytesToRead; ++run)
+        {
+            uint64_t imageOffset = (*run).sector * SECTOR_SIZE;
+            uint64_t length = std::min<uint64_t>((*run).count * SECTOR_SIZE, static_cast<uint64_t>(bytesToRead - (*run).logicalOffset));
+            TSK_OFF_T logicalOffset = (*run).logicalOffset;
+            while (length > 0)
+            {
+                size_t count = static_cast<size_t>(std::min<uint64_t>(length, buffer.size()));
+                if (readTraceLog.isOpen())
+                {
+                    readTraceLog.traceFileRead(file.getId(), &runs, logicalOffset, count);
+                }
+                readAhead.read(imageOffset, &buffer[0], count);
+                savedFile.stats.update(reinterpret_cast<const unsigned char*>(&buffer[0]), count);
+                outputFile.write(&buffer[0], count);
+                imageOffset += count;
+                logicalOffset += static_cast<TSK_OFF_T>(count);
+                length -= count;
+            }
+        }
+    }
+
+#if defined(__linux__)
+    /**
+     * Copies the first bytes of a file, whose content is the given sector runs
+     * of the raw image, to an output file inside the kernel. Only the head of
+     * the content is read, to detect the file's type. Bytes past the file's 
+     * initialized size are written as zeros, as the file system layer reads
+     * them, rather than copied from the sectors.
+     */
+    void copyExtentsFromImage(const TskFile &file, const SectorRunList &runs, TSK_OFF_T bytesToCopy, TSK_OFF_T initializedSize, 
+        OutputFile &outputFile, std::vector<char> &buffer, SavedFile &savedFile)
+    {
+        const TSK_OFF_T bytesFromImage = std::min(bytesToCopy, initializedSize);
+        bool identified = false;
+        for (SectorRunList::const_iterator run = runs.begin(); run != runs.end() && (*run).logicalOffset < bytesFromImage; ++run)
+        {
+            uint64_t imageOffset = (*run).sector * SECTOR_SIZE;
+            uint64_t length = std::min<uint64_t>((*run).count * SECTOR_SIZE, static_cast<uint64_t>(bytesFromImage - (*run).logicalOffset));
+            if (readTraceLog.isOpen())
+            {
+                readTraceLog.traceFileRead(file.getId(), &runs, (*run).logicalOffset, length);
+            }
+
+            // Split the run at image file boundaries.
+            while (length > 0)
+            {
+                int fd = -1;
+                uint64_t fileOffset = 0;
+                uint64_t available = rawImage.locate(imageOffset, fd, fileOffset);
+                if (available == 0)
+                {
+                    throw Poco::ReadFileException("sector run of file with id " + Poco::NumberFormatter::format(file.getId()) + " is past the end of the image");
+                }
+                uint64_t count = std::min(length, available);
+                if (!identified)
+                {
+                    ssize_t headBytes = pread(fd, &buffer[0], static_cast<size_t>(std::min<uint64_t>(count, 4096)), static_cast<off_t>(fileOffset));
+                    savedFile.stats.identify(reinterpret_cast<const unsigned char*>(&buffer[0]), headBytes > 0 ? static_cast<size_t>(headBytes) : 0);
+                    identified = true;
+                }
+                outputFile.copyFrom(fd, fileOffset, count, outputCapabilities.sourceReflink, outputCapabilities.sourceCopyFileRange);
+                imageOffset += count;
+                length -= count;
+            }
+        }
+        if (bytesFromImage < bytesToCopy)
+        {
+            outputFile.appendZeros(static_cast<uint64_t>(bytesToCopy - bytesFromImage));
+        }
+        savedFile.extentCopied = true;
+    }
+#endif
+
+    /**
+     * Reads the first bytes of a file, or all of it if readToEnd is true,
+     * through the file system layer and writes them to an output file, 
+     * accumulating content statistics from the same buffers.
+     */
+    void readFileContents(TskFile &file, TSK_OFF_T bytesToRead, bool readToEnd, const SectorRunList *runs, FileSink &outputFile, 
+        std::vector<char> &buffer, SavedFile &savedFile)
+    {
+        file.open();
+        try
+        {
+            TSK_OFF_T bytesCopied = 0;
+            ssize_t bytesRead = 0;
+            while (bytesCopied < bytesToRead || readToEnd)
+            {
+                size_t count = buffer.size();
+                if (!readToEnd && static_cast<TSK_OFF_T>(count) > bytesToRead - bytesCopied)
+                {
+                    count = static_cast<size_t>(bytesToRead - bytesCopied);
+                }
+                if ((bytesRead = file.read(&buffer[0], count)) <= 0)
+                {
+                    break;
+                }
+                if (readTraceLog.isOpen())
+                {
+                    readTraceLog.traceFileRead(file.getId(), runs, bytesCopied, static_cast<uint64_t>(bytesRead));
+                }
+                savedFile.stats.update(reinterpret_cast<const unsigned char*>(&buffer[0]), static_cast<size_t>(bytesRead));
+                outputFile.write(&buffer[0], static_cast<size_t>(bytesRead));
+                bytesCopied += bytesRead;
+            }
+
+            if (bytesRead < 0 || (!readToEnd && bytesCopied < bytesToRead))
+            {
+                throw Poco::ReadFileException("failed to read file with id " + Poco::NumberFormatter::format(file.getId()));
+            }
+        }
+        catch (...)
+        {
+            file.close();
+            throw;
+        }
+        file.close();
+    }
+
+    /**
+     * Copies the contents of a file to the given path, accumulating content 
+     * statistics from the same buffers as they are written. If the evidence
+     * is a raw image, the file's content is stored in plain sector runs and
+     * the file is not being written into a SquashFS image, the content is 
+     * copied straight from the image files inside the kernel instead. If a 
+     * slack path is given and the file's tail can be located in the image, 
+     * the last sector of file data and the slack space after it are fetched
+     * from the image in a single request, and the slack is written to the 
+     * slack path. Files large enough for the chunk store are saved to it, and
+     * a recipe of their chunks is written to <filePath>.chunks instead. Large
+     * files compressed by their file system are inflated by the parallel 
+     * decompressor, if it is running.
+     *
+     * @param file The file to copy.
+     * @param image The SquashFS image to write the file into, or NULL to write it to the output folder.
+     * @param filePath The path of the file to write, within the image if there is one.
+     * @param slackPath The path to write the file's slack space to, or empty.
+     * @param spoolPath The path to also write the file's content (and slack, to <spoolPath>.slack) to, or empty.
+     * @param savedFile Receives the content statistics and slack details of the file.
+     */
+    void copyFileContents(TskFile &file, Squashfs::Writer *image, const std::string &filePath, const std::string &slackPath, 
+        const std::string &spoolPath, SavedFile &savedFile)
+    {
+        static std::vector<char> buffer(COPY_BUFFER_SIZE);
+
+#if defined(__linux__)
+        const bool canCopyExtents = extentCopying;
+#else
+        const bool canCopyExtents = false;
+#endif
+
+        // The file's sector runs are needed to locate its slack, to trace its reads and to copy it from a raw image.
+        // Files scheduled for read-ahead already have theirs.
+        Poco::Timestamp phaseStart;
+        SectorRunList runs;
+        const bool readingAhead = readAhead.findScheduledFile(file.getId(), runs);
+        bool hasRuns = readingAhead || ((!slackPath.empty() || readTraceLog.isOpen() || canCopyExtents) && getFileSectorRuns(file, runs));
+
+        // Sectors past an NTFS file's initialized size are not its content, so neither the slack split of its tail nor
+        // a copy of its sectors may include them. Files scheduled for read-ahead were checked then.
+        TSK_OFF_T initializedSize = file.getSize();
+        if (hasRuns && !readingAhead && (!slackPath.empty() || canCopyExtents) && 
+            !getInitializedSize(file.getId(), file.getSize(), initializedSize))
+        {
+            hasRuns = false;
+            runs.clear();
+        }
+
+        FileTail tail;
+        bool saveSlack = !slackPath.empty() && hasRuns && initializedSize == file.getSize();
+        if (saveSlack)
+        {
+            locateFileTail(file, runs, tail);
+        }
+        savedFile.fragments = hasRuns ? runs.size() : 0;
+        savedFile.runsTime = phaseStart.elapsed();
+        phaseStart.update();
+
+        // Copy the file up to its tail, or all of it if no slack is to be saved. Space is not preallocated for 
+        // content copied from the image, since shared extents need none.
+        TSK_OFF_T bytesToRead = saveSlack ? tail.logicalOffset : file.getSize();
+        const bool chunked = isChunked(image, static_cast<uint64_t>(file.getSize()));
+        const bool copyExtents = canCopyExtents && hasRuns && image == NULL && !chunked;
+        const bool decompressInParallel = parallelDecompressor.isRunning() && (file.getMetaFlags() & TSK_FS_META_FLAG_COMP) != 0 &&
+            file.getTypeId() == TskImgDB::IMGDB_FILES_TYPE_FS && bytesToRead >= static_cast<TSK_OFF_T>(2 * DECOMPRESS_RANGE_SIZE);
+        std::auto_ptr<FileSink> outputFile;
+        if (chunked)
+        {
+            outputFile.reset(new ChunkedFile(filePath + CHUNK_RECIPE_SUFFIX));
+            savedFile.chunkRecipePath = filePath + CHUNK_RECIPE_SUFFIX;
+        }
+        else
+        {
+            outputFile.reset(spoolFileSink(createFileSink(image, filePath, copyExtents ? 0 : static_cast<uint64_t>(file.getSize()), file.getMtime(), false), 
+                spoolPath));
+        }
+        if (copyExtents)
+        {
+#if defined(__linux__)
+            copyExtentsFromImage(file, runs, bytesToRead, initializedSize, static_cast<OutputFile&>(*outputFile), buffer, savedFile);
+#endif
+        }
+        else if (readingAhead)
+        {
+            readFileContentsAhead(file, runs, bytesToRead, *outputFile, buffer, savedFile);
+        }
+        else if (decompressInParallel && parallelDecompressor.readFile(file, bytesToRead, *outputFile, savedFile))
+        {
+            savedFile.decompressedInParallel = true;
+        }
+        else
+        {
+            readFileContents(file, bytesToRead, !saveSlack, hasRuns ? &runs : NULL, *outputFile, buffer, savedFile);
+        }
+
+        savedFile.contentTime = phaseStart.elapsed();
+        phaseStart.update();
+
+        if (saveSlack)
+        {
+            // Read the last sector of file data together with the slack that follows it in the same run, splitting 
+            // the data between the file and the slack file.
+            std::auto_ptr<FileSink> slackFile(spoolFileSink(createFileSink(image, slackPath, tail.sectorCount * SECTOR_SIZE, file.getMtime(), true), 
+                spoolPath.empty() ? "" : spoolPath + ".slack"));
+            TskImageFile &imageFile = TskServices::Instance().getImageFile();
+            uint64_t tailDataBytes = static_cast<uint64_t>(file.getSize() - tail.logicalOffset);
+            tail.slackRuns.insert(tail.slackRuns.begin(), std::make_pair(tail.sector, tail.sectorCount));
+            for (std::vector<std::pair<uint64_t, uint64_t> >::const_iterator run = tail.slackRuns.begin(); run != tail.slackRuns.end(); ++run)
+            {
+                uint64_t sector = (*run).first;
+                uint64_t sectorsLeft = (*run).second;
+                while (sectorsLeft > 0)
+                {
+                    uint64_t sectorCount = std::min<uint64_t>(sectorsLeft, buffer.size() / SECTOR_SIZE);
+                    if (readTraceLog.isOpen())
+                    {
+                        readTraceLog.traceImageRead(file.getId(), sector, sectorCount);
+                    }
+                    if (imageFile.getSectorData(sector, sectorCount, &buffer[0]) != static_cast<int>(sectorCount))
+                    {
+                        throw Poco::ReadFileException("failed to read slack of file with id " + Poco::NumberFormatter::format(file.getId()));
+                    }
+
+                    uint64_t dataBytes = std::min<uint64_t>(tailDataBytes, sectorCount * SECTOR_SIZE);
+                    if (dataBytes > 0)
+                    {
+                        if (savedFile.stats.isMeasured())
+                        {
+                            savedFile.stats.update(reinterpret_cast<const unsigned char*>(&buffer[0]), static_cast<size_t>(dataBytes));
+                        }
+                        outputFile->write(&buffer[0], static_cast<size_t>(dataBytes));
+                        tailDataBytes -= dataBytes;
+                    }
+                    slackFile->write(&buffer[0] + dataBytes, static_cast<size_t>(sectorCount * SECTOR_SIZE - dataBytes));
+                    savedFile.slackBytes += sectorCount * SECTOR_SIZE - dataBytes;
+
+                    sector += sectorCount;
+                    sectorsLeft -= sectorCount;
+                }
+            }
+            slackFile->close();
+            savedFile.slackPath = slackPath;
+            savedFile.slackTime = phaseStart.elapsed();
+            phaseStart.update();
+        }
+
+        outputFile->close();
+        savedFile.contentTime += phaseStart.elapsed();
+    }
+
+    /**
+     * The details of a saved file or directory that are written to the 
+     * reports and the manifest, taken from the file or from its record.
+     */
+    struct ReportedFile
+    {
+        ReportedFile() : fileId(0), isDirectory(false), size(0), crtime(0), mtime(0), atime(0), ctime(0) {}
+
+        explicit ReportedFile(const TskFile &file) 
+            : fileId(file.getId()), isDirectory(file.getMetaType() == TSK_FS_META_TYPE_DIR), uniquePath(file.getUniquePath()), 
+              size(file.getSize()), md5(file.getHash(TskImgDB::MD5)), sha1(file.getHash(TskImgDB::SHA1)), crtime(file.getCrtime()), 
+              mtime(file.getMtime()), atime(file.getAtime()), ctime(file.getCtime())
+        {
+        }
+
+        ReportedFile(const TskFileRecord &fileRec, const std::string &uniquePath) 
+            : fileId(fileRec.fileId), isDirectory(fileRec.metaType == TSK_FS_META_TYPE_DIR), uniquePath(uniquePath), size(fileRec.size), 
+              md5(fileRec.md5), sha1(fileRec.sha1), crtime(fileRec.crtime), mtime(fileRec.mtime), atime(fileRec.atime), ctime(fileRec.ctime)
+        {
+        }
+
+        uint64_t fileId;
+        bool isDirectory;
+        std::string uniquePath;
+        TSK_OFF_T size;
+        std::string md5;
+        std::string sha1;
+        std::time_t crtime;
+        std::time_t mtime;
+        std::time_t atime;
+        std::time_t ctime;
+    };
+
+    void addFileToReport(const ReportedFile &file, const std::string &filePath, Poco::XML::Document *report, const SavedFile *savedFile = NULL)
+    {
+        Poco::XML::Element *reportRoot = static_cast<Poco::XML::Element*>(report->firstChild());
+
+        Poco::AutoPtr<Poco::XML::Element> fileElement; 
+        if (file.isDirectory)
+        {
+            fileElement = report->createElement("SavedDirectory");
+        }
+        else
+        {
+            fileElement = report->createElement("SavedFile");
+        }
+        reportRoot->appendChild(fileElement);
+
+        Poco::AutoPtr<Poco::XML::Element> savedPathElement = report->createElement("Path");
+        fileElement->appendChild(savedPathElement);        
+        Poco::AutoPtr<Poco::XML::Text> savedPathText = report->createTextNode(filePath);
+        savedPathElement->appendChild(savedPathText);
+
+        Poco::AutoPtr<Poco::XML::Element> originalPathElement = report->createElement("OriginalPath");        
+        fileElement->appendChild(originalPathElement);
+        Poco::AutoPtr<Poco::XML::Text> originalPathText = report->createTextNode(file.uniquePath);
+        originalPathElement->appendChild(originalPathText);
+
+        if (!file.isDirectory)
+        {
+            // This element will be empty unless a hash calculation module has operated on the file.
+            Poco::AutoPtr<Poco::XML::Element> md5HashElement = report->createElement("MD5");        
+            fileElement->appendChild(md5HashElement);                
+            Poco::AutoPtr<Poco::XML::Text> md5HashText = report->createTextNode(file.md5);
+            md5HashElement->appendChild(md5HashText);
+        }
+
+        if (savedFile != NULL)
+        {
+            const ContentStatistics *stats = &savedFile->stats;
+            Poco::AutoPtr<Poco::XML::Element> typeElement = report->createElement("Type");
+            fileElement->appendChild(typeElement);
+            Poco::AutoPtr<Poco::XML::Text> typeText = report->createTextNode(stats->getType());
+            typeElement->appendChild(typeText);
+
+            if (stats->isMeasured())
+            {
+                Poco::AutoPtr<Poco::XML::Element> entropyElement = report->createElement("Entropy");
+                fileElement->appendChild(entropyElement);
+                Poco::AutoPtr<Poco::XML::Text> entropyText = report->createTextNode(Poco::NumberFormatter::format(stats->getEntropy(), 4));
+                entropyElement->appendChild(entropyText);
+
+                Poco::AutoPtr<Poco::XML::Element> zeroByteRatioElement = report->createElement("ZeroByteRatio");
+                fileElement->appendChild(zeroByteRatioElement);
+                Poco::AutoPtr<Poco::XML::Text> zeroByteRatioText = report->createTextNode(Poco::NumberFormatter::format(stats->getZeroByteRatio(), 4));
+                zeroByteRatioElement->appendChild(zeroByteRatioText);
+            }
+
+            if (!savedFile->slackPath.empty())
+            {
+                Poco::AutoPtr<Poco::XML::Element> slackPathElement = report->createElement("SlackPath");
+                fileElement->appendChild(slackPathElement);
+                Poco::AutoPtr<Poco::XML::Text> slackPathText = report->createTextNode(savedFile->slackPath);
+                slackPathElement->appendChild(slackPathText);
+            }
+
+            if (!savedFile->chunkRecipePath.empty())
+            {
+                Poco::AutoPtr<Poco::XML::Element> recipePathElement = report->createElement("ChunkRecipePath");
+                fileElement->appendChild(recipePathElement);
+                Poco::AutoPtr<Poco::XML::Text> recipePathText = report->createTextNode(savedFile->chunkRecipePath);
+                recipePathElement->appendChild(recipePathText);
+            }
+        }
+    }
+
+    /**
+     * Writes the same element for a saved file or directory as 
+     * addFileToReport(), to a report that is being streamed.
+     */
+    void writeFileToReport(Poco::XML::XMLWriter &writer, const ReportedFile &file, const std::string &filePath, const SavedFile *savedFile = NULL)
+    {
+        const std::string elementName = file.isDirectory ? "SavedDirectory" : "SavedFile";
+        writer.startElement("", "", elementName);
+        writer.dataElement("", "", "Path", filePath);
+        writer.dataElement("", "", "OriginalPath", file.uniquePath);
+        if (!file.isDirectory)
+        {
+            writer.dataElement("", "", "MD5", file.md5);
+        }
+
+        if (savedFile != NULL)
+        {
+            const ContentStatistics *stats = &savedFile->stats;
+            writer.dataElement("", "", "Type", stats->getType());
+            if (stats->isMeasured())
+            {
+                writer.dataElement("", "", "Entropy", Poco::NumberFormatter::format(stats->getEntropy(), 4));
+                writer.dataElement("", "", "ZeroByteRatio", Poco::NumberFormatter::format(stats->getZeroByteRatio(), 4));
+            }
+            if (!savedFile->slackPath.empty())
+            {
+                writer.dataElement("", "", "SlackPath", savedFile->slackPath);
+            }
+            if (!savedFile->chunkRecipePath.empty())
+            {
+                writer.dataElement("", "", "ChunkRecipePath", savedFile->chunkRecipePath);
+            }
+        }
+        writer.endElement("", "", elementName);
+    }
+
+    /**
+     * Writes a columnar manifest of the saved files and directories of a run
+     * to an Arrow IPC file (see ArrowIpc.h), one row per entry in the sets'
+     * reports. Rows are written out in record batches as each set completes,
+     * so the manifest can be queried with Arrow based tools without parsing 
+     * the XML reports.
+     */
+    class ManifestWriter
+    {
+    public:
+        ManifestWriter() {}
+
+        void open(const std::string &path)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            std::vector<ArrowIpc::Column> columns;
+            columns.push_back(ArrowIpc::Column("set", ArrowIpc::UTF8, false));
+            columns.push_back(ArrowIpc::Column("file_id", ArrowIpc::UINT64, false));
+            columns.push_back(ArrowIpc::Column("saved_path", ArrowIpc::UTF8, false));
+            columns.push_back(ArrowIpc::Column("image", ArrowIpc::UTF8, true));
+            columns.push_back(ArrowIpc::Column("original_path", ArrowIpc::UTF8, false));
+            columns.push_back(ArrowIpc::Column("size", ArrowIpc::INT64, false));
+            columns.push_back(ArrowIpc::Column("md5", ArrowIpc::UTF8, true));
+            columns.push_back(ArrowIpc::Column("sha1", ArrowIpc::UTF8, true));
+            columns.push_back(ArrowIpc::Column("crtime", ArrowIpc::TIMESTAMP_SECONDS, true));
+            columns.push_back(ArrowIpc::Column("mtime", ArrowIpc::TIMESTAMP_SECONDS, true));
+            columns.push_back(ArrowIpc::Column("atime", ArrowIpc::TIMESTAMP_SECONDS, true));
+            columns.push_back(ArrowIpc::Column("ctime", ArrowIpc::TIMESTAMP_SECONDS, true));
+            columns.push_back(ArrowIpc::Column("type", ArrowIpc::UTF8, true));
+            columns.push_back(ArrowIpc::Column("entropy", ArrowIpc::DOUBLE, true));
+            columns.push_back(ArrowIpc::Column("slack_path", ArrowIpc::UTF8, true));
+            stream.reset(new Poco::FileOutputStream(path, std::ios::out | std::ios::trunc | std::ios::binary));
+            writer.reset(new ArrowIpc::FileWriter(*stream, columns));
+        }
+
+        bool isOpen() const
+        {
+            return writer.get() != NULL;
+        }
+
+        /**
+         * Writes out any rows not yet written and the manifest's footer.
+         */
+        void close()
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            if (writer.get() != NULL)
+            {
+                writer->finish();
+                writer.reset();
+            }
+            if (stream.get() != NULL)
+            {
+                stream->close();
+                stream.reset();
+            }
+        }
+
+        /**
+         * Adds a saved file or directory to the manifest.
+         *
+         * @param setName The name of the interesting file set.
+         * @param imagePath The path of the set's SquashFS image, or empty if
+         * the set is saved as a folder of files.
+         * @param file The file.
+         * @param savedPath The path of the saved file as listed in the report.
+         * @param savedFile The results of saving the file's contents, or NULL
+         * for a directory.
+         */
+        void addFile(const std::string &setName, const std::string &imagePath, const ReportedFile &file, const std::string &savedPath, 
+            const SavedFile *savedFile)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            writer->appendString(setName);
+            writer->appendUInt64(file.fileId);
+            writer->appendString(savedPath);
+            appendOptionalString(imagePath);
+            writer->appendString(file.uniquePath);
+            writer->appendInt64(static_cast<int64_t>(file.size));
+            appendOptionalString(file.md5);
+            appendOptionalString(file.sha1);
+            appendOptionalTime(file.crtime);
+            appendOptionalTime(file.mtime);
+            appendOptionalTime(file.atime);
+            appendOptionalTime(file.ctime);
+            if (savedFile == NULL)
+            {
+                writer->appendString("inode/directory");
+                writer->appendNull();
+                writer->appendNull();
+            }
+            else
+            {
+                writer->appendString(savedFile->stats.getType());
+                if (savedFile->stats.isMeasured())
+                {
+                    writer->appendDouble(savedFile->stats.getEntropy());
+                }
+                else
+                {
+                    writer->appendNull();
+                }
+                appendOptionalString(savedFile->slackPath);
+            }
+
+            // Bound the memory held by very large sets.
+            if (writer->getPendingRows() >= MAX_BATCH_ROWS)
+            {
+                writer->writeBatch();
+            }
+        }
+
+        /**
+         * Writes out the rows of a set once it has been saved.
+         */
+        void endSet()
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            writer->writeBatch();
+        }
+
+    private:
+        ManifestWriter(const ManifestWriter &);
+        ManifestWriter &operator=(const ManifestWriter &);
+
+        static const size_t MAX_BATCH_ROWS = 4096;
+
+        void appendOptionalString(const std::string &value)
+        {
+            if (value.empty())
+            {
+                writer->appendNull();
+            }
+            else
+            {
+                writer->appendString(value);
+            }
+        }
+
+        void appendOptionalTime(time_t value)
+        {
+            if (value == 0)
+            {
+                writer->appendNull();
+            }
+            else
+            {
+                writer->appendTimestamp(static_cast<int64_t>(value));
+            }
+        }
+
+        Poco::FastMutex mutex;
+        std::auto_ptr<Poco::FileOutputStream> stream;
+        std::auto_ptr<ArrowIpc::FileWriter> writer;
+    };
+
+    ManifestWriter manifest;
+
+    /**
+     * A file or directory to be saved for an interesting file set, determined
+     * from the image database before any file content is read.
+     */
+    struct PlannedFile
+    {
+        PlannedFile(const TskFileRecord &fileRec, const std::string &relativePath, bool isHit) 
+            : fileId(fileRec.fileId), isDirectory(fileRec.metaType == TSK_FS_META_TYPE_DIR), size(fileRec.size), 
+              typeId(fileRec.typeId), metaFlags(fileRec.metaFlags), mtime(fileRec.mtime), md5(fileRec.md5), relativePath(relativePath), 
+              isHit(isHit)
+        {
+        }
+
+        uint64_t fileId;
+        bool isDirectory;
+        TSK_OFF_T size;
+        TskImgDB::FILE_TYPES typeId;
+        TSK_FS_META_FLAG_ENUM metaFlags;
+        std::time_t mtime;
+
+        // The file's MD5 hash in hex, or empty if it has not been computed.
+        std::string md5;
+
+        // The path to save the file to, relative to the output folder. Directory paths end with a separator.
+        std::string relativePath;
+
+        // True for the files and directories hit by the set, false for the contents of hit directories.
+        bool isHit;
+    };
+
+    /**
+     * The files and directories to be saved for an interesting file set, in 
+     * the order they are to be saved, and the output space they need.
+     */
+    struct SetPlan
+    {
+        SetPlan() : estimatedBytes(0) {}
+
+        std::string name;
+        std::string description;
+        std::vector<PlannedFile> files;
+        uint64_t estimatedBytes;
+    };
+
+    /**
+     * The slowest file saves and directory queries of each set in a run, 
+     * kept so that the causes of long tails (e.g., a file on failing sectors
+     * or in a heavily fragmented run list) can be found without tracing the
+     * whole run, and written to an outlier report at the end of the run.
+     */
+    class OutlierLog
+    {
+    public:
+        void addFile(const std::string &setName, const PlannedFile &plannedFile, const SavedFile &savedFile, 
+            Poco::Timestamp::TimeDiff elapsed, bool failed)
+        {
+            SlowOperation operation;
+            operation.id = plannedFile.fileId;
+            operation.path = plannedFile.relativePath;
+            operation.size = static_cast<uint64_t>(plannedFile.size);
+            operation.typeId = plannedFile.typeId;
+            operation.metaFlags = plannedFile.metaFlags;
+            operation.elapsed = elapsed;
+            operation.fragments = savedFile.fragments;
+            operation.openTime = savedFile.openTime;
+            operation.runsTime = savedFile.runsTime;
+            operation.contentTime = savedFile.contentTime;
+            operation.slackTime = savedFile.slackTime;
+            operation.fannedOut = savedFile.fannedOut;
+            operation.failed = failed;
+            keep(sets[setName].files, operation);
+        }
+
+        void addDirectoryQuery(const std::string &setName, uint64_t dirId, const std::string &path, size_t entries, 
+            Poco::Timestamp::TimeDiff elapsed)
+        {
+            SlowOperation operation;
+            operation.id = dirId;
+            operation.path = path;
+            operation.entries = entries;
+            operation.elapsed = elapsed;
+            keep(sets[setName].directoryQueries, operation);
+        }
+
+        /**
+         * Writes the slowest operations of each set, slowest first. The 
+         * sector runs of files that were saved without looking them up are
+         * looked up now, for these files only, to report their fragment 
+         * counts.
+         */
+        void write(const std::string &path)
+        {
+            Poco::FileOutputStream reportFile(path);
+            Poco::XML::XMLWriter writer(reportFile, Poco::XML::XMLWriter::PRETTY_PRINT);
+            writer.setNewLine("\n");
+            writer.startDocument();
+            writer.startElement("", "", "SlowOperations");
+            for (std::map<std::string, SetOutliers>::iterator set = sets.begin(); set != sets.end(); ++set)
+            {
+                Poco::XML::AttributesImpl setAttributes;
+                setAttributes.addAttribute("", "", "name", "CDATA", (*set).first);
+                writer.startElement("", "", "InterestingFileSet", setAttributes);
+
+                std::vector<SlowOperation> &files = (*set).second.files;
+                std::sort(files.begin(), files.end(), isSlower);
+                for (std::vector<SlowOperation>::iterator file = files.begin(); file != files.end(); ++file)
+                {
+                    if ((*file).fragments == 0 && (*file).size > 0)
+                    {
+                        SectorRunList runs;
+                        try
+                        {
+                            if (getFileSectorRuns((*file).id, (*file).typeId, (*file).metaFlags, static_cast<TSK_OFF_T>((*file).size), runs))
+                            {
+                                (*file).fragments = runs.size();
+                            }
+                        }
+                        catch (TskException &)
+                        {
+                        }
+                    }
+
+                    Poco::XML::AttributesImpl attributes;
+                    addAttribute(attributes, "id", Poco::NumberFormatter::format((*file).id));
+                    addAttribute(attributes, "path", (*file).path);
+                    addAttribute(attributes, "size", Poco::NumberFormatter::format((*file).size));
+                    addAttribute(attributes, "fragments", (*file).fragments != 0 ? Poco::NumberFormatter::format((*file).fragments) : "");
+                    addAttribute(attributes, "elapsedMs", formatMs((*file).elapsed));
+                    addAttribute(attributes, "bytesPerSecond", (*file).elapsed > 0 ? 
+                        Poco::NumberFormatter::format(static_cast<uint64_t>((*file).size * 1000000.0 / (*file).elapsed)) : "");
+                    addAttribute(attributes, "openMs", formatMs((*file).openTime));
+                    addAttribute(attributes, "runsMs", formatMs((*file).runsTime));
+                    addAttribute(attributes, "contentMs", formatMs((*file).contentTime));
+                    addAttribute(attributes, "slackMs", formatMs((*file).slackTime));
+                    if ((*file).fannedOut)
+                    {
+                        addAttribute(attributes, "fannedOut", "true");
+                    }
+                    if ((*file).failed)
+                    {
+                        addAttribute(attributes, "failed", "true");
+                    }
+                    writer.emptyElement("", "", "SlowFile", attributes);
+                }
+
+                std::vector<SlowOperation> &queries = (*set).second.directoryQueries;
+                std::sort(queries.begin(), queries.end(), isSlower);
+                for (std::vector<SlowOperation>::const_iterator query = queries.begin(); query != queries.end(); ++query)
+                {
+                    Poco::XML::AttributesImpl attributes;
+                    addAttribute(attributes, "id", Poco::NumberFormatter::format((*query).id));
+                    addAttribute(attributes, "path", (*query).path);
+                    addAttribute(attributes, "entries", Poco::NumberFormatter::format((*query).entries));
+                    addAttribute(attributes, "elapsedMs", formatMs((*query).elapsed));
+                    writer.emptyElement("", "", "SlowDirectoryQuery", attributes);
+                }
+
+                writer.endElement("", "", "InterestingFileSet");
+            }
+            writer.endElement("", "", "SlowOperations");
+            writer.endDocument();
+            reportFile.close();
+        }
+
+        void clear()
+        {
+            sets.clear();
+        }
+
+    private:
+        struct SlowOperation
+        {
+            SlowOperation() : id(0), size(0), typeId(TskImgDB::IMGDB_FILES_TYPE_FS), metaFlags(TSK_FS_META_FLAG_ALLOC), entries(0), 
+                elapsed(0), fragments(0), openTime(0), runsTime(0), contentTime(0), slackTime(0), fannedOut(false), failed(false) {}
+
+            uint64_t id;
+            std::string path;
+            uint64_t size;
+            TskImgDB::FILE_TYPES typeId;
+            TSK_FS_META_FLAG_ENUM metaFlags;
+            size_t entries;
+            Poco::Timestamp::TimeDiff elapsed;
+            size_t fragments;
+            Poco::Timestamp::TimeDiff openTime;
+            Poco::Timestamp::TimeDiff runsTime;
+            Poco::Timestamp::TimeDiff contentTime;
+            Poco::Timestamp::TimeDiff slackTime;
+            bool fannedOut;
+            bool failed;
+        };
+
+        struct SetOutliers
+        {
+            std::vector<SlowOperation> files;
+            std::vector<SlowOperation> directoryQueries;
+        };
+
+        static bool isSlower(const SlowOperation &left, const SlowOperation &right)
+        {
+            return left.elapsed > right.elapsed;
+        }
+
+        /**
+         * Adds an operation to a set's slowest operations if it is among the
+         * slowest so far. The operations are kept as a heap with the fastest
+         * on top, so each addition costs O(log n).
+         */
+        static void keep(std::vector<SlowOperation> &slowest, const SlowOperation &operation)
+        {
+            if (slowest.size() < options.outliers)
+            {
+                slowest.push_back(operation);
+                std::push_heap(slowest.begin(), slowest.end(), isSlower);
+            }
+            else if (!slowest.empty() && operation.elapsed > slowest.front().elapsed)
+            {
+                std::pop_heap(slowest.begin(), slowest.end(), isSlower);
+                slowest.back() = operation;
+                std::push_heap(slowest.begin(), slowest.end(), isSlower);
+            }
+        }
+
+        static void addAttribute(Poco::XML::AttributesImpl &attributes, const std::string &name, const std::string &value)
+        {
+            attributes.addAttribute("", "", name, "CDATA", value);
+        }
+
+        static std::string formatMs(Poco::Timestamp::TimeDiff microseconds)
+        {
+            return Poco::NumberFormatter::format(microseconds / 1000.0, 3);
+        }
+
+        std::map<std::string, SetOutliers> sets;
+    };
+
+    OutlierLog outlierLog;
+
+    // Estimated size of the report element for a saved file.
+    const uint64_t REPORT_BYTES_PER_FILE = 512;
+
+    // The longest line of a chunk recipe: a SHA-1 in hex, a tab, a chunk length and a newline.
+    const uint64_t RECIPE_BYTES_PER_CHUNK = 64;
+
+    uint64_t roundUp(uint64_t bytes, uint64_t unit)
+    {
+        return ((bytes + unit - 1) / unit) * unit;
+    }
+
+    /**
+     * @return True if the copies of a file saved in a run are hard linked to
+     * the first copy on the same volume.
+     */
+    bool savesHardLinks()
+    {
+        return options.hardLinks && outputCapabilities.hardLinks && !options.squashfsImages;
+    }
+
+    /**
+     * Estimates the output space needed to save a file, counting whole 
+     * allocation units of the output file system. A file saved to the chunk 
+     * store is counted as its recipe plus, if its content is new, the worst 
+     * case for its chunks: all of them new, of the minimum chunk size, and 
+     * each ending in a partly used allocation unit. Content that is not new 
+     * is counted only if it is saved as a plain file.
+     */
+    uint64_t estimateFileBytes(const PlannedFile &file, bool newContent)
+    {
+        const uint64_t blockSize = outputCapabilities.blockSize;
+        const uint64_t size = static_cast<uint64_t>(file.size);
+        uint64_t bytes = 0;
+        if (!options.squashfsImages && isChunked(NULL, size))
+        {
+            const uint64_t chunkCount = size / (options.chunkSize / 4) + 1;
+            bytes += roundUp(std::strlen(Chunking::RECIPE_HEADER) + 1 + RECIPE_BYTES_PER_CHUNK * chunkCount, blockSize);
+            if (newContent)
+            {
+                bytes += size + chunkCount * blockSize;
+            }
+        }
+        else if (!options.squashfsImages || newContent)
+        {
+            bytes += roundUp(size, blockSize);
+        }
+
+        if (options.saveSlack)
+        {
+            // Slack never exceeds a cluster of the source file system; assume clusters are at most 64 KB.
+            bytes += 64 * 1024;
+        }
+        return bytes;
+    }
+
+    /**
+     * Estimates the output space needed to save the files in a set plan, 
+     * counting whole allocation units of the output file system for each file
+     * and directory. A file saved more than once in the set is counted once 
+     * if its copies are hard linked or written into a SquashFS image, and 
+     * files with the same MD5 hash once in a SquashFS image (which stores 
+     * identical content once) or the chunk store.
+     */
+    uint64_t estimateOutputBytes(const SetPlan &plan)
+    {
+        const uint64_t blockSize = outputCapabilities.blockSize;
+        const bool linked = savesHardLinks() || options.squashfsImages;
+        std::set<uint64_t> countedFileIds;
+        std::set<std::string> countedContent;
+        uint64_t bytes = roundUp(REPORT_BYTES_PER_FILE * (plan.files.size() + 1), blockSize);
+        for (std::vector<PlannedFile>::const_iterator file = plan.files.begin(); file != plan.files.end(); ++file)
+        {
+            if ((*file).isDirectory)
+            {
+                bytes += blockSize;
+            }
+            else if (countedFileIds.insert((*file).fileId).second || !linked)
+            {
+                bytes += estimateFileBytes(*file, (*file).md5.empty() || countedContent.insert((*file).md5).second);
+            }
+        }
+        return bytes;
+    }
+
+    /**
+     * @return The part of a set's estimate taken by files that will be hard 
+     * linked to copies saved before the set, given the ids of those files.
+     */
+    uint64_t estimateLinkedBytes(const SetPlan &plan, const std::set<uint64_t> &savedFileIds)
+    {
+        uint64_t bytes = 0;
+        std::set<uint64_t> countedFileIds;
+        for (std::vector<PlannedFile>::const_iterator file = plan.files.begin(); file != plan.files.end() && savesHardLinks(); ++file)
+        {
+            if (!(*file).isDirectory && savedFileIds.find((*file).fileId) != savedFileIds.end() && countedFileIds.insert((*file).fileId).second)
+            {
+                bytes += estimateFileBytes(*file, false);
+            }
+        }
+        return std::min(bytes, plan.estimatedBytes);
+    }
+
+    /**
+     * @return The space available to this process on the volume holding the
+     * given folder, or the largest possible value if it cannot be determined.
+     */
+    uint64_t getFreeSpace(const std::string &folderPath)
+    {
+#if defined(_WIN32)
+        ULARGE_INTEGER freeBytes;
+        if (GetDiskFreeSpaceExA(folderPath.c_str(), &freeBytes, NULL, NULL))
+        {
+            return freeBytes.QuadPart;
+        }
+#else
+        struct statvfs st;
+        if (statvfs(folderPath.c_str(), &st) == 0)
+        {
+            return static_cast<uint64_t>(st.f_bavail) * st.f_frsize;
+        }
+#endif
+        return static_cast<uint64_t>(-1);
+    }
+
+    /**
+     * @param reservedBytes Bytes already promised to the folder's volume but
+     * not yet written, which are not counted as free.
+     */
+    bool fitsInFolder(uint64_t estimatedBytes, const std::string &folderPath, uint64_t reservedBytes = 0)
+    {
+        uint64_t freeSpace = getFreeSpace(folderPath);
+        freeSpace -= std::min(freeSpace, reservedBytes);
+        return freeSpace >= options.minFreeSpace && freeSpace - options.minFreeSpace >= estimatedBytes;
+    }
+
+    void planDirectoryContents(const std::string &dirPath, uint64_t dirId, const FileFilter &filter, SetPlan &plan)
+    {
+        // Get the file records corresponding to the files in the directory, from the metadata replica if it has them
+        // and otherwise from the image database.
+        std::vector<const TskFileRecord> queriedRecs;
+        std::vector<const TskFileRecord*> fileRecs;
+        Poco::Timestamp queryStart;
+        if (!metadataReplica.getChildren(dirId, fileRecs))
+        {
+            std::stringstream condition; 
+            condition << "WHERE par_file_id = " << dirId;
+            queriedRecs = TskServices::Instance().getImgDB().getFileRecords(condition.str());
+            for (std::vector<const TskFileRecord>::const_iterator fileRec = queriedRecs.begin(); fileRec != queriedRecs.end(); ++fileRec)
+            {
+                fileRecs.push_back(&*fileRec);
+            }
+        }
+        if (options.outliers > 0)
+        {
+            outlierLog.addDirectoryQuery(plan.name, dirId, dirPath, fileRecs.size(), queryStart.elapsed());
+        }
+
+        // Plan to save each file and subdirectory in the directory.
+        for (std::vector<const TskFileRecord*>::const_iterator fileRecPtr = fileRecs.begin(); fileRecPtr != fileRecs.end(); ++fileRecPtr)
+        {
+            const TskFileRecord *fileRec = *fileRecPtr;
+            // Apply the set's filter to the file record, so that excluded files are never opened and excluded
+            // subdirectories are never traversed.
+            if (!filter.accepts(FileMetadata(*fileRec)))
+            {
+                if ((*fileRec).metaType == TSK_FS_META_TYPE_DIR)
+                {
+                    ++runStatistics.directoriesPruned;
+                }
+                else
+                {
+                    ++runStatistics.filesExcluded;
+                }
+                continue;
+            }
+
+            if ((*fileRec).metaType == TSK_FS_META_TYPE_DIR)
+            {
+                // Create a subdirectory to hold the contents of this subdirectory.
+                std::string subDirPath = dirPath + (*fileRec).name + Poco::Path::separator();
+                plan.files.push_back(PlannedFile(*fileRec, subDirPath, false));
+                
+                // Recurse into the subdirectory.
+                planDirectoryContents(subDirPath, (*fileRec).fileId, filter, plan);
+            }
+            else
+            {
+                // Save the file.
+                std::stringstream filePath;
+                filePath << dirPath << Poco::Path::separator() << (*fileRec).name;
+                plan.files.push_back(PlannedFile(*fileRec, filePath.str(), false));
+            }
+        }
+    }
+
+    void planInterestingDirectory(const TskFileRecord &dirRec, const std::string &fileSetFolderPath, const FileFilter &filter, SetPlan &plan)
+    {
+        // Make a subdirectory of the output folder named for the interesting file search set and create a further subdirectory
+        // corresponding to the directory to be saved. The resulting directory structure will look like this:
+        // <output folder>/
+        //      <interesting file set name>/
+        //          <directory name>_<file id>/ /*Suffix the directory with its its file id to ensure uniqueness*/
+        //              <directory name>/
+        //                  <contents of directory including subdirectories>
+        //
+        std::stringstream path;
+        path << fileSetFolderPath << dirRec.name << '_' << dirRec.fileId << Poco::Path::separator() << dirRec.name << Poco::Path::separator();
+        plan.files.push_back(PlannedFile(dirRec, path.str(), true));
+
+        planDirectoryContents(path.str(), dirRec.fileId, filter, plan);
+    }
+
+    void planInterestingFile(const TskFileRecord &fileRec, const std::string &fileSetFolderPath, SetPlan &plan)
+    {
+        // Construct a path to write the contents of the file to a subdirectory of the output folder named for the interesting file search
+        // set. The resulting directory structure will look like this:
+        // <output folder>/
+        //      <interesting file set name>/
+        //          <file name>_<fileId>.<ext> /*Suffix the file with its its file id to ensure uniqueness*/
+        std::string fileName = fileRec.name;
+        std::stringstream id;
+        id << '_' << fileRec.fileId;
+        std::string::size_type pos = 0;
+        if ((pos = fileName.rfind(".")) != std::string::npos && pos != 0)
+        {
+            // The file name has a conventional extension. Insert the file id before the '.' of the extension.
+            fileName.insert(pos, id.str());
+        }
+        else
+        {
+            // The file has no extension or the only '.' in the file is an initial '.', as in a hidden file.
+            // Add the file id to the end of the file name.
+            fileName.append(id.str());
+        }
+        std::stringstream filePath;
+        filePath << fileSetFolderPath << Poco::Path::separator() << fileName;
+        plan.files.push_back(PlannedFile(fileRec, filePath.str(), true));
+    }
+
+    /**
+     * Fetches the file records for the given file ids from the metadata 
+     * replica if it has them, and otherwise from the database, in batches.
+     */
+    void getFileRecords(const std::vector<uint64_t> &fileIds, std::map<uint64_t, TskFileRecord> &fileRecs)
+    {
+        std::vector<uint64_t> queriedIds;
+        for (std::vector<uint64_t>::const_iterator fileId = fileIds.begin(); fileId != fileIds.end(); ++fileId)
+        {
+            const TskFileRecord *fileRec = metadataReplica.findFileRecord(*fileId);
+            if (fileRec != NULL)
+            {
+                fileRecs.insert(std::make_pair(*fileId, *fileRec));
+            }
+            else
+            {
+                queriedIds.push_back(*fileId);
+            }
+        }
+
+        for (size_t first = 0; first < queriedIds.size(); first += MAX_IDS_PER_QUERY)
+        {
+            std::stringstream condition;
+            condition << "WHERE file_id IN (";
+            for (size_t i = first; i < queriedIds.size() && i < first + MAX_IDS_PER_QUERY; ++i)
+            {
+                condition << (i == first ? "" : ", ") << queriedIds[i];
+            }
+            condition << ")";
+
+            std::vector<const TskFileRecord> batch = TskServices::Instance().getImgDB().getFileRecords(condition.str());
+            for (std::vector<const TskFileRecord>::const_iterator fileRec = batch.begin(); fileRec != batch.end(); ++fileRec)
+            {
+                fileRecs.insert(std::make_pair((*fileRec).fileId, *fileRec));
+            }
+        }
+    }
+
+    /**
+     * Determines the files and directories to save for an interesting file 
+     * set, and the output space they need, from the image database.
+     */
+    SetPlan planSet(const std::string &setName, const std::string &setDescription, FileSetHitsRange fileSetHitsRange)
+    {
+        SetPlan plan;
+        plan.name = setName;
+        plan.description = setDescription;
+
+        // Fetch the records for all of the files hit by the set at once.
+        std::vector<uint64_t> fileIds;
+        for (FileSetHits::iterator fileHit = fileSetHitsRange.first; fileHit != fileSetHitsRange.second; ++fileHit)
+        {
+            fileIds.push_back((*fileHit).second.getObjectID());
+        }
+        std::map<uint64_t, TskFileRecord> fileRecs;
+        getFileRecords(fileIds, fileRecs);
+
+        // Plan to save all of the files in the set that pass the set's filter, in a subdirectory of the output folder
+        // named for the interesting file set.
+        std::string fileSetFolderPath = setName + Poco::Path::separator();
+        const FileFilter &filter = getFileFilter(setName);
+        for (std::vector<uint64_t>::const_iterator fileId = fileIds.begin(); fileId != fileIds.end(); ++fileId)
+        {
+            std::map<uint64_t, TskFileRecord>::const_iterator fileRec = fileRecs.find(*fileId);
+            if (fileRec == fileRecs.end())
+            {
+                std::stringstream subject;
+                subject << "file " << *fileId;
+                errorLog.error("missing file record", subject.str(), "no file record for file hit in set '" + setName + "', skipping file");
+                continue;
+            }
+
+            if (!filter.accepts(FileMetadata((*fileRec).second)))
+            {
+                ++runStatistics.filesExcluded;
+                continue;
+            }
+
+            if ((*fileRec).second.metaType == TSK_FS_META_TYPE_DIR)
+            {
+                planInterestingDirectory((*fileRec).second, fileSetFolderPath, filter, plan);
+            }
+            else
+            {
+                planInterestingFile((*fileRec).second, fileSetFolderPath, plan);
+            }
+        }
+
+        plan.estimatedBytes = estimateOutputBytes(plan);
+        return plan;
+    }
+
+    /**
+     * The first saved copy of a file that is planned to be saved more than 
+     * once in a run (e.g., a file hit by several sets).
+     */
+    struct SavedCopy
+    {
+        // The path the copy was written to, and the path it will have once its set has been moved out of the 
+        // staging folder, which is the same if the set was not staged.
+        std::string path;
+        std::string finalPath;
+
+        // The path of the SquashFS image the copy was written into, empty if it was written to the output folder.
+        std::string imagePath;
+
+        // The path of the spooled copy of the content of a copy written into an image, for the images of other sets, 
+        // or empty.
+        std::string spoolPath;
+
+        ReportedFile reportedFile;
+        SavedFile savedFile;
+    };
+
+    // The number of saves still to come of each file planned to be saved more than once, and the first saved copy of 
+    // each, so that the evidence is read once per file rather than once per save.
+    std::map<uint64_t, unsigned int> pendingFanOuts;
+    std::map<uint64_t, SavedCopy> savedCopies;
+
+    // The files planned to be saved in more than one set. When sets are saved as SquashFS images, the content of 
+    // these is spooled to the spool folder, in the output folder, until their last save.
+    std::set<uint64_t> crossSetFanOuts;
+    const std::string SPOOL_FOLDER_NAME = "SaveInterestingFilesModule_spool";
+
+    /**
+     * Groups the planned saves of all sets by file id, so that files planned 
+     * to be saved more than once are read from the evidence once.
+     */
+    void planFanOuts(const std::vector<SetPlan> &plans)
+    {
+        pendingFanOuts.clear();
+        savedCopies.clear();
+        crossSetFanOuts.clear();
+        std::set<uint64_t> plannedFileIds;
+        for (std::vector<SetPlan>::const_iterator plan = plans.begin(); plan != plans.end(); ++plan)
+        {
+            std::set<uint64_t> setFileIds;
+            for (std::vector<PlannedFile>::const_iterator plannedFile = (*plan).files.begin(); plannedFile != (*plan).files.end(); ++plannedFile)
+            {
+                if (!(*plannedFile).isDirectory)
+                {
+                    ++pendingFanOuts[(*plannedFile).fileId];
+                    if (setFileIds.insert((*plannedFile).fileId).second && !plannedFileIds.insert((*plannedFile).fileId).second)
+                    {
+                        crossSetFanOuts.insert((*plannedFile).fileId);
+                    }
+                }
+            }
+        }
+
+        for (std::map<uint64_t, unsigned int>::iterator fileUses = pendingFanOuts.begin(); fileUses != pendingFanOuts.end(); )
+        {
+            if ((*fileUses).second < 2)
+            {
+                pendingFanOuts.erase(fileUses++);
+            }
+            else
+            {
+                ++fileUses;
+            }
+        }
+    }
+
+    bool createHardLink(const std::string &existingPath, const std::string &linkPath)
+    {
+#if defined(_WIN32)
+        return CreateHardLinkA(linkPath.c_str(), existingPath.c_str(), NULL) != 0;
+#else
+        return link(existingPath.c_str(), linkPath.c_str()) == 0;
+#endif
+    }
+
+    /**
+     * Makes a saved file available at another path: hard linked if the 
+     * output file system supports it and hard links are allowed, otherwise 
+     * copied, sharing extents or inside the kernel where possible.
+     */
+    void copySavedFile(const std::string &sourcePath, const std::string &destPath)
+    {
+        if (options.hardLinks && outputCapabilities.hardLinks && createHardLink(sourcePath, destPath))
+        {
+            return;
+        }
+
+#if defined(__linux__)
+        int sourceFd = open(sourcePath.c_str(), O_RDONLY);
+        struct stat st;
+        if (sourceFd == -1 || fstat(sourceFd, &st) != 0)
+        {
+            if (sourceFd != -1)
+            {
+                close(sourceFd);
+            }
+            throw Poco::OpenFileException(sourcePath);
+        }
+        try
+        {
+            OutputFile destFile(destPath, 0);
+            destFile.copyFrom(sourceFd, 0, static_cast<uint64_t>(st.st_size), outputCapabilities.reflink, outputCapabilities.copyFileRange);
+            destFile.close();
+        }
+        catch (...)
+        {
+            close(sourceFd);
+            throw;
+        }
+        close(sourceFd);
+#else
+        Poco::File(sourcePath).copyTo(destPath);
+#endif
+    }
+
+    /**
+     * Adds a file to a SquashFS image from a spooled copy of its content.
+     *
+     * @return False if the spooled copy could not be opened.
+     */
+    bool addSpooledFile(Squashfs::Writer &image, const std::string &spoolPath, const std::string &path, std::time_t mtime)
+    {
+        std::auto_ptr<Poco::FileInputStream> spool;
+        try
+        {
+            spool.reset(new Poco::FileInputStream(spoolPath, std::ios::in | std::ios::binary));
+        }
+        catch (Poco::Exception &)
+        {
+            return false;
+        }
+
+        static std::vector<char> buffer(COPY_BUFFER_SIZE);
+        ImageEntry entry(image, path, mtime, false);
+        while (*spool)
+        {
+            spool->read(&buffer[0], static_cast<std::streamsize>(buffer.size()));
+            if (spool->gcount() > 0)
+            {
+                entry.write(&buffer[0], static_cast<size_t>(spool->gcount()));
+            }
+        }
+        if (spool->bad())
+        {
+            throw Poco::ReadFileException(spoolPath);
+        }
+        entry.close();
+        return true;
+    }
+
+    /**
+     * Saves a file from a copy saved earlier in the run, if there is one. A
+     * file being written into a SquashFS image is linked to a copy in the 
+     * same image, sharing its stored content, or added from the spooled 
+     * content of a copy in another set's image.
+     *
+     * @param fileId The id of the file.
+     * @param image The SquashFS image to save the file into, or NULL to save it to the output folder.
+     * @param filePath The path to save the file to, within the image if there is one.
+     * @param slackPath The path to save the file's slack to, or empty.
+     * @param mtime The file's modification time, for a file added to an image from a spooled copy.
+     * @param savedFile Receives the results of saving the earlier copy.
+     * @return False if there is no earlier copy, or it could not be linked or 
+     * copied, in which case the file must be read from the evidence.
+     */
+    bool fanOutSavedFile(uint64_t fileId, Squashfs::Writer *image, const std::string &filePath, const std::string &slackPath, std::time_t mtime, 
+        SavedFile &savedFile)
+    {
+        std::map<uint64_t, SavedCopy>::const_iterator savedCopy = savedCopies.find(fileId);
+        if (savedCopy == savedCopies.end())
+        {
+            return false;
+        }
+
+        const SavedCopy &copy = (*savedCopy).second;
+        bool slackSaved = !slackPath.empty() && !copy.savedFile.slackPath.empty();
+        if (image != NULL || !copy.imagePath.empty())
+        {
+            if (image == NULL)
+            {
+                return false;
+            }
+
+            if (copy.imagePath == image->getPath() && image->addLink(filePath, copy.path))
+            {
+                slackSaved = slackSaved && image->addLink(slackPath, copy.path + ".slack");
+            }
+            else if (!copy.spoolPath.empty() && addSpooledFile(*image, copy.spoolPath, filePath, mtime))
+            {
+                slackSaved = slackSaved && addSpooledFile(*image, copy.spoolPath + ".slack", slackPath, mtime);
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else
+        {
+            // The copy's set may have been moved out of the staging folder since it was saved, or may be being moved now.
+            // A copy saved to the chunk store is saved again by its recipe.
+            const std::string contentSuffix = copy.savedFile.chunkRecipePath.empty() ? "" : CHUNK_RECIPE_SUFFIX;
+            const std::string sourcePath = Poco::File(copy.path + contentSuffix).exists() ? copy.path : copy.finalPath;
+            try
+            {
+                copySavedFile(sourcePath + contentSuffix, filePath + contentSuffix);
+                if (slackSaved)
+                {
+                    copySavedFile(sourcePath + ".slack", slackPath);
+                }
+            }
+            catch (Poco::Exception &)
+            {
+                return false;
+            }
+        }
+
+        savedFile = copy.savedFile;
+        savedFile.runsTime = 0;
+        savedFile.contentTime = 0;
+        savedFile.slackTime = 0;
+        savedFile.slackPath = slackSaved ? slackPath : "";
+        savedFile.chunkRecipePath = copy.savedFile.chunkRecipePath.empty() ? "" : filePath + CHUNK_RECIPE_SUFFIX;
+        savedFile.extentCopied = false;
+        savedFile.decompressedInParallel = false;
+        savedFile.fannedOut = true;
+        return true;
+    }
+
+    /**
+     * Remembers the saved copy of a file that is to be saved again later in 
+     * the run.
+     */
+    void rememberSavedFile(uint64_t fileId, const Squashfs::Writer *image, const std::string &filePath, const std::string &finalPath, 
+        const std::string &spoolPath, const ReportedFile &reportedFile, const SavedFile &savedFile)
+    {
+        if (pendingFanOuts.find(fileId) != pendingFanOuts.end() && savedCopies.find(fileId) == savedCopies.end())
+        {
+            SavedCopy &copy = savedCopies[fileId];
+            copy.path = filePath;
+            copy.finalPath = finalPath;
+            copy.imagePath = image != NULL ? image->getPath() : "";
+            copy.spoolPath = spoolPath;
+            copy.reportedFile = reportedFile;
+            copy.savedFile = savedFile;
+        }
+    }
+
+    /**
+     * @return The path to spool the content of a file being saved into a 
+     * SquashFS image to, or empty if the file is not to be saved in another
+     * set's image.
+     */
+    std::string getSpoolPath(uint64_t fileId, const Squashfs::Writer *image)
+    {
+        if (image == NULL || crossSetFanOuts.find(fileId) == crossSetFanOuts.end() || savedCopies.find(fileId) != savedCopies.end())
+        {
+            return std::string();
+        }
+
+        const std::string spoolFolderPath = outputFolderPath + SPOOL_FOLDER_NAME + Poco::Path::separator();
+        Poco::File(spoolFolderPath).createDirectories();
+        return spoolFolderPath + Poco::NumberFormatter::format(fileId);
+    }
+
+    /**
+     * Removes the spool folder and any spooled content left in it.
+     */
+    void removeSpoolFolder()
+    {
+        try
+        {
+            Poco::File spoolFolder(outputFolderPath + SPOOL_FOLDER_NAME);
+            if (spoolFolder.exists())
+            {
+                spoolFolder.remove(true);
+            }
+        }
+        catch (Poco::Exception &ex)
+        {
+            LOGWARN("SaveInterestingFilesModule::report : failed to remove spool folder: " + ex.displayText());
+        }
+    }
+
+    /**
+     * Notes that one of the planned saves of a file is done, and forgets its
+     * saved copy, and removes its spooled content, after the last.
+     */
+    void finishFanOut(uint64_t fileId)
+    {
+        std::map<uint64_t, unsigned int>::iterator fileUses = pendingFanOuts.find(fileId);
+        if (fileUses != pendingFanOuts.end() && --(*fileUses).second == 0)
+        {
+            pendingFanOuts.erase(fileUses);
+            std::map<uint64_t, SavedCopy>::iterator savedCopy = savedCopies.find(fileId);
+            if (savedCopy != savedCopies.end() && !(*savedCopy).second.spoolPath.empty())
+            {
+                const std::string spoolPath = (*savedCopy).second.spoolPath;
+                try
+                {
+                    Poco::File(spoolPath).remove();
+                    if (Poco::File(spoolPath + ".slack").exists())
+                    {
+                        Poco::File(spoolPath + ".slack").remove();
+                    }
+                }
+                catch (Poco::Exception &)
+                {
+                    // Left for removeSpoolFolder at the end of the run.
+                }
+            }
+            savedCopies.erase(fileId);
+        }
+    }
+
+    /**
+     * Schedules the planned files from next onwards for read-ahead, until the
+     * read-ahead window is full.
+     */
+    void scheduleReadAhead(std::vector<PlannedFile>::const_iterator &next, std::vector<PlannedFile>::const_iterator end)
+    {
+        // Hold fewer blocks while fewer workers are allowed to read them.
+        const uint64_t readAheadBytes = options.readAheadBytes / options.readWorkers * readAhead.getAllowedWorkers();
+        for (; next != end && readAhead.getCachedBytes() < readAheadBytes; ++next)
+        {
+            // Files that are not wholly initialized are read through the file system layer, which reads zeros past
+            // their initialized size.
+            SectorRunList runs;
+            TSK_OFF_T initializedSize = 0;
+            if (!(*next).isDirectory && savedCopies.find((*next).fileId) == savedCopies.end() && 
+                getFileSectorRuns((*next).fileId, (*next).typeId, (*next).metaFlags, (*next).size, runs) &&
+                getInitializedSize((*next).fileId, (*next).size, initializedSize) && initializedSize == (*next).size)
+            {
+                readAhead.schedule((*next).fileId, runs, (*next).size);
+            }
+        }
+    }
+
+#if defined(__linux__)
+    // Fraction of a file's sectors that must be in the page cache for the file to be saved ahead of the others.
+    const double CACHED_FRACTION = 0.9;
+
+    /**
+     * Orders the files of a set so that those whose content is in the page
+     * cache, e.g. because an earlier module has just read them, are saved 
+     * first, at memory speed, while those that must be read from disk queue
+     * behind them. Directories go before both, so that the folders of the
+     * files exist when they are saved; otherwise the plan's order is kept.
+     * The sector runs of the files are loaded into the metadata replica, so 
+     * that they are looked up once for both the check and the copy.
+     *
+     * @return The reordered files, or an empty list if none of the files is
+     * in the page cache.
+     */
+    std::vector<PlannedFile> orderCachedFirst(const std::vector<PlannedFile> &files)
+    {
+        std::vector<uint64_t> fileIds;
+        for (std::vector<PlannedFile>::const_iterator plannedFile = files.begin(); plannedFile != files.end(); ++plannedFile)
+        {
+            if (!(*plannedFile).isDirectory && (*plannedFile).size > 0 && (*plannedFile).typeId == TskImgDB::IMGDB_FILES_TYPE_FS && 
+                ((*plannedFile).metaFlags & TSK_FS_META_FLAG_COMP) == 0)
+            {
+                fileIds.push_back((*plannedFile).fileId);
+            }
+        }
+        try
+        {
+            metadataReplica.loadSectorRuns(fileIds);
+        }
+        catch (TskException &)
+        {
+            // The runs of the files that were not loaded are queried as usual, and any error reported then.
+        }
+
+        std::vector<PlannedFile> directories;
+        std::vector<PlannedFile> cachedFiles;
+        std::vector<PlannedFile> uncachedFiles;
+        for (std::vector<PlannedFile>::const_iterator plannedFile = files.begin(); plannedFile != files.end(); ++plannedFile)
+        {
+            if ((*plannedFile).isDirectory)
+            {
+                directories.push_back(*plannedFile);
+                continue;
+            }
+
+            uint64_t runBytes = 0;
+            uint64_t residentBytes = 0;
+            try
+            {
+                SectorRunList runs;
+                if ((*plannedFile).size > 0 && 
+                    getFileSectorRuns((*plannedFile).fileId, (*plannedFile).typeId, (*plannedFile).metaFlags, (*plannedFile).size, runs))
+                {
+                    for (SectorRunList::const_iterator run = runs.begin(); run != runs.end(); ++run)
+                    {
+                        runBytes += (*run).count * SECTOR_SIZE;
+                        residentBytes += rawImage.countResidentBytes((*run).sector * SECTOR_SIZE, (*run).count * SECTOR_SIZE);
+                    }
+                }
+            }
+            catch (TskException &)
+            {
+                // The file will be saved in its planned place, and any error reported then.
+            }
+
+            if (runBytes > 0 && residentBytes >= runBytes * CACHED_FRACTION)
+            {
+                cachedFiles.push_back(*plannedFile);
+            }
+            else
+            {
+                uncachedFiles.push_back(*plannedFile);
+            }
+        }
+
+        if (cachedFiles.empty())
+        {
+            return std::vector<PlannedFile>();
+        }
+        runStatistics.filesCachedFirst += cachedFiles.size();
+        directories.insert(directories.end(), cachedFiles.begin(), cachedFiles.end());
+        directories.insert(directories.end(), uncachedFiles.begin(), uncachedFiles.end());
+        return directories;
+    }
+#endif
+
+    // The part of the unique paths of the files of each file system before their full paths, by the byte offset of the 
+    // file system in the image, as found from the first hit directory reported from each.
+    std::map<uint64_t, std::string> uniquePathPrefixes;
+
+    /**
+     * @return The details of a hit directory for the report: from its record
+     * in the metadata replica, if the replica has it and another directory 
+     * in its file system has already been reported, and otherwise from the 
+     * file manager.
+     */
+    ReportedFile getReportedDirectory(uint64_t dirId)
+    {
+        const TskFileRecord *dirRec = metadataReplica.findFileRecord(dirId);
+        uint64_t fsOffset = 0;
+        uint64_t fsFileId = 0;
+        int attrType = 0;
+        int attrId = 0;
+        const bool onFileSystem = dirRec != NULL && dirRec->typeId == TskImgDB::IMGDB_FILES_TYPE_FS &&
+            TskServices::Instance().getImgDB().getFileUniqueIdentifiers(dirId, fsOffset, fsFileId, attrType, attrId) == 0;
+        if (onFileSystem)
+        {
+            std::map<uint64_t, std::string>::const_iterator prefix = uniquePathPrefixes.find(fsOffset);
+            if (prefix != uniquePathPrefixes.end())
+            {
+                return ReportedFile(*dirRec, (*prefix).second + dirRec->fullPath);
+            }
+        }
+
+        std::auto_ptr<TskFile> dir(TskServices::Instance().getFileManager().getFile(dirId));
+        ReportedFile reportedDir(*dir);
+        const std::string &uniquePath = reportedDir.uniquePath;
+        if (onFileSystem && uniquePath.size() >= dirRec->fullPath.size() && 
+            uniquePath.compare(uniquePath.size() - dirRec->fullPath.size(), std::string::npos, dirRec->fullPath) == 0)
+        {
+            uniquePathPrefixes[fsOffset] = uniquePath.substr(0, uniquePath.size() - dirRec->fullPath.size());
+        }
+        return reportedDir;
+    }
+
+    /**
+     * Saves the contents of a planned file, or links or copies them from a 
+     * copy saved earlier in the run. A file that cannot be saved is recorded
+     * as an error, so that the rest of its set can still be saved.
+     *
+     * @param setName The name of the file's set.
+     * @param plannedFile The planned file.
+     * @param image The SquashFS image to save the file into, or NULL to save
+     * it to filePath in the output folder.
+     * @param filePath The path to save the file to.
+     * @param reportedPath The path of the saved file as listed in the report.
+     * @param savedFile Set to the results of saving the file's contents.
+     * @return The details of the file for the report, or NULL if it could
+     * not be saved.
+     */
+    std::auto_ptr<ReportedFile> savePlannedFile(const std::string &setName, const PlannedFile &plannedFile, Squashfs::Writer *image, 
+        const std::string &filePath, const std::string &reportedPath, SavedFile &savedFile)
+    {
+        if (pressureMonitor.isRunning())
+        {
+            pressureMonitor.throttle();
+        }
+
+        // Time the save from here, leaving out any wait for the host's pressure to ease.
+        Poco::Timestamp start;
+        std::auto_ptr<ReportedFile> reportedFile;
+        std::string error;
+        try
+        {
+            // A file saved from an earlier copy is not opened; its details are those of the copy.
+            const std::string slackPath = options.saveSlack ? filePath + ".slack" : "";
+            if (fanOutSavedFile(plannedFile.fileId, image, filePath, slackPath, plannedFile.mtime, savedFile))
+            {
+                savedFile.contentTime = start.elapsed();
+                reportedFile.reset(new ReportedFile(savedCopies[plannedFile.fileId].reportedFile));
+            }
+            else
+            {
+                std::auto_ptr<TskFile> file(TskServices::Instance().getFileManager().getFile(plannedFile.fileId));
+                savedFile.openTime = start.elapsed();
+                reportedFile.reset(new ReportedFile(*file));
+                const std::string spoolPath = getSpoolPath(plannedFile.fileId, image);
+                copyFileContents(*file, image, filePath, slackPath, spoolPath, savedFile);
+                rememberSavedFile(plannedFile.fileId, image, filePath, reportedPath, spoolPath, *reportedFile, savedFile);
+            }
+            if (!savedFile.slackPath.empty())
+            {
+                savedFile.slackPath = reportedPath + ".slack";
+            }
+            if (!savedFile.chunkRecipePath.empty())
+            {
+                savedFile.chunkRecipePath = reportedPath + CHUNK_RECIPE_SUFFIX;
+                ++runStatistics.filesChunked;
+            }
+            ++runStatistics.filesSaved;
+            runStatistics.bytesSaved += reportedFile->size;
+            runStatistics.slackBytesSaved += savedFile.slackBytes;
+            if (savedFile.extentCopied)
+            {
+                ++runStatistics.filesExtentCopied;
+            }
+            if (savedFile.decompressedInParallel)
+            {
+                ++runStatistics.filesDecompressedInParallel;
+            }
+            if (savedFile.fannedOut)
+            {
+                ++runStatistics.filesFannedOut;
+            }
+        }
+        catch (TskException &ex)
+        {
+            error = "TskException: " + ex.message();
+        }
+        catch (Poco::Exception &ex)
+        {
+            error = "Poco::Exception: " + ex.displayText();
+        }
+        catch (std::exception &ex)
+        {
+            error = std::string("std::exception: ") + ex.what();
+        }
+        readAhead.release(plannedFile.fileId);
+        finishFanOut(plannedFile.fileId);
+        if (options.outliers > 0)
+        {
+            outlierLog.addFile(setName, plannedFile, savedFile, start.elapsed(), !error.empty());
+        }
+
+        if (!error.empty())
+        {
+            reportedFile.reset();
+            ++runStatistics.filesFailed;
+            std::stringstream subject;
+            subject << "file " << plannedFile.fileId;
+            errorLog.error("file save failed", subject.str(), "failed to save to " + filePath + ": " + error);
+        }
+        return reportedFile;
+    }
+
+    // Suffix of the marker written to a set's folder when the set is published.
+    const std::string PUBLISHED_MARKER_SUFFIX = ".done";
+
+    /**
+     * Writes a file under a temporary name and renames it into place, so 
+     * that it is either absent or complete.
+     */
+    void writeFileAtomically(const std::string &path, const std::string &content)
+    {
+        const std::string tempPath = path + ".tmp";
+        Poco::FileOutputStream stream(tempPath, std::ios::out | std::ios::trunc | std::ios::binary);
+        stream.write(content.data(), static_cast<std::streamsize>(content.size()));
+        stream.close();
+        if (!stream)
+        {
+            throw Poco::WriteFileException(tempPath);
+        }
+        Poco::File(tempPath).renameTo(path);
+    }
+
+    /**
+     * Flushes the data and metadata written to the volume holding a folder
+     * to stable storage. One syncfs() per set costs far less than an fsync()
+     * per saved file. On Windows, where that takes administrator rights,
+     * this is left to the volume's write-back.
+     */
+    void syncVolume(const std::string &folderPath)
+    {
+#if defined(__linux__)
+        int fd = open(folderPath.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd == -1)
+        {
+            throw Poco::OpenFileException(folderPath);
+        }
+        int result = syncfs(fd);
+        close(fd);
+        if (result != 0)
+        {
+            throw Poco::WriteFileException("failed to flush the volume holding " + folderPath);
+        }
+#elif !defined(_WIN32)
+        sync();
+#endif
+    }
+
+    /**
+     * Publishes a completed set: makes everything saved for it durable, then
+     * writes its completion marker, <set folder>/<set>.done, holding the path
+     * of the set's report. A consumer can start on a set once its marker 
+     * exists, while later sets are still being saved.
+     *
+     * @param setName The name of the set.
+     * @param setFolderPath The set's folder in its final location.
+     * @param reportPath The path of the set's report.
+     */
+    void publishSet(const std::string &setName, const std::string &setFolderPath, const std::string &reportPath)
+    {
+        syncVolume(setFolderPath);
+        if (chunkStore.isOpen())
+        {
+            syncVolume(chunkStore.getPath());
+        }
+
+        // Flush again so that the marker is only durable after the set.
+        writeFileAtomically(Poco::Path::forDirectory(setFolderPath).toString() + setName + PUBLISHED_MARKER_SUFFIX, reportPath + "\n");
+        syncVolume(setFolderPath);
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(runStatisticsLock);
+            ++runStatistics.setsPublished;
+        }
+        LOGINFO("SaveInterestingFilesModule::report : published set '" + setName + "'");
+    }
+
+    /**
+     * Removes the completion marker of a set left by an earlier run into the 
+     * same folder, so that the set is not taken as complete while it is 
+     * being saved again.
+     */
+    void withdrawSet(const std::string &setName, const std::string &setFolderPath)
+    {
+        Poco::File marker(Poco::Path::forDirectory(setFolderPath).toString() + setName + PUBLISHED_MARKER_SUFFIX);
+        if (marker.exists())
+        {
+            marker.remove();
+        }
+    }
+
+    /**
+     * Saves the files in a set plan and writes the set's report. If sets are
+     * saved as SquashFS images, the files and a copy of the report are 
+     * written into the image <set>/<set>.sqsh instead of the set's folder,
+     * and the report lists the paths of the files within the image.
+     *
+     * @param plan The set plan.
+     * @param outputRootPath The folder to save the set to.
+     * @param reportRootPath The folder the set will finally reside in, which
+     * differs from outputRootPath if the set is being staged. The report lists
+     * the paths of the saved files relative to this folder.
+     * @param counters The performance counters of the calling thread.
+     */
+    void saveFiles(const SetPlan &plan, const std::string &outputRootPath, const std::string &reportRootPath, const PerfCounters &counters)
+    {
+        // Start an XML report of the files in the set.
+        Poco::AutoPtr<Poco::XML::Document> report = new Poco::XML::Document();
+        Poco::AutoPtr<Poco::XML::Element> reportRoot = report->createElement("InterestingFileSet");
+        reportRoot->setAttribute("name", plan.name);
+        reportRoot->setAttribute("description", plan.description);
+        report->appendChild(reportRoot);
+
+        // Make a subdirectory of the output folder named for the interesting file set.
+        Poco::Path fileSetFolderPath(Poco::Path::forDirectory(outputRootPath));
+        fileSetFolderPath.pushDirectory(plan.name);
+        Poco::File(fileSetFolderPath).createDirectories();
+        if (options.publish)
+        {
+            Poco::Path finalSetFolderPath(Poco::Path::forDirectory(reportRootPath));
+            finalSetFolderPath.pushDirectory(plan.name);
+            withdrawSet(plan.name, finalSetFolderPath.toString());
+        }
+
+        std::auto_ptr<Squashfs::Writer> image;
+        std::auto_ptr<ImageCompressors> imageCompressors;
+        std::string reportedImage;
+        if (options.squashfsImages)
+        {
+            Poco::Path imagePath(fileSetFolderPath, plan.name + ".sqsh");
+            image.reset(new Squashfs::Writer(imagePath.toString(), options.compressWorkers, Squashfs::DEFAULT_BLOCK_SIZE, &imageCompressorRunner));
+            imageCompressors.reset(new ImageCompressors(*image, options.compressWorkers));
+            Poco::Path reportedImagePath(Poco::Path::forDirectory(reportRootPath));
+            reportedImagePath.pushDirectory(plan.name);
+            reportedImagePath.setFileName(plan.name + ".sqsh");
+            reportedImage = reportedImagePath.toString();
+            reportRoot->setAttribute("image", reportedImage);
+        }
+        
+        // On raw evidence, check just before saving the set which of its files are in the page cache, to save those
+        // first.
+        std::vector<PlannedFile> cachedFirstFiles;
+#if defined(__linux__)
+        if (options.cacheFirst && rawImage.isOpen())
+        {
+            PhaseTimer timer("report thread", "check page cache", counters);
+            cachedFirstFiles = orderCachedFirst(plan.files);
+        }
+#endif
+        const std::vector<PlannedFile> &files = cachedFirstFiles.empty() ? plan.files : cachedFirstFiles;
+
+        // Save all of the files in the plan.
+        {
+            PhaseTimer timer("report thread", "save files", counters);
+            std::vector<PlannedFile>::const_iterator nextToSchedule = files.begin();
+            for (std::vector<PlannedFile>::const_iterator plannedFile = files.begin(); plannedFile != files.end(); ++plannedFile)
+            {
+                if (readAhead.isRunning())
+                {
+                    scheduleReadAhead(nextToSchedule, files.end());
+                }
+
+                const std::string filePath = image.get() != NULL ? (*plannedFile).relativePath : outputRootPath + (*plannedFile).relativePath;
+                const std::string reportedPath = image.get() != NULL ? (*plannedFile).relativePath : reportRootPath + (*plannedFile).relativePath;
+                if ((*plannedFile).isDirectory)
+                {
+                    if (image.get() != NULL)
+                    {
+                        image->addDirectory(filePath, (*plannedFile).mtime);
+                    }
+                    else
+                    {
+                        Poco::File(filePath).createDirectories();
+                    }
+                    if ((*plannedFile).isHit)
+                    {
+                        const ReportedFile dir = getReportedDirectory((*plannedFile).fileId);
+                        addFileToReport(dir, reportedPath, report);
+                        if (manifest.isOpen())
+                        {
+                            manifest.addFile(plan.name, reportedImage, dir, reportedPath, NULL);
+                        }
+                        ++runStatistics.directoriesSaved;
+                    }
+                    continue;
+                }
+
+                // A file that cannot be saved is left out of the report.
+                SavedFile savedFile;
+                std::auto_ptr<ReportedFile> file = savePlannedFile(plan.name, *plannedFile, image.get(), filePath, reportedPath, savedFile);
+                if (file.get() != NULL)
+                {
+                    addFileToReport(*file, reportedPath, report, &savedFile);
+                    if (manifest.isOpen())
+                    {
+                        manifest.addFile(plan.name, reportedImage, *file, reportedPath, &savedFile);
+                    }
+                }
+            }
+        }
+
+        // Write out the completed XML report.
+        {
+            PhaseTimer timer("report thread", "write reports", counters);
+            // The report is renamed into place once written, so that it is never seen half written.
+            fileSetFolderPath.setFileName(plan.name + ".xml");
+            Poco::XML::DOMWriter writer;
+            writer.setNewLine("\n");
+            writer.setOptions(Poco::XML::XMLWriter::PRETTY_PRINT);
+            std::ostringstream reportText;
+            writer.writeNode(reportText, report);
+            writeFileAtomically(fileSetFolderPath.toString(), reportText.str());
+
+            if (image.get() != NULL)
+            {
+                // Put a copy of the report in the image, so the image is complete on its own.
+                image->addFile(plan.name + "/" + plan.name + ".xml", std::time(NULL), reportText.str());
+            }
+        }
+
+        if (image.get() != NULL)
+        {
+            PhaseTimer timer("report thread", "finish images", counters);
+            runStatistics.imageBytes += image->finish();
+            ++runStatistics.imagesSaved;
+        }
+        if (manifest.isOpen())
+        {
+            manifest.endSet();
+        }
+        ++runStatistics.setsSaved;
+
+        // A staged set is published once it has been moved to its final folder.
+        if (options.publish && outputRootPath == reportRootPath)
+        {
+            PhaseTimer timer("report thread", "publish sets", counters);
+            Poco::Path setFolderPath(Poco::Path::forDirectory(reportRootPath));
+            setFolderPath.pushDirectory(plan.name);
+            publishSet(plan.name, setFolderPath.toString(), setFolderPath.toString() + plan.name + ".xml");
+        }
+    }
+
+    // Name of the report shared by the sets saved together by saveConsolidatedSets().
+    const std::string CONSOLIDATED_REPORT_NAME = "SaveInterestingFilesModule_sets.xml";
+
+    /**
+     * Adds the folders a planned file needs, relative to the output folder, 
+     * to a set of folders: the file's own folder if it is a directory, 
+     * otherwise the folder it is in, and the folders above it.
+     */
+    void addPlannedFolders(const PlannedFile &plannedFile, std::set<std::string> &folderPaths)
+    {
+        const std::string &path = plannedFile.relativePath;
+        const char separator = Poco::Path::separator();
+        // The path of a directory ends with a separator; the folder of a file ends at the last separator of its path.
+        std::string::size_type end = plannedFile.isDirectory ? path.size() : path.rfind(separator);
+        if (end == std::string::npos)
+        {
+            return;
+        }
+        for (std::string::size_type pos = path.find(separator); pos != std::string::npos && pos <= end; pos = path.find(separator, pos + 1))
+        {
+            // Skip the empty components of doubled separators.
+            if (pos > 0 && path[pos - 1] != separator)
+            {
+                folderPaths.insert(path.substr(0, pos + 1));
+            }
+        }
+    }
+
+    /**
+     * Saves sets too small to be worth a folder and a report of their own 
+     * to the output folder together. The folders of all of the sets are 
+     * created in a single sorted pass, one directory creation each, and the
+     * sets' reports are streamed as they are saved to a single shared 
+     * report, CONSOLIDATED_REPORT_NAME, rather than built as a document per
+     * set. The sets are saved as folders of files whatever the format 
+     * option, and are not staged.
+     */
+    void saveConsolidatedSets(const std::vector<const SetPlan*> &plans, const PerfCounters &counters)
+    {
+        {
+            PhaseTimer timer("report thread", "create folders", counters);
+            std::set<std::string> folderPaths;
+            for (std::vector<const SetPlan*>::const_iterator plan = plans.begin(); plan != plans.end(); ++plan)
+            {
+                folderPaths.insert((*plan)->name + Poco::Path::separator());
+                for (std::vector<PlannedFile>::const_iterator plannedFile = (*plan)->files.begin(); plannedFile != (*plan)->files.end(); ++plannedFile)
+                {
+                    addPlannedFolders(*plannedFile, folderPaths);
+                }
+            }
+
+            // A folder sorts after the folders above it, so each folder's parent already exists when it is created.
+            for (std::set<std::string>::const_iterator folderPath = folderPaths.begin(); folderPath != folderPaths.end(); ++folderPath)
+            {
+                Poco::File(outputFolderPath + *folderPath).createDirectory();
+            }
+        }
+
+        for (std::vector<const SetPlan*>::const_iterator plan = plans.begin(); plan != plans.end() && options.publish; ++plan)
+        {
+            withdrawSet((*plan)->name, outputFolderPath + (*plan)->name + Poco::Path::separator());
+        }
+
+        // The shared report is renamed into place once complete, so that it is never seen half written.
+        const std::string reportPath = outputFolderPath + CONSOLIDATED_REPORT_NAME;
+        Poco::FileOutputStream reportFile(reportPath + ".tmp");
+        Poco::XML::XMLWriter writer(reportFile, Poco::XML::XMLWriter::PRETTY_PRINT);
+        writer.setNewLine("\n");
+        writer.startDocument();
+        writer.startElement("", "", "InterestingFileSets");
+        {
+            PhaseTimer timer("report thread", "save files", counters);
+            for (std::vector<const SetPlan*>::const_iterator plan = plans.begin(); plan != plans.end(); ++plan)
+            {
+                Poco::XML::AttributesImpl attributes;
+                attributes.addAttribute("", "", "name", "CDATA", (*plan)->name);
+                attributes.addAttribute("", "", "description", "CDATA", (*plan)->description);
+                writer.startElement("", "", "InterestingFileSet", attributes);
+
+                std::vector<PlannedFile>::const_iterator nextToSchedule = (*plan)->files.begin();
+                for (std::vector<PlannedFile>::const_iterator plannedFile = (*plan)->files.begin(); plannedFile != (*plan)->files.end(); ++plannedFile)
+                {
+                    if (readAhead.isRunning())
+                    {
+                        scheduleReadAhead(nextToSchedule, (*plan)->files.end());
+                    }
+
+                    const std::string filePath = outputFolderPath + (*plannedFile).relativePath;
+                    if ((*plannedFile).isDirectory)
+                    {
+                        if ((*plannedFile).isHit)
+                        {
+                            const ReportedFile dir = getReportedDirectory((*plannedFile).fileId);
+                            writeFileToReport(writer, dir, filePath);
+                            if (manifest.isOpen())
+                            {
+                                manifest.addFile((*plan)->name, "", dir, filePath, NULL);
+                            }
+                            ++runStatistics.directoriesSaved;
+                        }
+                        continue;
+                    }
+
+                    // A file that cannot be saved is left out of the report.
+                    SavedFile savedFile;
+                    std::auto_ptr<ReportedFile> file = savePlannedFile((*plan)->name, *plannedFile, NULL, filePath, filePath, savedFile);
+                    if (file.get() != NULL)
+                    {
+                        writeFileToReport(writer, *file, filePath, &savedFile);
+                        if (manifest.isOpen())
+                        {
+                            manifest.addFile((*plan)->name, "", *file, filePath, &savedFile);
+                        }
+                    }
+                }
+
+                writer.endElement("", "", "InterestingFileSet");
+                ++runStatistics.setsSaved;
+                ++runStatistics.setsConsolidated;
+            }
+        }
+        writer.endElement("", "", "InterestingFileSets");
+        writer.endDocument();
+        reportFile.close();
+        if (!reportFile)
+        {
+            throw Poco::WriteFileException(reportPath + ".tmp");
+        }
+        Poco::File(reportPath + ".tmp").renameTo(reportPath);
+
+        if (manifest.isOpen())
+        {
+            manifest.endSet();
+        }
+
+        // The sets share a report, so they are published together once it is complete.
+        if (options.publish)
+        {
+            PhaseTimer timer("report thread", "publish sets", counters);
+            for (std::vector<const SetPlan*>::const_iterator plan = plans.begin(); plan != plans.end(); ++plan)
+            {
+                publishSet((*plan)->name, outputFolderPath + (*plan)->name + Poco::Path::separator(), reportPath);
+            }
+        }
+    }
+
+    /**
+     * Copies a file a chunk at a time, backing off between chunks while the
+     * host is under pressure, and gives the copy the file's modification 
+     * time.
+     */
+    void copyFileThrottled(Poco::File &source, const std::string &destPath)
+    {
+        Poco::FileInputStream input(source.path(), std::ios::in | std::ios::binary);
+        Poco::FileOutputStream output(destPath, std::ios::out | std::ios::trunc | std::ios::binary);
+        std::vector<char> buffer(COPY_BUFFER_SIZE);
+        while (input)
+        {
+            pressureMonitor.throttleBackground();
+            input.read(&buffer[0], static_cast<std::streamsize>(buffer.size()));
+            output.write(&buffer[0], input.gcount());
+        }
+        if (input.bad())
+        {
+            throw Poco::ReadFileException(source.path());
+        }
+        output.close();
+        if (!output)
+        {
+            throw Poco::WriteFileException(destPath);
+        }
+        Poco::File(destPath).setLastModified(source.getLastModified());
+    }
+
+    /**
+     * Renames a file, replacing any file at the new path.
+     *
+     * @return False if the new path is on another volume, in which case the
+     * file has to be copied.
+     * @throws Poco::FileException if the file could not be renamed for any
+     * other reason.
+     */
+    bool renameOnVolume(const std::string &sourcePath, const std::string &destPath)
+    {
+#if defined(_WIN32)
+        if (MoveFileExA(sourcePath.c_str(), destPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+        {
+            return true;
+        }
+        const DWORD error = GetLastError();
+        if (error == ERROR_NOT_SAME_DEVICE)
+        {
+            return false;
+        }
+        throw Poco::FileException("cannot move " + sourcePath + " to " + destPath + ": error " + Poco::NumberFormatter::format(static_cast<unsigned int>(error)));
+#else
+        if (::rename(sourcePath.c_str(), destPath.c_str()) == 0)
+        {
+            return true;
+        }
+        const int error = errno;
+        if (error == EXDEV)
+        {
+            return false;
+        }
+        throw Poco::FileException("cannot move " + sourcePath + " to " + destPath + ": " + strerror(error));
+#endif
+    }
+
+    /**
+     * Moves the contents of a folder into another folder, merging it with any
+     * existing contents, and removes the source folder. Files are renamed if
+     * both folders are on the same volume and copied otherwise; a file that
+     * fails to copy is not left part written in the destination.
+     */
+    void moveFolderContents(const std::string &sourcePath, const std::string &destPath)
+    {
+        Poco::File(destPath).createDirectories();
+
+        std::vector<std::string> names;
+        Poco::File(sourcePath).list(names);
+        for (std::vector<std::string>::const_iterator name = names.begin(); name != names.end(); ++name)
+        {
+            Poco::File source(sourcePath + *name);
+            if (source.isDirectory())
+            {
+                moveFolderContents(sourcePath + *name + Poco::Path::separator(), destPath + *name + Poco::Path::separator());
+                continue;
+            }
+
+            const std::string dest = destPath + *name;
+            if (renameOnVolume(source.path(), dest))
+            {
+                continue;
+            }
+            try
+            {
+                copyFileThrottled(source, dest);
+            }
+            catch (...)
+            {
+                try
+                {
+                    Poco::File(dest).remove();
+                }
+                catch (Poco::Exception &)
+                {
+                }
+                throw;
+            }
+            source.remove();
+        }
+
+        Poco::File(sourcePath).remove();
+    }
+
+    /**
+     * Request to move a completed set from the staging folder to its final
+     * output folder.
+     */
+    class MigrationNotification : public Poco::Notification
+    {
+    public:
+        MigrationNotification(const std::string &setName, const std::string &stagingSetPath, const std::string &finalSetPath, uint64_t bytes)
+            : setName(setName), stagingSetPath(stagingSetPath), finalSetPath(finalSetPath), bytes(bytes)
+        {
+        }
+
+        std::string setName;
+        std::string stagingSetPath;
+        std::string finalSetPath;
+        uint64_t bytes;
+    };
+
+    /**
+     * Background thread that moves completed sets from the staging folder to
+     * the output folder while later sets are being saved, and keeps track of
+     * the bytes waiting in the staging folder and, per destination volume, 
+     * the bytes still to be moved there.
+     */
+    class StagingMover : public Poco::Runnable
+    {
+    public:
+        StagingMover() : pendingBytes(0), migrated(true) {}
+
+        void start()
+        {
+            thread.start(*this);
+        }
+
+        /**
+         * Queues a completed set to be moved. 
+         */
+        void enqueue(const std::string &setName, const std::string &stagingSetPath, const std::string &finalSetPath, uint64_t bytes)
+        {
+            {
+                Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                pendingBytes += bytes;
+                queuedBytes[volumeKey(Poco::Path(finalSetPath).parent().toString())] += bytes;
+            }
+            queue.enqueueNotification(new MigrationNotification(setName, stagingSetPath, finalSetPath, bytes));
+        }
+
+        /**
+         * @return The estimated bytes of the sets queued or being moved to 
+         * the volume holding a folder. Space they have already taken there
+         * is counted again until their move completes.
+         */
+        uint64_t getQueuedBytes(const std::string &folderPath)
+        {
+            Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+            std::map<std::string, uint64_t>::const_iterator bytes = queuedBytes.find(volumeKey(folderPath));
+            return bytes != queuedBytes.end() ? (*bytes).second : 0;
+        }
+
+        /**
+         * Waits until the given number of bytes can be added to the staging 
+         * folder without exceeding the high-water mark, or until the staging 
+         * folder is empty.
+         */
+        void waitForSpace(uint64_t bytes, uint64_t highWater)
+        {
+            for (;;)
+            {
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    if (pendingBytes == 0 || pendingBytes + bytes <= highWater)
+                    {
+                        return;
+                    }
+                }
+                migrated.wait();
+            }
+        }
+
+        /**
+         * Waits for all queued sets to be moved and stops the thread.
+         *
+         * @return Error messages for sets that could not be moved.
+         */
+        std::vector<std::string> finish()
+        {
+            queue.enqueueNotification(new MigrationNotification("", "", "", 0));
+            thread.join();
+            return errors;
+        }
+
+        virtual void run()
+        {
+            PerfCounters counters;
+            if (options.perfCounters)
+            {
+                counters.open();
+            }
+
+            for (;;)
+            {
+                Poco::AutoPtr<Poco::Notification> notification(queue.waitDequeueNotification());
+                MigrationNotification *migration = dynamic_cast<MigrationNotification*>(notification.get());
+                if (migration == NULL || migration->stagingSetPath.empty())
+                {
+                    break;
+                }
+
+                try
+                {
+                    PhaseTimer timer("staging mover", "move sets", counters);
+                    moveFolderContents(migration->stagingSetPath, migration->finalSetPath);
+                    if (options.publish)
+                    {
+                        publishSet(migration->setName, migration->finalSetPath, migration->finalSetPath + migration->setName + ".xml");
+                    }
+                }
+                catch (Poco::Exception &ex)
+                {
+                    errors.push_back("failed to move set '" + migration->setName + "' from " + migration->stagingSetPath + " to " + 
+                        migration->finalSetPath + ": " + ex.displayText());
+                }
+
+                {
+                    Poco::ScopedLock<Poco::FastMutex> lock(mutex);
+                    pendingBytes -= migration->bytes;
+                    queuedBytes[volumeKey(Poco::Path(migration->finalSetPath).parent().toString())] -= migration->bytes;
+                }
+                migrated.set();
+            }
+        }
+
+    private:
+        /**
+         * @return The key of the volume holding a folder, or of the folder 
+         * itself if its volume cannot be determined.
+         */
+        static std::string volumeKey(const std::string &folderPath)
+        {
+            const std::string volumeId = getVolumeId(folderPath);
+            return volumeId.empty() ? folderPath : volumeId;
+        }
+
+        Poco::NotificationQueue queue;
+        Poco::Thread thread;
+        Poco::FastMutex mutex;
+        uint64_t pendingBytes;
+        std::map<std::string, uint64_t> queuedBytes;
+        Poco::Event migrated;
+        std::vector<std::string> errors;
+    };
+
+    /**
+     * Saves a set that has been admitted to an output folder, through the
+     * staging folder if one is configured and the set can be staged without 
+     * exceeding the high-water mark. If the staging folder is over the mark,
+     * waits for the mover to drain it first; a set too large to ever be 
+     * staged is saved directly to the output folder.
+     */
+    void saveAdmittedSet(const SetPlan &plan, const std::string &outputRootPath, uint64_t estimatedBytes, StagingMover *mover, 
+        uint64_t stagingHighWater, const PerfCounters &counters)
+    {
+        if (mover != NULL && estimatedBytes <= stagingHighWater)
+        {
+            {
+                PhaseTimer timer("report thread", "wait for staging space", counters);
+                mover->waitForSpace(estimatedBytes, stagingHighWater);
+            }
+
+            if (fitsInFolder(estimatedBytes, options.stagingFolderPath))
+            {
+                saveFiles(plan, options.stagingFolderPath, outputRootPath, counters);
+                mover->enqueue(plan.name, options.stagingFolderPath + plan.name + Poco::Path::separator(), 
+                    outputRootPath + plan.name + Poco::Path::separator(), estimatedBytes);
+                ++runStatistics.setsStaged;
+                return;
+            }
+        }
+
+        saveFiles(plan, outputRootPath, outputRootPath, counters);
+    }
+
+    /**
+     * @return The ids of the files saved earlier in the run that a set saved
+     * to the given folder will hard link to rather than copy: those whose 
+     * first copy is on the folder's volume, as long as the set is not staged
+     * on another volume (moving it would turn its links into copies).
+     */
+    std::set<uint64_t> getLinkableFileIds(const std::string &folderPath, StagingMover *mover)
+    {
+        std::set<uint64_t> fileIds;
+        const std::string volumeId = getVolumeId(folderPath);
+        if (!savesHardLinks() || savedCopies.empty() || volumeId.empty() || 
+            (mover != NULL && getVolumeId(options.stagingFolderPath) != volumeId))
+        {
+            return fileIds;
+        }
+
+        // Saved copies are in the output, overflow or staging folder.
+        std::vector<std::string> rootPaths;
+        rootPaths.push_back(outputFolderPath);
+        rootPaths.push_back(options.overflowFolderPath);
+        rootPaths.push_back(options.stagingFolderPath);
+        std::vector<bool> rootsOnVolume;
+        for (std::vector<std::string>::const_iterator rootPath = rootPaths.begin(); rootPath != rootPaths.end(); ++rootPath)
+        {
+            rootsOnVolume.push_back(!(*rootPath).empty() && getVolumeId(*rootPath) == volumeId);
+        }
+
+        for (std::map<uint64_t, SavedCopy>::const_iterator savedCopy = savedCopies.begin(); savedCopy != savedCopies.end(); ++savedCopy)
+        {
+            const SavedCopy &copy = (*savedCopy).second;
+            bool onVolume = copy.imagePath.empty();
+            for (size_t root = 0; root < rootPaths.size() && onVolume; ++root)
+            {
+                const std::string &rootPath = rootPaths[root];
+                if (!rootPath.empty() && 
+                    (copy.path.compare(0, rootPath.size(), rootPath) == 0 || copy.finalPath.compare(0, rootPath.size(), rootPath) == 0))
+                {
+                    onVolume = rootsOnVolume[root];
+                }
+            }
+            if (onVolume)
+            {
+                fileIds.insert((*savedCopy).first);
+            }
+        }
+        return fileIds;
+    }
+
+    /**
+     * @return The output space a set is estimated to need in the given 
+     * folder: its estimate, less the files it will hard link there.
+     */
+    uint64_t estimateSetBytes(const SetPlan &plan, const std::string &folderPath, StagingMover *mover)
+    {
+        return plan.estimatedBytes - estimateLinkedBytes(plan, getLinkableFileIds(folderPath, mover));
+    }
+
+    /**
+     * Chooses the folder to save a set to: the output folder if the set fits
+     * there, otherwise the overflow folder if it fits there. The space that
+     * staged sets will take once moved is not counted as free.
+     *
+     * @param mover The staging mover, or NULL if sets are not staged.
+     * @param estimatedBytes Receives the space the set is estimated to need in the chosen folder.
+     * @return The chosen folder, or an empty string if the set fits in neither.
+     */
+    std::string admitSet(const SetPlan &plan, StagingMover *mover, uint64_t &estimatedBytes)
+    {
+        estimatedBytes = estimateSetBytes(plan, outputFolderPath, mover);
+        if (fitsInFolder(estimatedBytes, outputFolderPath, mover != NULL ? mover->getQueuedBytes(outputFolderPath) : 0))
+        {
+            return outputFolderPath;
+        }
+
+        if (!options.overflowFolderPath.empty())
+        {
+            Poco::File(options.overflowFolderPath).createDirectories();
+            estimatedBytes = estimateSetBytes(plan, options.overflowFolderPath, mover);
+            if (fitsInFolder(estimatedBytes, options.overflowFolderPath, mover != NULL ? mover->getQueuedBytes(options.overflowFolderPath) : 0))
+            {
+                ++runStatistics.setsRerouted;
+                std::stringstream msg;
+                msg << "SaveInterestingFilesModule::report : set '" << plan.name << "' needs an estimated " << estimatedBytes 
+                    << " bytes and does not fit in the output folder, saving it to " << options.overflowFolderPath;
+                LOGWARN(msg.str());
+                return options.overflowFolderPath;
+            }
+        }
+
+        return std::string();
+    }
+
+    bool hasSmallerEstimate(const SetPlan *left, const SetPlan *right)
+    {
+        return left->estimatedBytes < right->estimatedBytes;
+    }
+
+    /**
+     * Saves the planned sets, admitting each set only if the space it is 
+     * estimated to need is available. Sets that do not fit are deferred until 
+     * all the other sets have been saved and then retried smallest first, 
+     * in case space has been freed in the meantime.
+     *
+     * @return False if any set had to be skipped for lack of space or could
+     * not be moved from the staging folder.
+     */
+    bool saveSets(const std::vector<SetPlan> &plans, const PerfCounters &counters)
+    {
+        // Start moving completed sets out of the staging folder, if there is one, in the background.
+        std::auto_ptr<StagingMover> mover;
+        uint64_t stagingHighWater = options.stagingHighWater;
+        if (!options.stagingFolderPath.empty())
+        {
+            Poco::File(options.stagingFolderPath).createDirectories();
+            if (stagingHighWater == 0)
+            {
+                stagingHighWater = getFreeSpace(options.stagingFolderPath) / 10 * 9;
+            }
+            mover.reset(new StagingMover());
+            mover->start();
+        }
+
+        bool allSaved = true;
+        try
+        {
+            // Save the small sets together, if they all fit in the output folder, and the rest of the sets one by one.
+            // A file in several of the small sets is counted once if its copies are hard linked.
+            std::vector<const SetPlan*> consolidatedPlans;
+            uint64_t consolidatedBytes = 0;
+            std::set<uint64_t> consolidatedFileIds;
+            for (std::vector<SetPlan>::const_iterator plan = plans.begin(); plan != plans.end() && options.consolidateMaxFiles > 0; ++plan)
+            {
+                if ((*plan).files.size() <= options.consolidateMaxFiles)
+                {
+                    consolidatedPlans.push_back(&(*plan));
+                    consolidatedBytes += (*plan).estimatedBytes - estimateLinkedBytes(*plan, consolidatedFileIds);
+                    for (std::vector<PlannedFile>::const_iterator plannedFile = (*plan).files.begin(); plannedFile != (*plan).files.end(); ++plannedFile)
+                    {
+                        consolidatedFileIds.insert((*plannedFile).fileId);
+                    }
+                }
+            }
+            const bool consolidated = !consolidatedPlans.empty() && fitsInFolder(consolidatedBytes, outputFolderPath);
+            if (consolidated)
+            {
+                saveConsolidatedSets(consolidatedPlans, counters);
+            }
+
+            std::vector<const SetPlan*> deferredPlans;
+            for (std::vector<SetPlan>::const_iterator plan = plans.begin(); plan != plans.end(); ++plan)
+            {
+                if (consolidated && (*plan).files.size() <= options.consolidateMaxFiles)
+                {
+                    continue;
+                }
+
+                uint64_t estimatedBytes = 0;
+                std::string outputRootPath = admitSet(*plan, mover.get(), estimatedBytes);
+                if (outputRootPath.empty())
+                {
+                    ++runStatistics.setsDeferred;
+                    deferredPlans.push_back(&(*plan));
+                    continue;
+                }
+                saveAdmittedSet(*plan, outputRootPath, estimatedBytes, mover.get(), stagingHighWater, counters);
+            }
+
+            std::sort(deferredPlans.begin(), deferredPlans.end(), hasSmallerEstimate);
+            for (std::vector<const SetPlan*>::const_iterator plan = deferredPlans.begin(); plan != deferredPlans.end(); ++plan)
+            {
+                uint64_t estimatedBytes = 0;
+                std::string outputRootPath = admitSet(**plan, mover.get(), estimatedBytes);
+                if (outputRootPath.empty())
+                {
+                    ++runStatistics.setsSkipped;
+                    allSaved = false;
+                    std::stringstream msg;
+                    msg << "needs an estimated " << (*plan)->estimatedBytes << " bytes, more than the free space in the output folder, skipping set";
+                    errorLog.error("set does not fit", "set '" + (*plan)->name + "'", msg.str());
+                    continue;
+                }
+                saveAdmittedSet(**plan, outputRootPath, estimatedBytes, mover.get(), stagingHighWater, counters);
+            }
+        }
+        catch (...)
+        {
+            // Don't leave the mover running while the module unwinds.
+            if (mover.get() != NULL)
+            {
+                mover->finish();
+            }
+            throw;
+        }
+
+        // Wait for the staged sets to reach the output folder.
+        if (mover.get() != NULL)
+        {
+            PhaseTimer timer("report thread", "wait for migration", counters);
+            std::vector<std::string> errors = mover->finish();
+            for (std::vector<std::string>::const_iterator error = errors.begin(); error != errors.end(); ++error)
+            {
+                allSaved = false;
+                errorLog.error("set move failed", "staging folder", *error);
+            }
+        }
+
+        return allSaved;
+    }
+
+    // Bytes at the start of each file system that subset images hold whatever the file system's type, to cover its
+    // boot sector or superblock and the structures that directly follow it.
+    const uint64_t FILE_SYSTEM_HEADER_BYTES = 64 * 1024;
+
+    // A run of image sectors: the first sector and the sector count.
+    typedef std::pair<uint64_t, uint64_t> SectorExtent;
+
+    /**
+     * Adds all of the sector runs allocated to a file, including slack and
+     * runs of compressed content, to a list of extents.
+     */
+    void addFileExtents(uint64_t fileId, std::vector<SectorExtent> &extents)
+    {
+        SectorRunList runs;
+        if (!metadataReplica.findSectorRuns(fileId, runs))
+        {
+            querySectorRuns(fileId, runs);
+        }
+        for (SectorRunList::const_iterator run = runs.begin(); run != runs.end(); ++run)
+        {
+            extents.push_back(std::make_pair((*run).sector, (*run).count));
+        }
+    }
+
+    /**
+     * Sorts a list of extents and merges those that overlap or adjoin.
+     */
+    void mergeSectorExtents(std::vector<SectorExtent> &extents)
+    {
+        std::sort(extents.begin(), extents.end());
+        std::vector<SectorExtent> merged;
+        for (std::vector<SectorExtent>::const_iterator extent = extents.begin(); extent != extents.end(); ++extent)
+        {
+            if ((*extent).second == 0)
+            {
+                continue;
+            }
+            if (!merged.empty() && (*extent).first <= merged.back().first + merged.back().second)
+            {
+                merged.back().second = std::max(merged.back().first + merged.back().second, (*extent).first + (*extent).second) - merged.back().first;
+            }
+            else
+            {
+                merged.push_back(*extent);
+            }
+        }
+        extents.swap(merged);
+    }
+
+    /**
+     * Determines the sectors of the evidence a subset image must hold for 
+     * the planned files to be found and parsed in place: the sectors of the
+     * planned files and directories and of the directories above them, of 
+     * the file system metadata files in the roots of their file systems 
+     * (e.g., $MFT, $FAT1 or $CatalogFile, which TSK names with a leading $),
+     * the start of every file system, and the partition tables.
+     *
+     * @return The extents, sorted and merged.
+     */
+    std::vector<SectorExtent> planSubsetImage(const std::vector<SetPlan> &plans)
+    {
+        std::set<uint64_t> fileIds;
+        std::vector<uint64_t> unvisited;
+        for (std::vector<SetPlan>::const_iterator plan = plans.begin(); plan != plans.end(); ++plan)
+        {
+            for (std::vector<PlannedFile>::const_iterator plannedFile = (*plan).files.begin(); plannedFile != (*plan).files.end(); ++plannedFile)
+            {
+                if (fileIds.insert((*plannedFile).fileId).second)
+                {
+                    unvisited.push_back((*plannedFile).fileId);
+                }
+            }
+        }
+
+        // Walk up from the planned files to the roots of their file systems, a level at a time. A root is a directory 
+        // with no parent record.
+        std::map<uint64_t, uint64_t> parentIds;
+        std::set<uint64_t> dirIds;
+        while (!unvisited.empty())
+        {
+            std::map<uint64_t, TskFileRecord> fileRecs;
+            getFileRecords(unvisited, fileRecs);
+            unvisited.clear();
+            for (std::map<uint64_t, TskFileRecord>::const_iterator fileRec = fileRecs.begin(); fileRec != fileRecs.end(); ++fileRec)
+            {
+                const TskFileRecord &record = (*fileRec).second;
+                parentIds[record.fileId] = record.parentFileId;
+                if (record.metaType == TSK_FS_META_TYPE_DIR)
+                {
+                    dirIds.insert(record.fileId);
+                }
+                if (record.parentFileId != 0 && record.parentFileId != record.fileId && fileIds.insert(record.parentFileId).second)
+                {
+                    unvisited.push_back(record.parentFileId);
+                }
+            }
+        }
+
+        std::vector<uint64_t> rootIds;
+        for (std::set<uint64_t>::const_iterator dirId = dirIds.begin(); dirId != dirIds.end(); ++dirId)
+        {
+            uint64_t parentId = parentIds[*dirId];
+            if (parentId == *dirId || parentIds.find(parentId) == parentIds.end())
+            {
+                rootIds.push_back(*dirId);
+            }
+        }
+
+        // Add the file system metadata files in the roots, from the metadata replica if it has the contents of a root.
+        std::vector<uint64_t> queriedRootIds;
+        for (std::vector<uint64_t>::const_iterator rootId = rootIds.begin(); rootId != rootIds.end(); ++rootId)
+        {
+            std::vector<const TskFileRecord*> childRecords;
+            if (!metadataReplica.getChildren(*rootId, childRecords))
+            {
+                queriedRootIds.push_back(*rootId);
+                continue;
+            }
+            for (std::vector<const TskFileRecord*>::const_iterator childRecord = childRecords.begin(); childRecord != childRecords.end(); ++childRecord)
+            {
+                if (!(*childRecord)->name.empty() && (*childRecord)->name[0] == '$')
+                {
+                    fileIds.insert((*childRecord)->fileId);
+                }
+            }
+        }
+
+        for (size_t first = 0; first < queriedRootIds.size(); first += MAX_IDS_PER_QUERY)
+        {
+            std::stringstream condition;
+            condition << "WHERE par_file_id IN (";
+            for (size_t i = first; i < queriedRootIds.size() && i < first + MAX_IDS_PER_QUERY; ++i)
+            {
+                condition << (i == first ? "" : ", ") << queriedRootIds[i];
+            }
+            condition << ") AND name LIKE '$%'";
+
+            std::vector<uint64_t> metadataFileIds = TskServices::Instance().getImgDB().getFileIds(condition.str());
+            fileIds.insert(metadataFileIds.begin(), metadataFileIds.end());
+        }
+
+        std::vector<SectorExtent> extents;
+        for (std::set<uint64_t>::const_iterator fileId = fileIds.begin(); fileId != fileIds.end(); ++fileId)
+        {
+            addFileExtents(*fileId, extents);
+        }
+
+        std::list<TskFsInfoRecord> fileSystems;
+        TskServices::Instance().getImgDB().getFsInfo(fileSystems);
+        for (std::list<TskFsInfoRecord>::const_iterator fileSystem = fileSystems.begin(); fileSystem != fileSystems.end(); ++fileSystem)
+        {
+            extents.push_back(std::make_pair((*fileSystem).img_byte_offset / SECTOR_SIZE, FILE_SYSTEM_HEADER_BYTES / SECTOR_SIZE));
+        }
+
+        std::list<TskVolumeInfoRecord> volumes;
+        TskServices::Instance().getImgDB().getVolumeInfo(volumes);
+        for (std::list<TskVolumeInfoRecord>::const_iterator volume = volumes.begin(); volume != volumes.end(); ++volume)
+        {
+            if (((*volume).flags & TSK_VS_PART_FLAG_META) != 0)
+            {
+                extents.push_back(std::make_pair(static_cast<uint64_t>((*volume).sect_start), static_cast<uint64_t>((*volume).sect_len)));
+            }
+        }
+
+        mergeSectorExtents(extents);
+        return extents;
+    }
+
+    /**
+     * A file of a fixed size, written at arbitrary offsets, that is left
+     * sparse where it is not written if the output file system supports 
+     * sparse files, and zero filled there otherwise.
+     */
+    class SparseOutputFile
+    {
+    public:
+        SparseOutputFile(const std::string &path, uint64_t size) : path(path)
+        {
+#if defined(_WIN32)
+            handle = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (handle == INVALID_HANDLE_VALUE)
+            {
+                throw Poco::CreateFileException(path);
+            }
+            DWORD bytesReturned = 0;
+            LARGE_INTEGER end;
+            end.QuadPart = static_cast<LONGLONG>(size);
+            if ((outputCapabilities.punchHole && !DeviceIoControl(handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytesReturned, NULL)) ||
+                !SetFilePointerEx(handle, end, NULL, FILE_BEGIN) || !SetEndOfFile(handle))
+            {
+                CloseHandle(handle);
+                throw Poco::WriteFileException(path);
+            }
+#else
+            fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1)
+            {
+                throw Poco::CreateFileException(path);
+            }
+            if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+            {
+                ::close(fd);
+                throw Poco::WriteFileException(path);
+            }
+#endif
+        }
 
-namespace
-{
-    const char *MODULE_NAME = "SaveInterestingFilesModule";
-    const char *MODULE_DESCRIPTION = "Saves files and directories that were flagged as being interesting to a location for further analysis";
-    const char *MODULE_VERSION = "1.0.0";
+        ~SparseOutputFile()
+        {
+#if defined(_WIN32)
+            if (handle != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(handle);
+            }
+#else
+            if (fd != -1)
+            {
+                ::close(fd);
+            }
+#endif
+        }
 
-    typedef std::map<std::string, std::string> FileSets; 
-    typedef std::multimap<std::string, TskBlackboardArtifact> FileSetHits;
-    typedef std::pair<FileSetHits::iterator, FileSetHits::iterator> FileSetHitsRange; 
+        void writeAt(uint64_t offset, const char *data, size_t length)
+        {
+#if defined(_WIN32)
+            LARGE_INTEGER position;
+            position.QuadPart = static_cast<LONGLONG>(offset);
+            if (!SetFilePointerEx(handle, position, NULL, FILE_BEGIN))
+            {
+                throw Poco::WriteFileException(path);
+            }
+            while (length > 0)
+            {
+                DWORD bytesWritten = 0;
+                if (!WriteFile(handle, data, static_cast<DWORD>(length), &bytesWritten, NULL) || bytesWritten == 0)
+                {
+                    throw Poco::WriteFileException(path);
+                }
+                data += bytesWritten;
+                length -= bytesWritten;
+            }
+#else
+            while (length > 0)
+            {
+                ssize_t bytesWritten = pwrite(fd, data, length, static_cast<off_t>(offset));
+                if (bytesWritten < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (bytesWritten <= 0)
+                {
+                    throw Poco::WriteFileException(path);
+                }
+                data += bytesWritten;
+                offset += static_cast<uint64_t>(bytesWritten);
+                length -= static_cast<size_t>(bytesWritten);
+            }
+#endif
+        }
 
-    std::string outputFolderPath;
+        void close()
+        {
+#if defined(_WIN32)
+            BOOL closed = CloseHandle(handle);
+            handle = INVALID_HANDLE_VALUE;
+            if (!closed)
+#else
+            int result = ::close(fd);
+            fd = -1;
+            if (result != 0)
+#endif
+            {
+                throw Poco::WriteFileException(path);
+            }
+        }
 
-    void addFileToReport(const TskFile &file, const std::string &filePath, Poco::XML::Document *report)
+    private:
+        SparseOutputFile(const SparseOutputFile &);
+        SparseOutputFile &operator=(const SparseOutputFile &);
+
+        std::string path;
+#if defined(_WIN32)
+        HANDLE handle;
+#else
+        int fd;
+#endif
+    };
+
+    bool isAllZeros(const char *data, size_t length)
     {
-        Poco::XML::Element *reportRoot = static_cast<Poco::XML::Element*>(report->firstChild());
+        return length == 0 || (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
+    }
 
-        Poco::AutoPtr<Poco::XML::Element> fileElement; 
-        if (file.getMetaType() == TSK_FS_META_TYPE_DIR)
+    /**
+     * Writes a raw image the size of the evidence that holds only the given
+     * sectors of it, read in a single pass in image order through a handle 
+     * of its own. The rest of the image is left as holes (or zeros), and so
+     * are buffers of zeros read from the evidence. The extents written are
+     * listed in <path>.map as tab-separated byte offsets and lengths, to tell
+     * zeros read from the evidence from sectors that were not read.
+     *
+     * @return The bytes read from the evidence.
+     */
+    uint64_t writeSubsetImage(const std::string &path, const std::vector<SectorExtent> &extents)
+    {
+        const std::vector<std::string> imageFileNames = TskServices::Instance().getImageFile().getFileNames();
+        std::vector<const char*> names;
+        for (std::vector<std::string>::const_iterator imageFileName = imageFileNames.begin(); imageFileName != imageFileNames.end(); ++imageFileName)
         {
-            fileElement = report->createElement("SavedDirectory");
+            names.push_back((*imageFileName).c_str());
         }
-        else
+        TSK_IMG_INFO *image = names.empty() ? NULL : tsk_img_open_utf8(static_cast<int>(names.size()), &names[0], TSK_IMG_TYPE_DETECT, 0);
+        if (image == NULL)
         {
-            fileElement = report->createElement("SavedFile");
+            const char *error = tsk_error_get();
+            std::string message = std::string("failed to open the evidence image: ") + (error != NULL ? error : "no image files");
+            tsk_error_reset();
+            throw Poco::OpenFileException(message);
         }
-        reportRoot->appendChild(fileElement);
-
-        Poco::AutoPtr<Poco::XML::Element> savedPathElement = report->createElement("Path");
-        fileElement->appendChild(savedPathElement);        
-        Poco::AutoPtr<Poco::XML::Text> savedPathText = report->createTextNode(filePath);
-        savedPathElement->appendChild(savedPathText);
 
-        Poco::AutoPtr<Poco::XML::Element> originalPathElement = report->createElement("OriginalPath");        
-        fileElement->appendChild(originalPathElement);
-        Poco::AutoPtr<Poco::XML::Text> originalPathText = report->createTextNode(file.getUniquePath());
-        originalPathElement->appendChild(originalPathText);
+        uint64_t bytesRead = 0;
+        try
+        {
+            const uint64_t imageSize = static_cast<uint64_t>(image->size);
+            SparseOutputFile subsetImage(path, imageSize);
+            Poco::FileOutputStream extentMap(path + ".map", std::ios::out | std::ios::trunc);
+            std::vector<char> buffer(COPY_BUFFER_SIZE);
+            for (std::vector<SectorExtent>::const_iterator extent = extents.begin(); extent != extents.end(); ++extent)
+            {
+                uint64_t offset = (*extent).first * SECTOR_SIZE;
+                const uint64_t end = std::min(offset + (*extent).second * SECTOR_SIZE, imageSize);
+                if (offset >= end)
+                {
+                    continue;
+                }
+                extentMap << offset << "\t" << end - offset << "\n";
 
-        if (file.getMetaType() != TSK_FS_META_TYPE_DIR)
+                while (offset < end)
+                {
+                    size_t length = static_cast<size_t>(std::min<uint64_t>(end - offset, buffer.size()));
+                    if (readTraceLog.isOpen())
+                    {
+                        readTraceLog.traceImageRead(0, offset / SECTOR_SIZE, (length + SECTOR_SIZE - 1) / SECTOR_SIZE);
+                    }
+                    if (tsk_img_read(image, static_cast<TSK_OFF_T>(offset), &buffer[0], length) != static_cast<ssize_t>(length))
+                    {
+                        tsk_error_reset();
+                        throw Poco::ReadFileException("failed to read the evidence image at offset " + Poco::NumberFormatter::format(offset));
+                    }
+                    if (!isAllZeros(&buffer[0], length))
+                    {
+                        subsetImage.writeAt(offset, &buffer[0], length);
+                    }
+                    offset += length;
+                    bytesRead += length;
+                }
+            }
+            subsetImage.close();
+        }
+        catch (...)
         {
-            // This element will be empty unless a hash calculation module has operated on the file.
-            Poco::AutoPtr<Poco::XML::Element> md5HashElement = report->createElement("MD5");        
-            fileElement->appendChild(md5HashElement);                
-            Poco::AutoPtr<Poco::XML::Text> md5HashText = report->createTextNode(file.getHash(TskImgDB::MD5));
-            md5HashElement->appendChild(md5HashText);
+            tsk_img_close(image);
+            throw;
         }
+        tsk_img_close(image);
+        return bytesRead;
     }
 
-    void saveDirectoryContents(const std::string &dirPath, const TskFile &dir, Poco::XML::Document *report)
+    // Name of the framework's SQLite image database in the framework output folder.
+    const std::string IMAGE_DB_FILE_NAME = "image.db";
+
+    // Longest time to wait for the framework's own connection to release a lock on the image database.
+    const int IMAGE_DB_BUSY_TIMEOUT_MS = 30000;
+
+    /**
+     * An index of the image database that a query the module makes through 
+     * the framework needs to avoid scanning the whole table, e.g. for every 
+     * directory saved.
+     */
+    struct ImageDbIndex
+    {
+        const char *name;
+        const char *table;
+        const char *column;
+    };
+
+    const ImageDbIndex IMAGE_DB_INDEXES[] =
+    {
+        // Listing the contents of each directory saved.
+        { "files_par_file_id", "files", "par_file_id" },
+        // Getting the interesting file hits from the blackboard.
+        { "blackboard_artifacts_artifact_type_id", "blackboard_artifacts", "artifact_type_id" },
+        // Getting the set name attributes of each hit.
+        { "blackboard_attributes_artifact_id", "blackboard_attributes", "artifact_id" },
+        // Getting the sector runs of each file saved.
+        { "fs_blocks_file_id", "fs_blocks", "file_id" },
+        // Getting the hashes of each file saved.
+        { "file_hashes_file_id", "file_hashes", "file_id" }
+    };
+
+    /**
+     * A connection to the image database, separate from the framework's own,
+     * for checking and creating indexes.
+     */
+    class ImageDbConnection
     {
-        // Construct a query for the file records corresponding to the files in the directory and fetch them.
-        std::stringstream condition; 
-        condition << "WHERE par_file_id = " << dir.getId();
-        std::vector<const TskFileRecord> fileRecs = TskServices::Instance().getImgDB().getFileRecords(condition.str());
+    public:
+        ImageDbConnection(const std::string &path, bool writable) : db(NULL)
+        {
+            if (sqlite3_open_v2(path.c_str(), &db, writable ? SQLITE_OPEN_READWRITE : SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+            {
+                std::string error = db != NULL ? sqlite3_errmsg(db) : "out of memory";
+                sqlite3_close(db);
+                throw Poco::OpenFileException("failed to open image database " + path + ": " + error);
+            }
+            sqlite3_busy_timeout(db, IMAGE_DB_BUSY_TIMEOUT_MS);
+        }
 
-        // Save each file and subdirectory in the directory.
-        for (std::vector<const TskFileRecord>::const_iterator fileRec = fileRecs.begin(); fileRec != fileRecs.end(); ++fileRec)
+        ~ImageDbConnection()
         {
-            std::auto_ptr<TskFile> file(TskServices::Instance().getFileManager().getFile((*fileRec).fileId));
+            sqlite3_close(db);
+        }
 
-            if (file->getMetaType() == TSK_FS_META_TYPE_DIR)
+        /**
+         * @return The steps of the query plan of a query, separated by "; ".
+         */
+        std::string explain(const std::string &query)
+        {
+            sqlite3_stmt *statement = NULL;
+            if (sqlite3_prepare_v2(db, ("EXPLAIN QUERY PLAN " + query).c_str(), -1, &statement, NULL) != SQLITE_OK)
             {
-                // Create a subdirectory to hold the contents of this subdirectory.
-                Poco::Path subDirPath(Poco::Path::forDirectory(dirPath));
-                subDirPath.pushDirectory(file->getName());
-                Poco::File(subDirPath).createDirectory();
-                
-                // Recurse into the subdirectory.
-                saveDirectoryContents(subDirPath.toString(), *file, report);
+                throw Poco::IOException("failed to explain '" + query + "': " + sqlite3_errmsg(db));
             }
-            else
+
+            // The step's description is the last column, whichever version of SQLite the framework was built with.
+            std::string plan;
+            int result;
+            while ((result = sqlite3_step(statement)) == SQLITE_ROW)
             {
-                // Save the file.
-                std::stringstream filePath;
-                filePath << dirPath << Poco::Path::separator() << file->getName();
-                TskServices::Instance().getFileManager().copyFile(file.get(), TskUtilities::toUTF16(filePath.str()));
-                addFileToReport(*file, filePath.str(), report);
+                const unsigned char *detail = sqlite3_column_text(statement, sqlite3_column_count(statement) - 1);
+                plan += (plan.empty() ? "" : "; ") + std::string(detail != NULL ? reinterpret_cast<const char*>(detail) : "");
             }
+            sqlite3_finalize(statement);
+            if (result != SQLITE_DONE)
+            {
+                throw Poco::IOException("failed to explain '" + query + "': " + sqlite3_errmsg(db));
+            }
+            return plan;
         }
-    }
 
-    void saveInterestingDirectory(const TskFile &dir, const std::string &fileSetFolderPath, Poco::XML::Document *report)
-    {
-        // Make a subdirectory of the output folder named for the interesting file search set and create a further subdirectory
-        // corresponding to the directory to be saved. The resulting directory structure will look like this:
-        // <output folder>/
-        //      <interesting file set name>/
-        //          <directory name>_<file id>/ /*Suffix the directory with its its file id to ensure uniqueness*/
-        //              <directory name>/
-        //                  <contents of directory including subdirectories>
-        //
-        Poco::Path path(Poco::Path::forDirectory(fileSetFolderPath));
-        std::stringstream subDir;
-        subDir << dir.getName() << '_' << dir.getId();
-        path.pushDirectory(subDir.str());
-        path.pushDirectory(dir.getName());
-        Poco::File(path).createDirectories();
+        /**
+         * Executes SQL statements, rolling back any transaction they leave 
+         * open if one fails.
+         */
+        void execute(const std::string &sql)
+        {
+            char *error = NULL;
+            if (sqlite3_exec(db, sql.c_str(), NULL, NULL, &error) != SQLITE_OK)
+            {
+                std::string message = error != NULL ? error : sqlite3_errmsg(db);
+                sqlite3_free(error);
+                if (!sqlite3_get_autocommit(db))
+                {
+                    sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+                }
+                throw Poco::IOException("failed to execute '" + sql + "': " + message);
+            }
+        }
 
-        addFileToReport(dir, path.toString(), report);
+    private:
+        ImageDbConnection(const ImageDbConnection &);
+        ImageDbConnection &operator=(const ImageDbConnection &);
 
-        saveDirectoryContents(path.toString(), dir, report);
-    }
+        sqlite3 *db;
+    };
 
-    void saveInterestingFile(const TskFile &file, const std::string &fileSetFolderPath, Poco::XML::Document *report)
+    std::string getIndexedQuery(const ImageDbIndex &index)
     {
-        // Construct a path to write the contents of the file to a subdirectory of the output folder named for the interesting file search
-        // set. The resulting directory structure will look like this:
-        // <output folder>/
-        //      <interesting file set name>/
-        //          <file name>_<fileId>.<ext> /*Suffix the file with its its file id to ensure uniqueness*/
-        std::string fileName = file.getName();
-        std::stringstream id;
-        id << '_' << file.getId();
-        std::string::size_type pos = 0;
-        if ((pos = fileName.rfind(".")) != std::string::npos && pos != 0)
-        {
-            // The file name has a conventional extension. Insert the file id before the '.' of the extension.
-            fileName.insert(pos, id.str());
-        }
-        else
-        {
-            // The file has no extension or the only '.' in the file is an initial '.', as in a hidden file.
-            // Add the file id to the end of the file name.
-            fileName.append(id.str());
-        }
-        std::stringstream filePath;
-        filePath << fileSetFolderPath.c_str() << Poco::Path::separator() << fileName.c_str();
-    
-        // Save the file.
-        TskServices::Instance().getFileManager().copyFile(file.getId(), TskUtilities::toUTF16(filePath.str()));
+        return std::string("SELECT * FROM ") + index.table + " WHERE " + index.column + " = 1";
+    }
 
-        addFileToReport(file, filePath.str(), report);
+    /**
+     * @return True if a query plan reads a whole table (or index) rather 
+     * than searching it.
+     */
+    bool isTableScan(const std::string &plan)
+    {
+        return plan.compare(0, 5, "SCAN ") == 0 || plan.find("; SCAN ") != std::string::npos;
     }
 
-    void saveFiles(const std::string &setName, const std::string &setDescription, FileSetHitsRange fileSetHitsRange)
+    /**
+     * Checks that the queries the module makes through the framework can 
+     * search indexes of the image database rather than scan whole tables, 
+     * optionally creating the missing indexes in a single transaction, and 
+     * logs a warning with the query plan of each query that would still scan
+     * a table. Only a SQLite image database is checked.
+     */
+    void checkImageDbIndexes(bool createIndexes)
     {
-        // Start an XML report of the files in the set.
-        Poco::AutoPtr<Poco::XML::Document> report = new Poco::XML::Document();
-        Poco::AutoPtr<Poco::XML::Element> reportRoot = report->createElement("InterestingFileSet");
-        reportRoot->setAttribute("name", setName);
-        reportRoot->setAttribute("description", setDescription);
-        report->appendChild(reportRoot);
+        const std::string MSG_PREFIX = "SaveInterestingFilesModule::report : ";
+        Poco::Path dbPath(Poco::Path::forDirectory(GetSystemProperty(TskSystemProperties::OUT_DIR)));
+        dbPath.setFileName(IMAGE_DB_FILE_NAME);
+        if (!Poco::File(dbPath).exists())
+        {
+            LOGINFO(MSG_PREFIX + "no SQLite image database at " + dbPath.toString() + ", not checking its indexes");
+            return;
+        }
 
-        // Make a subdirectory of the output folder named for the interesting file set.
-        Poco::Path fileSetFolderPath(Poco::Path::forDirectory(outputFolderPath));
-        fileSetFolderPath.pushDirectory(setName);
-        Poco::File(fileSetFolderPath).createDirectory();
-        
-        // Save all of the files in the set.
-        for (FileSetHits::iterator fileHit = fileSetHitsRange.first; fileHit != fileSetHitsRange.second; ++fileHit)
+        // A failed check is logged and the export goes ahead; it is only slower.
+        try
         {
-            std::auto_ptr<TskFile> file(TskServices::Instance().getFileManager().getFile((*fileHit).second.getObjectID()));
-            if (file->getMetaType() == TSK_FS_META_TYPE_DIR)
+            ImageDbConnection db(dbPath.toString(), createIndexes);
+            std::vector<const ImageDbIndex*> missingIndexes;
+            for (size_t i = 0; i < sizeof(IMAGE_DB_INDEXES) / sizeof(IMAGE_DB_INDEXES[0]); ++i)
             {
-                 saveInterestingDirectory(*file, fileSetFolderPath.toString(), report); 
+                try
+                {
+                    if (isTableScan(db.explain(getIndexedQuery(IMAGE_DB_INDEXES[i]))))
+                    {
+                        missingIndexes.push_back(&IMAGE_DB_INDEXES[i]);
+                    }
+                }
+                catch (Poco::IOException &ex)
+                {
+                    // E.g., the table is not in this version of the framework's schema.
+                    LOGWARN(MSG_PREFIX + "failed to check the image database's indexes: " + ex.displayText());
+                }
             }
-            else
+
+            if (createIndexes && !missingIndexes.empty())
+            {
+                std::string sql = "BEGIN;";
+                for (std::vector<const ImageDbIndex*>::const_iterator index = missingIndexes.begin(); index != missingIndexes.end(); ++index)
+                {
+                    sql += std::string(" CREATE INDEX IF NOT EXISTS ") + (*index)->name + " ON " + (*index)->table + "(" + (*index)->column + ");";
+                }
+                sql += " COMMIT;";
+                db.execute(sql);
+                std::stringstream msg;
+                msg << MSG_PREFIX << "created " << missingIndexes.size() << " indexes in the image database";
+                LOGINFO(msg.str());
+            }
+
+            for (std::vector<const ImageDbIndex*>::const_iterator index = missingIndexes.begin(); index != missingIndexes.end(); ++index)
             {
-                saveInterestingFile(*file, fileSetFolderPath.toString(), report);
+                const std::string query = getIndexedQuery(**index);
+                const std::string plan = db.explain(query);
+                if (isTableScan(plan))
+                {
+                    LOGWARN(MSG_PREFIX + "image database query '" + query + "' scans the whole table (" + plan + "); create an index on " + 
+                        (*index)->table + "(" + (*index)->column + ") or set dbindexes=create");
+                }
             }
         }
-
-        // Write out the completed XML report.
-        fileSetFolderPath.setFileName(setName + ".xml");
-        Poco::FileStream reportFile(fileSetFolderPath.toString());
-        Poco::XML::DOMWriter writer;
-        writer.setNewLine("\n");
-        writer.setOptions(Poco::XML::XMLWriter::PRETTY_PRINT);
-        writer.writeNode(reportFile, report);
+        catch (Poco::Exception &ex)
+        {
+            LOGWARN(MSG_PREFIX + "failed to check the image database's indexes: " + ex.displayText());
+        }
     }
 }
 
@@ -246,9 +7256,90 @@ extern "C"
      * Module initialization function. Optionally receives an output folder
      * path as the location for saving the files corresponding to interesting
      * file set hits. The default output folder path is a folder named for the
-     * module in #MODULE_OUT_DIR#.
+     * module in #MODULE_OUT_DIR#. The output folder path may be followed by
+     * semicolon-separated <name>=<value> options, or given as a last 
+     * out=<path> option if it contains ';' or '=' (see parseArguments()):
      *
-     * @param args Optional output folder path.
+     *      perfcounters=true   Sample performance counters (cycles, 
+     *                          instructions, LLC misses, context switches,
+     *                          page faults) around each phase of report() 
+     *                          and log them with the run statistics. Linux
+     *                          only; wall clock times are always logged.
+     *      filters=<path>      Path of an XML file of per-set include/exclude
+     *                          filters applied while traversing the files to
+     *                          be saved. See loadFileFilters().
+     *      saveslack=true      Save the slack space after each saved file to
+     *                          <saved file path>.slack.
+     *      minfreespace=<size> Free space to leave on the output volume when
+     *                          deciding whether a set fits (default 0).
+     *      overflow=<path>     Folder to save sets that do not fit in the 
+     *                          output folder to.
+     *      staging=<path>      Fast folder to save sets to first; completed
+     *                          sets are moved to the output folder in the
+     *                          background.
+     *      staginghighwater=<size>  Most bytes of completed sets to let 
+     *                          accumulate in the staging folder (default 90%
+     *                          of its free space).
+     *      readtrace=<path>    Record the evidence reads of report() to a 
+     *                          trace file for ReadTraceReplay.
+     *      replica=true|false  Load the file records of the hit files and 
+     *                          of the contents of the hit directories into
+     *                          memory at the start of report() (default 
+     *                          false).
+     *      extentcopy=true|false  Copy file content from raw image files 
+     *                          inside the kernel where possible, leaving 
+     *                          entropy and zero byte ratios out of the 
+     *                          reports (default false).
+     *      readworkers=<n>     Read and inflate the image blocks of upcoming
+     *                          files on n threads (default 0, none).
+     *      readahead=<size>    Most bytes of image blocks to read ahead 
+     *                          (default 256M).
+     *      decompressworkers=<n>  Inflate the compression units of files
+     *                          compressed by their file system on n 
+     *                          threads (default 0, none).
+     *      hardlinks=true|false  Hard link files saved more than once to 
+     *                          their first copy (default true).
+     *      format=files|squashfs  Save each set as a folder of files or as
+     *                          a SquashFS image (default files).
+     *      compressworkers=<n> Threads compressing SquashFS image blocks
+     *                          (default the number of processors).
+     *      subsetimage=true|false  Write a sparse image of the evidence
+     *                          holding only the interesting files and the
+     *                          metadata to parse them (default false).
+     *      manifest=true|false Write a columnar manifest of the saved files
+     *                          to SaveInterestingFilesModule_manifest.arrow
+     *                          (default false).
+     *      consolidate=<n>     Save sets of at most n files and directories
+     *                          together, with one shared report (default 0,
+     *                          never).
+     *      iopressure=<pct>    Back off while tasks on the host have been
+     *                          stalled on I/O for more than pct% of the 
+     *                          last 10 seconds (default 0, never).
+     *      memorypressure=<pct>  Likewise for memory.
+     *      cpupressure=<pct>   Likewise for CPU.
+     *      dbindexes=off|check|create  Check that the image database has
+     *                          the indexes the module's queries need, and
+     *                          optionally create any that are missing
+     *                          (default check).
+     *      chunkdedup=<size>   Save files of at least this size to a chunk
+     *                          store shared by the run, cut into content-
+     *                          defined chunks each stored once, with a 
+     *                          recipe at <saved file path>.chunks (default
+     *                          0, never). See ChunkStore.h.
+     *      chunksize=<size>    Average chunk size, a power of two (default
+     *                          1M).
+     *      cachefirst=true|false  On raw evidence, save the files of each 
+     *                          set whose content is in the page cache 
+     *                          first (default false). Linux only.
+     *      outliers=<n>        Write the n slowest file saves and directory
+     *                          queries of each set, with their phase times,
+     *                          to SaveInterestingFilesModule_outliers.xml
+     *                          (default 0, none).
+     *      publish=true|false  As soon as each set is complete, flush it to
+     *                          stable storage and write a completion marker,
+     *                          <set>/<set>.done (default false).
+     *
+     * @param args Optional output folder path and options.
      * @return TskModule::OK if an output folder is created, TskModule::FAIL
      * otherwise. 
      */
@@ -259,10 +7350,13 @@ extern "C"
         const std::string MSG_PREFIX = "SaveInterestingFilesModule::initialize : ";
         try
         {
+            std::string outputPath;
+            parseArguments(arguments, outputPath);
+
             Poco::Path outputDirPath;
-            if (strlen(arguments) != 0)
+            if (!outputPath.empty())
             {
-                outputDirPath = Poco::Path::forDirectory(arguments);
+                outputDirPath = Poco::Path::forDirectory(outputPath);
             }
             else
             {
@@ -271,7 +7365,43 @@ extern "C"
             }
             outputFolderPath = outputDirPath.toString();
 
+            Poco::Timestamp filtersModified;
+            if (!options.filtersPath.empty())
+            {
+                filtersModified = Poco::File(options.filtersPath).getLastModified();
+            }
+            if (options.filtersPath != loadedFiltersPath || filtersModified != loadedFiltersModified)
+            {
+                fileFilters.clear();
+                defaultFileFilter = FileFilter();
+                loadedFiltersPath.clear();
+                if (!options.filtersPath.empty())
+                {
+                    loadFileFilters(options.filtersPath);
+                }
+                loadedFiltersPath = options.filtersPath;
+                loadedFiltersModified = filtersModified;
+            }
+
             Poco::File(outputDirPath).createDirectory();
+
+            // Find out once per output volume which write mechanisms its file system supports, so report() can use 
+            // the fastest.
+            const std::string volumeId = getVolumeId(outputFolderPath);
+            std::map<std::string, OutputCapabilities>::const_iterator probed = probedVolumes.find(volumeId);
+            if (volumeId.empty() || probed == probedVolumes.end())
+            {
+                outputCapabilities = probeOutputCapabilities(outputFolderPath);
+                logOutputCapabilities(outputFolderPath, outputCapabilities);
+                if (!volumeId.empty())
+                {
+                    probedVolumes[volumeId] = outputCapabilities;
+                }
+            }
+            else
+            {
+                outputCapabilities = (*probed).second;
+            }
         }
         catch (TskException &ex)
         {
@@ -326,9 +7456,104 @@ extern "C"
                 return TskModule::FAIL;
             }
 
+            runStatistics = RunStatistics();
+            errorLog.open(outputFolderPath + "SaveInterestingFilesModule_errors.txt");
+            if (!options.readTracePath.empty())
+            {
+                readTraceLog.open(options.readTracePath);
+            }
+            if (options.manifest)
+            {
+                manifest.open(outputFolderPath + "SaveInterestingFilesModule_manifest.arrow");
+            }
+            if (options.chunkDedupMinSize > 0)
+            {
+                if (chunker.get() == NULL || chunker->getAverageSize() != options.chunkSize)
+                {
+                    chunker.reset(new Chunking::Chunker(options.chunkSize));
+                }
+                chunkStore.open(outputFolderPath + CHUNK_STORE_NAME);
+            }
+#if defined(__linux__)
+            // If the evidence is a raw image that data can be moved from without passing through user space, copy
+            // files straight from it.
+            if (options.extentCopy)
+            {
+                probeSourceCapabilities(outputFolderPath, outputCapabilities);
+            }
+            const bool canCopyFromImage = options.extentCopy && (outputCapabilities.sourceReflink || outputCapabilities.sourceCopyFileRange);
+            const bool rawEvidence = (canCopyFromImage || options.cacheFirst) && rawImage.open();
+            extentCopying = rawEvidence && canCopyFromImage;
+            if (extentCopying)
+            {
+                LOGINFO(MSG_PREFIX + "evidence is a raw image, copying file content straight from the image files");
+            }
+            if (rawEvidence && options.cacheFirst)
+            {
+                LOGINFO(MSG_PREFIX + "evidence is a raw image, saving the files of each set that are in the page cache first");
+            }
+            if (options.readWorkers > 0 && !extentCopying)
+#else
+            if (options.readWorkers > 0)
+#endif
+            {
+                readAhead.start(options.readWorkers);
+            }
+#if defined(__linux__)
+            if (extentCopying || readAhead.isRunning() || options.saveSlack)
+#else
+            if (readAhead.isRunning() || options.saveSlack)
+#endif
+            {
+                openReportFileSystems();
+            }
+            if (options.decompressWorkers > 0)
+            {
+                parallelDecompressor.start(options.decompressWorkers);
+            }
+            unsigned int largestPool = readAhead.isRunning() ? options.readWorkers : 0;
+            if (parallelDecompressor.isRunning())
+            {
+                largestPool = std::max(largestPool, options.decompressWorkers);
+            }
+            if (options.squashfsImages)
+            {
+                largestPool = std::max(largestPool, options.compressWorkers);
+            }
+            pressureMonitor.start(largestPool);
+            if (pressureMonitor.isRunning())
+            {
+                LOGINFO(MSG_PREFIX + "backing off while the host is under pressure");
+                if (readAhead.isRunning())
+                {
+                    pressureMonitor.addPool(readAhead, options.readWorkers);
+                }
+                if (parallelDecompressor.isRunning())
+                {
+                    pressureMonitor.addPool(parallelDecompressor, options.decompressWorkers);
+                }
+            }
+            PerfCounters counters;
+            if (options.perfCounters)
+            {
+                counters.open();
+            }
+            for (int i = 0; i < PerfCounters::NUM_COUNTERS; ++i)
+            {
+                runStatistics.countersAvailable[i] = counters.isAvailable(static_cast<PerfCounters::Counter>(i));
+            }
+
+            // Make sure the image database queries made from here on can use indexes.
+            if (options.imageDbIndexes != Options::IMAGE_DB_INDEXES_OFF)
+            {
+                PhaseTimer timer("report thread", "check image database", counters);
+                checkImageDbIndexes(options.imageDbIndexes == Options::IMAGE_DB_INDEXES_CREATE);
+            }
+
             // Get the interesting file set hits from the blackboard and sort them by set name.
             FileSets fileSets;
             FileSetHits fileSetHits;
+            std::auto_ptr<PhaseTimer> collectTimer(new PhaseTimer("report thread", "collect hits", counters));
             std::vector<TskBlackboardArtifact> fileSetHitArtifacts = TskServices::Instance().getBlackboard().getArtifacts(TSK_INTERESTING_FILE_HIT);
             for (std::vector<TskBlackboardArtifact>::iterator fileHit = fileSetHitArtifacts.begin(); fileHit != fileSetHitArtifacts.end(); ++fileHit)
             {
@@ -352,22 +7577,96 @@ extern "C"
 
                 if (!setNameFound)
                 {
-                    // Log the error and try the next artifact.
-                    std::stringstream msg;
-                    msg << MSG_PREFIX << "failed to find TSK_SET_NAME attribute for TSK_INTERESTING_FILE_HIT artifact with id '" << (*fileHit).getArtifactID() << "', skipping artifact";
-                    LOGERROR(msg.str());
+                    // Record the error and try the next artifact.
+                    std::stringstream subject;
+                    subject << "artifact " << (*fileHit).getArtifactID();
+                    errorLog.error("missing TSK_SET_NAME", subject.str(), "failed to find TSK_SET_NAME attribute for TSK_INTERESTING_FILE_HIT artifact, skipping artifact");
+                }
+            }
+
+            collectTimer.reset();
+
+            // Copy the records of the hit files and the contents of the hit directories into memory, so that planning
+            // does not query the image database.
+            if (options.replica)
+            {
+                PhaseTimer timer("report thread", "load replica", counters);
+                std::set<uint64_t> hitFileIds;
+                for (FileSetHits::const_iterator fileHit = fileSetHits.begin(); fileHit != fileSetHits.end(); ++fileHit)
+                {
+                    hitFileIds.insert((*fileHit).second.getObjectID());
+                }
+                metadataReplica.load(std::vector<uint64_t>(hitFileIds.begin(), hitFileIds.end()));
+                std::stringstream msg;
+                msg << MSG_PREFIX << "loaded " << metadataReplica.getRecordCount() << " file records into the metadata replica";
+                LOGINFO(msg.str());
+            }
+
+            // Plan the files to save for each file set from the image database.
+            std::vector<SetPlan> plans;
+            {
+                PhaseTimer timer("report thread", "plan sets", counters);
+                for (map<std::string, std::string>::const_iterator fileSet = fileSets.begin(); fileSet != fileSets.end(); ++fileSet)
+                {
+                    // Get the file hits for the file set as an iterator range.
+                    FileSetHitsRange fileSetHitsRange = fileSetHits.equal_range((*fileSet).first); 
+
+                    // Plan to save the files corresponding to the file hit artifacts.
+                    plans.push_back(planSet((*fileSet).first, (*fileSet).second, fileSetHitsRange));
                 }
             }
 
-            // Save the interesting files to the output directory, file set by file set.
-            for (map<std::string, std::string>::const_iterator fileSet = fileSets.begin(); fileSet != fileSets.end(); ++fileSet)
+            // Load the sector runs of the files to be saved, if they will be needed, before any file content is read.
+            if (metadataReplica.isLoaded() && sectorRunsNeeded())
             {
-                // Get the file hits for the file set as an iterator range.
-                FileSetHitsRange fileSetHitsRange = fileSetHits.equal_range((*fileSet).first); 
+                PhaseTimer timer("report thread", "load sector runs", counters);
+                std::vector<uint64_t> fileIds;
+                for (std::vector<SetPlan>::const_iterator plan = plans.begin(); plan != plans.end(); ++plan)
+                {
+                    for (std::vector<PlannedFile>::const_iterator plannedFile = (*plan).files.begin(); plannedFile != (*plan).files.end(); ++plannedFile)
+                    {
+                        if (!(*plannedFile).isDirectory && (*plannedFile).size > 0)
+                        {
+                            fileIds.push_back((*plannedFile).fileId);
+                        }
+                    }
+                }
+                metadataReplica.loadSectorRuns(fileIds);
+            }
+
+            // Read files saved more than once (e.g., hit by several sets) from the evidence only once.
+            planFanOuts(plans);
+
+            // Save the interesting files to the output directory, file set by file set, as space allows.
+            if (!saveSets(plans, counters) || runStatistics.filesFailed != 0)
+            {
+                status = TskModule::FAIL;
+            }
+
+            // Write a sparse copy of the evidence holding just the interesting files and the metadata needed to find
+            // and parse them in place.
+            if (options.subsetImage)
+            {
+                PhaseTimer timer("report thread", "write subset image", counters);
+                std::vector<SectorExtent> extents = planSubsetImage(plans);
+                const std::vector<std::string> imageFileNames = TskServices::Instance().getImageFile().getFileNames();
+                const std::string imageName = imageFileNames.empty() ? "evidence" : Poco::Path(imageFileNames.front()).getBaseName();
+                runStatistics.subsetImageBytes = writeSubsetImage(outputFolderPath + imageName + "_subset.dd", extents);
+            }
 
-                // Save the files corresponding to the file hit artifacts.
-                saveFiles((*fileSet).first, (*fileSet).second, fileSetHitsRange);
+            if (options.outliers > 0)
+            {
+                outlierLog.write(outputFolderPath + "SaveInterestingFilesModule_outliers.xml");
             }
+
+            runStatistics.chunksStored = chunkStore.getChunksStored();
+            runStatistics.chunkBytesStored = chunkStore.getBytesStored();
+            runStatistics.chunkBytesDeduplicated = chunkStore.getBytesDeduplicated();
+
+            // The workers add their threads' statistics as they stop.
+            readAhead.stop();
+            parallelDecompressor.stop();
+            logRunStatistics();
         }
         catch (TskException &ex)
         {
@@ -395,6 +7694,27 @@ extern "C"
             status = TskModule::FAIL;
             LOGERROR(MSG_PREFIX + "unrecognized exception");
         }
+
+        // Log the summary of any errors for individual files and artifacts and finish writing their details.
+        errorLog.close();
+        readTraceLog.close();
+        manifest.close();
+        chunkStore.close();
+        outlierLog.clear();
+        metadataReplica.clear();
+        uniquePathPrefixes.clear();
+        pressureMonitor.stop();
+        readAhead.stop();
+        parallelDecompressor.stop();
+        closeReportFileSystems();
+        pendingFanOuts.clear();
+        savedCopies.clear();
+        crossSetFanOuts.clear();
+        removeSpoolFolder();
+#if defined(__linux__)
+        rawImage.close();
+        extentCopying = false;
+#endif
         
         return status;
     }
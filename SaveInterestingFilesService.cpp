@@ -0,0 +1,567 @@
+/*
+ * The Sleuth Kit
+ *
+ * Contact: Brian Carrier [carrier <at> sleuthkit [dot] org]
+ * Copyright (c) 2010-2012 Basis Technology Corporation. All Rights
+ * reserved.
+ *
+ * This software is distributed under the Common Public License 1.0
+ */
+
+/** \file SaveInterestingFilesService.cpp
+ * A long-running service that saves the interesting files of many cases with
+ * SaveInterestingFilesModule, so that the cost of starting up is paid once
+ * rather than per case. Cases are submitted over a local (UNIX domain)
+ * socket and queued, and up to a given number run at once.
+ *
+ * The service loads the framework configuration and the module once, and
+ * initializes the module for each case in its own process, where the
+ * module's case-independent state stays warm from case to case: the probed
+ * write capabilities of each output volume, the compiled set filters, and
+ * the loaded code and framework configuration. Each case then runs in a
+ * child process forked from the service, which inherits that state, opens
+ * the case's image database and image, and runs the module's report() and
+ * finalize(). Cases are isolated from each other and from the service: each
+ * has its own output folder, reports and error log, and a case that fails
+ * or crashes does not affect the others.
+ *
+ * Usage:
+ *      SaveInterestingFilesService -m module -s socket [-c config]
+ *                                  [-l log] [-j jobs] [-a arguments]
+ *
+ *      -m  Path of the SaveInterestingFilesModule library.
+ *      -s  Path of the socket to listen on, created with owner-only access.
+ *      -c  Framework configuration file. Default: the framework's default.
+ *      -l  Framework log file. Default: SaveInterestingFilesService.log.
+ *      -j  Number of cases to run at once. Default: 1.
+ *      -a  Module options for every case, as for initialize() but without
+ *          an output folder path, e.g. "readworkers=4;hardlinks=true".
+ *
+ * A client submits a case by connecting to the socket and sending one line
+ * of tab-separated fields:
+ *
+ *      <case folder>\t<output folder>\t<image file>[\t<image file>...]
+ *
+ * where the case folder is the framework output folder holding the case's
+ * image database (image.db), as left by the analysis of the image, and the
+ * image files are the segments of the image. The service answers with
+ * "queued <id>" and, when the case is finished, "done <id> ok" or
+ * "done <id> failed <reason>", and closes the connection.
+ *
+ * The service stops accepting cases on SIGINT or SIGTERM, fails the cases
+ * still queued, waits for the running cases and exits. It needs fork() and
+ * UNIX domain sockets, and so is not built on Windows.
+ */
+
+// Framework includes
+#include "framework.h"
+#include "Services/TskSystemPropertiesImpl.h"
+#include "Services/TskImgDBSqlite.h"
+#include "Services/TskImageFileTsk.h"
+#include "Services/TskDBBlackboard.h"
+#include "Services/Log.h"
+#include "File/TskFileManagerImpl.h"
+
+// Poco includes
+#include "Poco/SharedLibrary.h"
+#include "Poco/StringTokenizer.h"
+#include "Poco/NumberParser.h"
+#include "Poco/NumberFormatter.h"
+#include "Poco/File.h"
+#include "Poco/Exception.h"
+
+// System includes
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <iostream>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace
+{
+    typedef TskModule::Status (*InitializeFunction)(const char *arguments);
+    typedef TskModule::Status (*ReportFunction)();
+    typedef TskModule::Status (*FinalizeFunction)();
+
+    // Interval at which the service checks for finished cases while it waits for connections.
+    const int POLL_INTERVAL_MS = 200;
+
+    // Longest request line accepted from a client.
+    const size_t MAX_REQUEST_LENGTH = 64 * 1024;
+
+    /**
+     * A case submitted to the service.
+     */
+    struct Job
+    {
+        Job() : id(0), connection(-1), pid(0) {}
+
+        unsigned long id;
+
+        // The client's connection, answered when the case is finished.
+        int connection;
+
+        std::string caseFolder;
+        std::string outputFolder;
+        std::vector<std::string> imageFiles;
+
+        // The child process running the case, 0 while it is queued.
+        pid_t pid;
+    };
+
+    volatile sig_atomic_t stopRequested = 0;
+
+    void requestStop(int)
+    {
+        stopRequested = 1;
+    }
+
+    void usage()
+    {
+        std::cerr << "Usage: SaveInterestingFilesService -m module -s socket [-c config] [-l log] [-j jobs] [-a arguments]" << std::endl;
+        std::cerr << "  -m  Path of the SaveInterestingFilesModule library" << std::endl;
+        std::cerr << "  -s  Path of the socket to listen on" << std::endl;
+        std::cerr << "  -c  Framework configuration file (default: the framework's default)" << std::endl;
+        std::cerr << "  -l  Framework log file (default: SaveInterestingFilesService.log)" << std::endl;
+        std::cerr << "  -j  Number of cases to run at once (default: 1)" << std::endl;
+        std::cerr << "  -a  Module options for every case, without an output folder path" << std::endl;
+    }
+
+    void reply(int connection, const std::string &line)
+    {
+        std::string message = line + "\n";
+        // A client that has gone away is not an error of the service.
+        send(connection, message.data(), message.size(), MSG_NOSIGNAL);
+    }
+
+    void finishJob(const Job &job, const std::string &result)
+    {
+        std::cout << "case " << job.id << " (" << job.caseFolder << "): " << result << std::endl;
+        reply(job.connection, "done " + Poco::NumberFormatter::format(job.id) + " " + result);
+        close(job.connection);
+    }
+
+    /**
+     * Parses a request line into a job.
+     *
+     * @return False if the line is not a valid request.
+     */
+    bool parseRequest(const std::string &line, Job &job)
+    {
+        Poco::StringTokenizer fields(line, "\t", Poco::StringTokenizer::TOK_TRIM);
+        if (fields.count() < 3)
+        {
+            return false;
+        }
+        job.caseFolder = fields[0];
+        job.outputFolder = fields[1];
+        job.imageFiles.assign(fields.begin() + 2, fields.end());
+        for (std::vector<std::string>::const_iterator field = fields.begin(); field != fields.end(); ++field)
+        {
+            if ((*field).empty())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Opens the services for a case, in the child process running it. The
+     * services are never closed; the process exits when the case is done.
+     */
+    void openCase(const Job &job)
+    {
+        SetSystemProperty(TskSystemProperties::OUT_DIR, job.caseFolder);
+
+        TskImgDBSqlite *imgDB = new TskImgDBSqlite(job.caseFolder.c_str());
+        if (imgDB->open() != 0)
+        {
+            throw TskException("failed to open the image database in " + job.caseFolder);
+        }
+        TskServices::Instance().setImgDB(*imgDB);
+        TskServices::Instance().setBlackboard(TskDBBlackboard::instance());
+        TskServices::Instance().setFileManager(TskFileManagerImpl::instance());
+
+        TskImageFileTsk *imageFile = new TskImageFileTsk();
+        if (imageFile->open(job.imageFiles) != 0)
+        {
+            throw TskException("failed to open the image " + job.imageFiles[0]);
+        }
+        TskServices::Instance().setImageFile(*imageFile);
+    }
+
+    /**
+     * Runs a case in the child process forked for it, and exits with status
+     * 0 if the module saved its files, 1 otherwise.
+     */
+    void runCase(const Job &job, ReportFunction report, FinalizeFunction finalize)
+    {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+
+        int exitStatus = 1;
+        try
+        {
+            openCase(job);
+            TskModule::Status reportStatus = report();
+            TskModule::Status finalizeStatus = finalize();
+            exitStatus = (reportStatus == TskModule::OK && finalizeStatus == TskModule::OK) ? 0 : 1;
+        }
+        catch (TskException &ex)
+        {
+            LOGERROR("SaveInterestingFilesService : case " + job.caseFolder + ": TskException: " + ex.message());
+        }
+        catch (Poco::Exception &ex)
+        {
+            LOGERROR("SaveInterestingFilesService : case " + job.caseFolder + ": Poco::Exception: " + ex.displayText());
+        }
+        catch (std::exception &ex)
+        {
+            LOGERROR("SaveInterestingFilesService : case " + job.caseFolder + ": std::exception: " + ex.what());
+        }
+        // Skip the service's static destructors and atexit handlers, which belong to the parent.
+        std::cout.flush();
+        _exit(exitStatus);
+    }
+
+    /**
+     * Initializes the module for a case in the service process and forks the
+     * child that runs it.
+     *
+     * @param inheritedFds The listening socket and every client connection,
+     * which the child closes so that a connection is closed as soon as the
+     * service closes it, rather than when the last sibling case exits.
+     * @return False if the case could not be started, in which case it has
+     * been answered.
+     */
+    bool startJob(Job &job, const std::vector<int> &inheritedFds, const std::string &moduleArguments, InitializeFunction initialize, 
+        ReportFunction report, FinalizeFunction finalize)
+    {
+        try
+        {
+            Poco::File(job.outputFolder).createDirectories();
+        }
+        catch (Poco::Exception &ex)
+        {
+            finishJob(job, "failed cannot create output folder: " + ex.displayText());
+            return false;
+        }
+
+        // The output folder is passed last, as out=<path>, so that it may contain ';' and '='.
+        const std::string arguments = (moduleArguments.empty() ? "" : moduleArguments + ";") + "out=" + job.outputFolder;
+        if (initialize(arguments.c_str()) != TskModule::OK)
+        {
+            finishJob(job, "failed module initialization failed, see the framework log");
+            return false;
+        }
+
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            finishJob(job, std::string("failed cannot fork: ") + strerror(errno));
+            return false;
+        }
+        if (pid == 0)
+        {
+            for (std::vector<int>::const_iterator fd = inheritedFds.begin(); fd != inheritedFds.end(); ++fd)
+            {
+                close(*fd);
+            }
+            runCase(job, report, finalize);
+        }
+        job.pid = pid;
+        std::cout << "case " << job.id << " (" << job.caseFolder << "): started" << std::endl;
+        return true;
+    }
+
+    /**
+     * @return The listening socket and the connections of every client, 
+     * including the one of the case being started.
+     */
+    std::vector<int> inheritedFds(int listener, const std::map<int, std::string> &requests, const std::deque<Job> &queuedJobs, 
+        const std::map<pid_t, Job> &runningJobs, const Job &job)
+    {
+        std::vector<int> fds;
+        fds.push_back(listener);
+        fds.push_back(job.connection);
+        for (std::map<int, std::string>::const_iterator request = requests.begin(); request != requests.end(); ++request)
+        {
+            fds.push_back((*request).first);
+        }
+        for (std::deque<Job>::const_iterator queuedJob = queuedJobs.begin(); queuedJob != queuedJobs.end(); ++queuedJob)
+        {
+            fds.push_back((*queuedJob).connection);
+        }
+        for (std::map<pid_t, Job>::const_iterator runningJob = runningJobs.begin(); runningJob != runningJobs.end(); ++runningJob)
+        {
+            fds.push_back((*runningJob).second.connection);
+        }
+        return fds;
+    }
+
+    int listenOn(const std::string &socketPath)
+    {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path))
+        {
+            throw Poco::InvalidArgumentException("socket path too long: " + socketPath);
+        }
+        strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener == -1)
+        {
+            throw Poco::IOException(std::string("cannot create socket: ") + strerror(errno));
+        }
+        // Replace the socket of a service that did not shut down cleanly.
+        unlink(socketPath.c_str());
+        mode_t oldMask = umask(077);
+        int result = bind(listener, reinterpret_cast<struct sockaddr*>(&address), sizeof(address));
+        umask(oldMask);
+        if (result == -1 || ::listen(listener, SOMAXCONN) == -1)
+        {
+            std::string error = strerror(errno);
+            close(listener);
+            throw Poco::IOException("cannot listen on " + socketPath + ": " + error);
+        }
+        return listener;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string modulePath;
+    std::string socketPath;
+    std::string configPath;
+    std::string logPath = "SaveInterestingFilesService.log";
+    std::string moduleArguments;
+    unsigned int maxRunningJobs = 1;
+
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if ((arg == "-m" || arg == "-s" || arg == "-c" || arg == "-l" || arg == "-j" || arg == "-a") && i + 1 < argc)
+            {
+                std::string value = argv[++i];
+                if (arg == "-m")
+                {
+                    modulePath = value;
+                }
+                else if (arg == "-s")
+                {
+                    socketPath = value;
+                }
+                else if (arg == "-c")
+                {
+                    configPath = value;
+                }
+                else if (arg == "-l")
+                {
+                    logPath = value;
+                }
+                else if (arg == "-j")
+                {
+                    maxRunningJobs = Poco::NumberParser::parseUnsigned(value);
+                }
+                else
+                {
+                    moduleArguments = value;
+                }
+            }
+            else
+            {
+                usage();
+                return 1;
+            }
+        }
+    }
+    catch (Poco::SyntaxException &ex)
+    {
+        std::cerr << ex.displayText() << std::endl;
+        usage();
+        return 1;
+    }
+
+    if (modulePath.empty() || socketPath.empty() || maxRunningJobs == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    int listener = -1;
+    try
+    {
+        // Set up the case-independent framework services once.
+        TskSystemPropertiesImpl *systemProperties = new TskSystemPropertiesImpl();
+        if (configPath.empty())
+        {
+            systemProperties->initialize();
+        }
+        else
+        {
+            systemProperties->initialize(configPath);
+        }
+        TskServices::Instance().setSystemProperties(*systemProperties);
+        Log *log = new Log();
+        log->open(logPath.c_str());
+        TskServices::Instance().setLog(*log);
+
+        Poco::SharedLibrary module(modulePath);
+        InitializeFunction initialize = reinterpret_cast<InitializeFunction>(module.getSymbol("initialize"));
+        ReportFunction report = reinterpret_cast<ReportFunction>(module.getSymbol("report"));
+        FinalizeFunction finalize = reinterpret_cast<FinalizeFunction>(module.getSymbol("finalize"));
+
+        listener = listenOn(socketPath);
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGINT, requestStop);
+        signal(SIGTERM, requestStop);
+        std::cout << "listening on " << socketPath << ", running up to " << maxRunningJobs << " cases at once" << std::endl;
+
+        unsigned long lastJobId = 0;
+        std::map<int, std::string> requests;
+        std::deque<Job> queuedJobs;
+        std::map<pid_t, Job> runningJobs;
+        while (!stopRequested || !runningJobs.empty())
+        {
+            // Wait for connections and requests.
+            std::vector<struct pollfd> fds;
+            if (!stopRequested)
+            {
+                struct pollfd fd = { listener, POLLIN, 0 };
+                fds.push_back(fd);
+                for (std::map<int, std::string>::const_iterator request = requests.begin(); request != requests.end(); ++request)
+                {
+                    struct pollfd requestFd = { (*request).first, POLLIN, 0 };
+                    fds.push_back(requestFd);
+                }
+            }
+            if (poll(fds.empty() ? NULL : &fds[0], fds.size(), POLL_INTERVAL_MS) > 0)
+            {
+                for (std::vector<struct pollfd>::const_iterator fd = fds.begin(); fd != fds.end(); ++fd)
+                {
+                    if ((*fd).revents == 0)
+                    {
+                        continue;
+                    }
+                    if ((*fd).fd == listener)
+                    {
+                        int connection = accept(listener, NULL, NULL);
+                        if (connection != -1)
+                        {
+                            requests[connection];
+                        }
+                        continue;
+                    }
+
+                    char buffer[4096];
+                    ssize_t received = recv((*fd).fd, buffer, sizeof(buffer), 0);
+                    std::string &request = requests[(*fd).fd];
+                    if (received > 0)
+                    {
+                        request.append(buffer, static_cast<size_t>(received));
+                    }
+                    std::string::size_type end = request.find('\n');
+                    if (end == std::string::npos && received > 0 && request.size() <= MAX_REQUEST_LENGTH)
+                    {
+                        continue;
+                    }
+
+                    Job job;
+                    job.connection = (*fd).fd;
+                    if (end == std::string::npos || !parseRequest(request.substr(0, end), job))
+                    {
+                        reply(job.connection, "error expected <case folder>\\t<output folder>\\t<image file>...");
+                        close(job.connection);
+                    }
+                    else
+                    {
+                        job.id = ++lastJobId;
+                        reply(job.connection, "queued " + Poco::NumberFormatter::format(job.id));
+                        queuedJobs.push_back(job);
+                    }
+                    requests.erase((*fd).fd);
+                }
+            }
+
+            // Answer the cases that have finished.
+            int status = 0;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+                std::map<pid_t, Job>::iterator job = runningJobs.find(pid);
+                if (job == runningJobs.end())
+                {
+                    continue;
+                }
+                if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+                {
+                    finishJob((*job).second, "ok");
+                }
+                else if (WIFSIGNALED(status))
+                {
+                    finishJob((*job).second, "failed terminated by signal " + Poco::NumberFormatter::format(WTERMSIG(status)));
+                }
+                else
+                {
+                    finishJob((*job).second, "failed see the framework log and the case's error log");
+                }
+                runningJobs.erase(job);
+            }
+
+            // Start queued cases, or fail them if the service is stopping.
+            while (!queuedJobs.empty() && (stopRequested || runningJobs.size() < maxRunningJobs))
+            {
+                Job job = queuedJobs.front();
+                queuedJobs.pop_front();
+                if (stopRequested)
+                {
+                    finishJob(job, "failed service stopped");
+                }
+                else if (startJob(job, inheritedFds(listener, requests, queuedJobs, runningJobs, job), moduleArguments, initialize, report, 
+                    finalize))
+                {
+                    runningJobs[job.pid] = job;
+                }
+            }
+        }
+
+        for (std::map<int, std::string>::const_iterator request = requests.begin(); request != requests.end(); ++request)
+        {
+            close((*request).first);
+        }
+    }
+    catch (TskException &ex)
+    {
+        std::cerr << ex.message() << std::endl;
+        return 1;
+    }
+    catch (Poco::Exception &ex)
+    {
+        std::cerr << ex.displayText() << std::endl;
+        return 1;
+    }
+    catch (std::exception &ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    close(listener);
+    unlink(socketPath.c_str());
+    return 0;
+}
@@ -0,0 +1,957 @@
+/*
+ * The Sleuth Kit
+ *
+ * Contact: Brian Carrier [carrier <at> sleuthkit [dot] org]
+ * Copyright (c) 2010-2012 Basis Technology Corporation. All Rights
+ * reserved.
+ *
+ * This software is distributed under the Common Public License 1.0
+ */
+
+/** \file SquashfsImage.h
+ * This file contains a writer for the SquashFS 4.0 images the module builds
+ * when given the format=squashfs option. The images can be mounted read-only
+ * (e.g., mount -t squashfs -o loop) or read with tools such as unsquashfs or
+ * 7-Zip.
+ *
+ * The writer builds an image from a stream of files: the content of each file
+ * is cut into blocks that worker threads compress with zlib while the next
+ * blocks are read, and the compressed blocks are written in order as they
+ * complete. Files whose content is already in the image are stored once.
+ * Directories, inodes and the other tables are kept in memory and written
+ * when the image is finished.
+ *
+ * To keep the writer simple, images have no fragments (the tail of each file
+ * is a block of its own), no extended attributes, no export table, and all
+ * entries belong to root.
+ */
+
+#ifndef _SQUASHFS_IMAGE_H
+#define _SQUASHFS_IMAGE_H
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <ctime>
+#include <stdint.h>
+
+#include "Poco/File.h"
+#include "Poco/FileStream.h"
+#include "Poco/DeflatingStream.h"
+#include "Poco/SHA1Engine.h"
+#include "Poco/DigestEngine.h"
+#include "Poco/StringTokenizer.h"
+#include "Poco/Exception.h"
+#include "Poco/Thread.h"
+#include "Poco/Runnable.h"
+#include "Poco/RunnableAdapter.h"
+#include "Poco/Mutex.h"
+#include "Poco/Condition.h"
+
+namespace Squashfs
+{
+    const uint32_t MAGIC = 0x73717368;
+    const uint16_t VERSION_MAJOR = 4;
+    const uint16_t VERSION_MINOR = 0;
+    const uint32_t DEFAULT_BLOCK_SIZE = 128 * 1024;
+    const size_t SUPERBLOCK_SIZE = 96;
+    const size_t METADATA_BLOCK_SIZE = 8192;
+    const uint64_t DEVICE_BLOCK_SIZE = 4096;
+
+    const uint16_t COMPRESSION_ZLIB = 1;
+    const uint16_t FLAG_NO_FRAGMENTS = 0x0010;
+    const uint16_t FLAG_DUPLICATES = 0x0040;
+    const uint16_t FLAG_NO_XATTRS = 0x0200;
+
+    // Set in the size of a data block or metadata block stored uncompressed.
+    const uint32_t DATA_BLOCK_UNCOMPRESSED = 1 << 24;
+    const uint16_t METADATA_BLOCK_UNCOMPRESSED = 0x8000;
+
+    const uint32_t NO_FRAGMENT = 0xFFFFFFFF;
+    const uint32_t NO_XATTR = 0xFFFFFFFF;
+    const uint64_t NO_TABLE = ~static_cast<uint64_t>(0);
+
+    enum InodeType
+    {
+        BASIC_DIRECTORY = 1,
+        BASIC_FILE = 2,
+        EXTENDED_DIRECTORY = 8,
+        EXTENDED_FILE = 9
+    };
+
+    // Limits of a directory listing header.
+    const size_t MAX_HEADER_ENTRIES = 256;
+    const int32_t MAX_INODE_NUMBER_DELTA = 32767;
+    const size_t MAX_NAME_LENGTH = 256;
+
+    inline void put16(std::string &out, uint16_t value)
+    {
+        out += static_cast<char>(value & 0xff);
+        out += static_cast<char>((value >> 8) & 0xff);
+    }
+
+    inline void put32(std::string &out, uint32_t value)
+    {
+        put16(out, static_cast<uint16_t>(value & 0xffff));
+        put16(out, static_cast<uint16_t>(value >> 16));
+    }
+
+    inline void put64(std::string &out, uint64_t value)
+    {
+        put32(out, static_cast<uint32_t>(value & 0xffffffff));
+        put32(out, static_cast<uint32_t>(value >> 32));
+    }
+
+    /**
+     * @return The data compressed in a zlib stream.
+     */
+    inline std::string compress(const char *data, size_t length)
+    {
+        std::ostringstream compressed;
+        Poco::DeflatingOutputStream deflater(compressed, Poco::DeflatingStreamBuf::STREAM_ZLIB);
+        deflater.write(data, static_cast<std::streamsize>(length));
+        deflater.close();
+        return compressed.str();
+    }
+
+    /**
+     * Builds a table of metadata blocks (the inode, directory and id tables).
+     */
+    class MetadataWriter
+    {
+    public:
+        /**
+         * @return The reference of the next byte appended: the offset of its
+         * metadata block in the table, shifted left 16 bits, plus its offset
+         * in the uncompressed block.
+         */
+        uint64_t getReference() const
+        {
+            return (static_cast<uint64_t>(table.size()) << 16) | pending.size();
+        }
+
+        void append(const std::string &data)
+        {
+            size_t appended = 0;
+            while (appended < data.size())
+            {
+                size_t count = std::min(data.size() - appended, METADATA_BLOCK_SIZE - pending.size());
+                pending.append(data, appended, count);
+                appended += count;
+                if (pending.size() == METADATA_BLOCK_SIZE)
+                {
+                    flush();
+                }
+            }
+        }
+
+        const std::string &finish()
+        {
+            if (!pending.empty())
+            {
+                flush();
+            }
+            return table;
+        }
+
+    private:
+        void flush()
+        {
+            std::string compressed = compress(pending.data(), pending.size());
+            if (compressed.size() < pending.size())
+            {
+                put16(table, static_cast<uint16_t>(compressed.size()));
+                table += compressed;
+            }
+            else
+            {
+                put16(table, static_cast<uint16_t>(pending.size()) | METADATA_BLOCK_UNCOMPRESSED);
+                table += pending;
+            }
+            pending.clear();
+        }
+
+        std::string table;
+        std::string pending;
+    };
+
+    /**
+     * Runs each compression worker of a writer on the worker's thread, e.g.,
+     * to measure it.
+     */
+    class WorkerRunner
+    {
+    public:
+        virtual ~WorkerRunner() {}
+
+        /**
+         * Runs a worker by calling work.run().
+         */
+        virtual void runWorker(Poco::Runnable &work) = 0;
+    };
+
+    /**
+     * Writes a SquashFS image. The methods other than run() must be called
+     * from a single thread.
+     */
+    class Writer : public Poco::Runnable
+    {
+    public:
+        /**
+         * Creates the image file and starts the compression workers. With no
+         * workers, blocks are compressed by the thread writing the files. If
+         * a runner is given, the workers are run through it.
+         */
+        Writer(const std::string &path, unsigned int workerCount, uint32_t blockSize = DEFAULT_BLOCK_SIZE, WorkerRunner *runner = NULL)
+            : path(path), stream(path, std::ios::out | std::ios::trunc | std::ios::binary), blockSize(blockSize),
+              position(SUPERBLOCK_SIZE), currentFile(NO_NODE), currentSize(0), nextBlock(0), nextBlockToWrite(0),
+              runner(runner), compressor(*this, &Writer::compressBlocks), allowedWorkers(workerCount), busyWorkers(0), stopping(false)
+        {
+            uint32_t log = 0;
+            while ((static_cast<uint32_t>(1) << log) < blockSize)
+            {
+                ++log;
+            }
+            if ((static_cast<uint32_t>(1) << log) != blockSize || log < 12 || log > 20)
+            {
+                throw Poco::InvalidArgumentException("SquashFS block size must be a power of two from 4K to 1M");
+            }
+            blockLog = static_cast<uint16_t>(log);
+
+            // The superblock is written last; reserve its space.
+            stream.write(std::string(SUPERBLOCK_SIZE, '\0').data(), SUPERBLOCK_SIZE);
+
+            nodes.push_back(Node());
+            nodes[0].mtime = static_cast<uint32_t>(std::time(NULL));
+
+            for (unsigned int i = 0; i < workerCount; ++i)
+            {
+                workers.push_back(new Poco::Thread());
+                workers.back()->start(*this);
+            }
+        }
+
+        ~Writer()
+        {
+            stopWorkers();
+        }
+
+        const std::string &getPath() const
+        {
+            return path;
+        }
+
+        /**
+         * Sets the number of workers that may compress blocks at once. With
+         * none allowed, the thread writing the files compresses the blocks
+         * it has to wait for.
+         */
+        void setAllowedWorkers(unsigned int workerCount)
+        {
+            Poco::Mutex::ScopedLock lock(blockLock);
+            allowedWorkers = workerCount;
+            blockQueued.broadcast();
+            blockCompressed.broadcast();
+        }
+
+        /**
+         * Adds a directory, and any missing parent directories, to the image.
+         * Path components may be separated by either slash.
+         */
+        void addDirectory(const std::string &directoryPath, std::time_t mtime)
+        {
+            findNode(directoryPath, true, true, mtime);
+        }
+
+        /**
+         * Starts a file whose content is given by write(). Any missing parent
+         * directories are added.
+         */
+        void beginFile(const std::string &filePath, std::time_t mtime)
+        {
+            if (currentFile != NO_NODE)
+            {
+                throw Poco::IllegalStateException("SquashFS image file already open");
+            }
+            size_t existingCount = nodes.size();
+            size_t node = findNode(filePath, true, false, mtime);
+            if (node < existingCount)
+            {
+                throw Poco::ExistsException(filePath);
+            }
+
+            currentFile = node;
+            current = Content();
+            current.start = position;
+            currentSize = 0;
+            digest.reset();
+        }
+
+        void write(const char *data, size_t length)
+        {
+            if (currentFile == NO_NODE)
+            {
+                throw Poco::IllegalStateException("No SquashFS image file open");
+            }
+            digest.update(data, length);
+            currentSize += length;
+            while (length > 0)
+            {
+                size_t count = std::min(length, static_cast<size_t>(blockSize) - buffer.size());
+                buffer.append(data, count);
+                data += count;
+                length -= count;
+                if (buffer.size() == blockSize)
+                {
+                    submitBlock();
+                }
+            }
+        }
+
+        /**
+         * Ends the file started by beginFile(). If a file with the same
+         * content is already in the image, the data just written is dropped
+         * and the file refers to the existing data.
+         */
+        void endFile()
+        {
+            if (currentFile == NO_NODE)
+            {
+                throw Poco::IllegalStateException("No SquashFS image file open");
+            }
+            if (!buffer.empty())
+            {
+                submitBlock();
+            }
+            writeBlocks(nextBlock);
+            current.size = currentSize;
+
+            std::ostringstream key;
+            key << Poco::DigestEngine::digestToHex(digest.digest()) << ":" << currentSize;
+            std::map<std::string, size_t>::const_iterator existing = contentByDigest.find(key.str());
+            if (existing != contentByDigest.end())
+            {
+                nodes[currentFile].content = (*existing).second;
+                position = current.start;
+                stream.seekp(static_cast<std::streamoff>(position));
+            }
+            else
+            {
+                contents.push_back(current);
+                nodes[currentFile].content = contents.size() - 1;
+                contentByDigest[key.str()] = contents.size() - 1;
+            }
+            currentFile = NO_NODE;
+            current = Content();
+
+            // Write the files added while this one was open.
+            while (!deferredFiles.empty())
+            {
+                DeferredFile file = deferredFiles.front();
+                deferredFiles.pop_front();
+                addFile(file.path, file.mtime, file.data);
+            }
+        }
+
+        /**
+         * Adds a file with the given content. If a file is open, the file is
+         * added after it ends.
+         */
+        void addFile(const std::string &filePath, std::time_t mtime, const std::string &data)
+        {
+            if (currentFile != NO_NODE)
+            {
+                DeferredFile file;
+                file.path = filePath;
+                file.mtime = mtime;
+                file.data = data;
+                deferredFiles.push_back(file);
+                return;
+            }
+            beginFile(filePath, mtime);
+            write(data.data(), data.size());
+            endFile();
+        }
+
+        /**
+         * Adds a file with the content of a file already in the image,
+         * without storing the content again.
+         *
+         * @return False if there is no (ended) file at existingPath.
+         */
+        bool addLink(const std::string &filePath, const std::string &existingPath)
+        {
+            size_t existing = findNode(existingPath, false, false, 0);
+            if (existing == NO_NODE || nodes[existing].isDirectory || existing == currentFile)
+            {
+                return false;
+            }
+            size_t existingCount = nodes.size();
+            size_t node = findNode(filePath, true, false, nodes[existing].mtime);
+            if (node < existingCount)
+            {
+                throw Poco::ExistsException(filePath);
+            }
+            nodes[node].content = nodes[existing].content;
+            return true;
+        }
+
+        /**
+         * Writes the tables and superblock and closes the image. The image
+         * size is padded to a multiple of 4K so it can be loop mounted.
+         *
+         * @return The size of the image.
+         */
+        uint64_t finish()
+        {
+            if (currentFile != NO_NODE)
+            {
+                endFile();
+            }
+            stopWorkers();
+
+            uint32_t inodeNumber = 0;
+            numberInodes(0, inodeNumber);
+
+            MetadataWriter inodes;
+            MetadataWriter directories;
+            writeInodes(0, inodes, directories);
+
+            std::string tables;
+            uint64_t inodeTableStart = position;
+            tables += inodes.finish();
+            uint64_t directoryTableStart = position + tables.size();
+            tables += directories.finish();
+
+            // There is no fragment table; it starts (and ends) where the id
+            // table does. The id table holds a single id, 0, for root.
+            uint64_t fragmentTableStart = position + tables.size();
+            uint64_t idBlockStart = fragmentTableStart;
+            MetadataWriter ids;
+            std::string rootId;
+            put32(rootId, 0);
+            ids.append(rootId);
+            tables += ids.finish();
+            uint64_t idTableStart = position + tables.size();
+            put64(tables, idBlockStart);
+
+            uint64_t bytesUsed = position + tables.size();
+            uint64_t imageSize = (bytesUsed + DEVICE_BLOCK_SIZE - 1) / DEVICE_BLOCK_SIZE * DEVICE_BLOCK_SIZE;
+            tables.append(static_cast<size_t>(imageSize - bytesUsed), '\0');
+            stream.write(tables.data(), static_cast<std::streamsize>(tables.size()));
+
+            std::string superblock;
+            put32(superblock, MAGIC);
+            put32(superblock, static_cast<uint32_t>(nodes.size()));
+            put32(superblock, nodes[0].mtime);
+            put32(superblock, blockSize);
+            put32(superblock, 0);
+            put16(superblock, COMPRESSION_ZLIB);
+            put16(superblock, blockLog);
+            put16(superblock, FLAG_NO_FRAGMENTS | FLAG_DUPLICATES | FLAG_NO_XATTRS);
+            put16(superblock, 1);
+            put16(superblock, VERSION_MAJOR);
+            put16(superblock, VERSION_MINOR);
+            put64(superblock, nodes[0].inodeReference);
+            put64(superblock, bytesUsed);
+            put64(superblock, idTableStart);
+            put64(superblock, NO_TABLE);
+            put64(superblock, inodeTableStart);
+            put64(superblock, directoryTableStart);
+            put64(superblock, fragmentTableStart);
+            put64(superblock, NO_TABLE);
+            stream.seekp(0);
+            stream.write(superblock.data(), static_cast<std::streamsize>(superblock.size()));
+            stream.close();
+            if (!stream)
+            {
+                throw Poco::WriteFileException(path);
+            }
+
+            // Drop any data written past the end for duplicate files.
+            Poco::File(path).setSize(imageSize);
+            return imageSize;
+        }
+
+        /**
+         * Runs a compression worker until the writer is finished.
+         */
+        void run()
+        {
+            if (runner != NULL)
+            {
+                runner->runWorker(compressor);
+            }
+            else
+            {
+                compressBlocks();
+            }
+        }
+
+    private:
+        Writer(const Writer &);
+        Writer &operator=(const Writer &);
+
+        /**
+         * Compresses blocks until the writer is finished.
+         */
+        void compressBlocks()
+        {
+            Poco::Mutex::ScopedLock lock(blockLock);
+            for (;;)
+            {
+                while ((queuedBlocks.empty() || busyWorkers >= allowedWorkers) && !stopping)
+                {
+                    blockQueued.wait(blockLock);
+                }
+                if (queuedBlocks.empty())
+                {
+                    return;
+                }
+                compressQueuedBlock();
+            }
+        }
+
+        static const size_t NO_NODE = static_cast<size_t>(-1);
+
+        /**
+         * Data blocks of one or more files with the same content.
+         */
+        struct Content
+        {
+            Content() : start(0), size(0) {}
+
+            uint64_t start;
+            uint64_t size;
+
+            // Block sizes as stored in the inode (with the uncompressed bit).
+            std::vector<uint32_t> blockSizes;
+        };
+
+        struct Node
+        {
+            Node() : isDirectory(true), mtime(0), content(0), inodeNumber(0), inodeReference(0), parent(NO_NODE) {}
+
+            std::string name;
+            bool isDirectory;
+            uint32_t mtime;
+
+            // Index of the content of a file.
+            size_t content;
+
+            // Indexes of the entries of a directory, by name.
+            std::map<std::string, size_t> children;
+
+            uint32_t inodeNumber;
+            uint64_t inodeReference;
+            size_t parent;
+        };
+
+        struct CompressedBlock
+        {
+            CompressedBlock() : size(0) {}
+
+            // Size as stored in the inode (with the uncompressed bit).
+            uint32_t size;
+            std::string data;
+        };
+
+        struct DeferredFile
+        {
+            std::string path;
+            std::time_t mtime;
+            std::string data;
+        };
+
+        /**
+         * @return The index of the node at the given path, or NO_NODE if it
+         * does not exist and create is false. Created nodes are directories
+         * except for the last component of a file.
+         */
+        size_t findNode(const std::string &nodePath, bool create, bool isDirectory, std::time_t mtime)
+        {
+            Poco::StringTokenizer components(nodePath, "/\\", Poco::StringTokenizer::TOK_IGNORE_EMPTY);
+            size_t node = 0;
+            for (size_t i = 0; i < components.count(); ++i)
+            {
+                const std::string &name = components[i];
+                if (!nodes[node].isDirectory)
+                {
+                    throw Poco::ExistsException(nodePath);
+                }
+                std::map<std::string, size_t>::const_iterator child = nodes[node].children.find(name);
+                if (child != nodes[node].children.end())
+                {
+                    node = (*child).second;
+                    continue;
+                }
+                if (!create)
+                {
+                    return NO_NODE;
+                }
+                if (name.size() > MAX_NAME_LENGTH)
+                {
+                    throw Poco::InvalidArgumentException(nodePath);
+                }
+
+                Node created;
+                created.name = name;
+                created.isDirectory = isDirectory || i + 1 < components.count();
+                created.mtime = static_cast<uint32_t>(mtime);
+                created.parent = node;
+                nodes.push_back(created);
+                nodes[node].children[name] = nodes.size() - 1;
+                node = nodes.size() - 1;
+            }
+            return node;
+        }
+
+        void compressBlock(const std::string &data, CompressedBlock &compressed)
+        {
+            try
+            {
+                compressed.data = compress(data.data(), data.size());
+            }
+            catch (...)
+            {
+                compressed.data.clear();
+            }
+            if (!compressed.data.empty() && compressed.data.size() < data.size())
+            {
+                compressed.size = static_cast<uint32_t>(compressed.data.size());
+            }
+            else
+            {
+                compressed.data = data;
+                compressed.size = static_cast<uint32_t>(data.size()) | DATA_BLOCK_UNCOMPRESSED;
+            }
+        }
+
+        /**
+         * Compresses the first queued block. Called with the block lock held,
+         * which is released while compressing.
+         */
+        void compressQueuedBlock()
+        {
+            std::pair<uint64_t, std::string> block;
+            block.first = queuedBlocks.front().first;
+            block.second.swap(queuedBlocks.front().second);
+            queuedBlocks.pop_front();
+
+            CompressedBlock compressed;
+            ++busyWorkers;
+            {
+                Poco::ScopedUnlock<Poco::Mutex> unlock(blockLock);
+                compressBlock(block.second, compressed);
+            }
+            --busyWorkers;
+
+            compressedBlocks[block.first].size = compressed.size;
+            compressedBlocks[block.first].data.swap(compressed.data);
+            blockCompressed.broadcast();
+            blockQueued.signal();
+        }
+
+        /**
+         * Hands the buffered block to the workers, or compresses and writes
+         * it if there are none. Keeps at most two blocks per worker waiting
+         * to be written.
+         */
+        void submitBlock()
+        {
+            if (workers.empty())
+            {
+                CompressedBlock compressed;
+                compressBlock(buffer, compressed);
+                buffer.clear();
+                writeBlock(compressed);
+                ++nextBlock;
+                ++nextBlockToWrite;
+                return;
+            }
+
+            {
+                Poco::Mutex::ScopedLock lock(blockLock);
+                queuedBlocks.push_back(std::make_pair(nextBlock++, std::string()));
+                queuedBlocks.back().second.swap(buffer);
+                blockQueued.signal();
+            }
+            uint64_t maxInFlight = 2 * workers.size();
+            writeBlocks(nextBlock > maxInFlight ? nextBlock - maxInFlight : 0);
+        }
+
+        /**
+         * Writes compressed blocks in order, waiting for the blocks before
+         * the given one, and without waiting for any after it.
+         */
+        void writeBlocks(uint64_t until)
+        {
+            for (;;)
+            {
+                CompressedBlock compressed;
+                {
+                    Poco::Mutex::ScopedLock lock(blockLock);
+                    std::map<uint64_t, CompressedBlock>::iterator block = compressedBlocks.find(nextBlockToWrite);
+                    while (block == compressedBlocks.end() && nextBlockToWrite < until)
+                    {
+                        if (allowedWorkers == 0 && !queuedBlocks.empty())
+                        {
+                            compressQueuedBlock();
+                        }
+                        else
+                        {
+                            blockCompressed.wait(blockLock);
+                        }
+                        block = compressedBlocks.find(nextBlockToWrite);
+                    }
+                    if (block == compressedBlocks.end())
+                    {
+                        return;
+                    }
+                    compressed.size = (*block).second.size;
+                    compressed.data.swap((*block).second.data);
+                    compressedBlocks.erase(block);
+                }
+                writeBlock(compressed);
+                ++nextBlockToWrite;
+            }
+        }
+
+        void writeBlock(const CompressedBlock &compressed)
+        {
+            stream.write(compressed.data.data(), static_cast<std::streamsize>(compressed.data.size()));
+            if (!stream)
+            {
+                throw Poco::WriteFileException(path);
+            }
+            position += compressed.data.size();
+            current.blockSizes.push_back(compressed.size);
+        }
+
+        void stopWorkers()
+        {
+            {
+                Poco::Mutex::ScopedLock lock(blockLock);
+                stopping = true;
+                blockQueued.broadcast();
+            }
+            for (std::vector<Poco::Thread*>::iterator worker = workers.begin(); worker != workers.end(); ++worker)
+            {
+                (*worker)->join();
+                delete *worker;
+            }
+            workers.clear();
+        }
+
+        /**
+         * Numbers inodes depth first, children before their directory, so
+         * the root directory gets the highest number.
+         */
+        void numberInodes(size_t node, uint32_t &inodeNumber)
+        {
+            for (std::map<std::string, size_t>::const_iterator child = nodes[node].children.begin();
+                child != nodes[node].children.end(); ++child)
+            {
+                numberInodes((*child).second, inodeNumber);
+            }
+            nodes[node].inodeNumber = ++inodeNumber;
+        }
+
+        /**
+         * Writes the inodes of a tree in inode number order, and the listings
+         * of its directories.
+         */
+        void writeInodes(size_t node, MetadataWriter &inodes, MetadataWriter &directories)
+        {
+            for (std::map<std::string, size_t>::const_iterator child = nodes[node].children.begin();
+                child != nodes[node].children.end(); ++child)
+            {
+                writeInodes((*child).second, inodes, directories);
+            }
+
+            std::string inode;
+            if (nodes[node].isDirectory)
+            {
+                uint64_t listingReference = directories.getReference();
+                std::string listing = directoryListing(node);
+                directories.append(listing);
+                directoryInode(node, listingReference, listing.size(), inode);
+            }
+            else
+            {
+                fileInode(node, inode);
+            }
+            nodes[node].inodeReference = inodes.getReference();
+            inodes.append(inode);
+        }
+
+        void inodeHeader(size_t node, InodeType type, uint16_t mode, std::string &inode) const
+        {
+            put16(inode, static_cast<uint16_t>(type));
+            put16(inode, mode);
+            put16(inode, 0);
+            put16(inode, 0);
+            put32(inode, nodes[node].mtime);
+            put32(inode, nodes[node].inodeNumber);
+        }
+
+        void fileInode(size_t node, std::string &inode) const
+        {
+            const Content &content = contents[nodes[node].content];
+            if (content.start <= 0xFFFFFFFF && content.size <= 0xFFFFFFFF)
+            {
+                inodeHeader(node, BASIC_FILE, 0444, inode);
+                put32(inode, static_cast<uint32_t>(content.start));
+                put32(inode, NO_FRAGMENT);
+                put32(inode, 0);
+                put32(inode, static_cast<uint32_t>(content.size));
+            }
+            else
+            {
+                inodeHeader(node, EXTENDED_FILE, 0444, inode);
+                put64(inode, content.start);
+                put64(inode, content.size);
+                put64(inode, 0);
+                put32(inode, 1);
+                put32(inode, NO_FRAGMENT);
+                put32(inode, 0);
+                put32(inode, NO_XATTR);
+            }
+            for (std::vector<uint32_t>::const_iterator size = content.blockSizes.begin(); size != content.blockSizes.end(); ++size)
+            {
+                put32(inode, *size);
+            }
+        }
+
+        void directoryInode(size_t node, uint64_t listingReference, size_t listingSize, std::string &inode) const
+        {
+            uint32_t linkCount = 2;
+            for (std::map<std::string, size_t>::const_iterator child = nodes[node].children.begin();
+                child != nodes[node].children.end(); ++child)
+            {
+                if (nodes[(*child).second].isDirectory)
+                {
+                    ++linkCount;
+                }
+            }
+
+            // The size of a listing includes 3 bytes for the "." and ".."
+            // entries that are not stored.
+            uint64_t fileSize = listingSize + 3;
+            uint32_t parentInode = node == 0 ? static_cast<uint32_t>(nodes.size() + 1) : nodes[nodes[node].parent].inodeNumber;
+            uint64_t startBlock = listingReference >> 16;
+            uint16_t offset = static_cast<uint16_t>(listingReference & 0xFFFF);
+            if (fileSize <= 0xFFFF && startBlock <= 0xFFFFFFFF)
+            {
+                inodeHeader(node, BASIC_DIRECTORY, 0555, inode);
+                put32(inode, static_cast<uint32_t>(startBlock));
+                put32(inode, linkCount);
+                put16(inode, static_cast<uint16_t>(fileSize));
+                put16(inode, offset);
+                put32(inode, parentInode);
+            }
+            else
+            {
+                inodeHeader(node, EXTENDED_DIRECTORY, 0555, inode);
+                put32(inode, linkCount);
+                put32(inode, static_cast<uint32_t>(fileSize));
+                put32(inode, static_cast<uint32_t>(startBlock));
+                put32(inode, parentInode);
+                put16(inode, 0);
+                put16(inode, offset);
+                put32(inode, NO_XATTR);
+            }
+        }
+
+        /**
+         * @return The listing of a directory: its entries sorted by name, in
+         * runs that share a header giving the inode metadata block and a base
+         * inode number.
+         */
+        std::string directoryListing(size_t node) const
+        {
+            std::vector<size_t> entries;
+            for (std::map<std::string, size_t>::const_iterator child = nodes[node].children.begin();
+                child != nodes[node].children.end(); ++child)
+            {
+                entries.push_back((*child).second);
+            }
+
+            std::string listing;
+            size_t first = 0;
+            while (first < entries.size())
+            {
+                uint64_t block = nodes[entries[first]].inodeReference >> 16;
+                uint32_t baseNumber = nodes[entries[first]].inodeNumber;
+                size_t end = first + 1;
+                while (end < entries.size() && end - first < MAX_HEADER_ENTRIES &&
+                    (nodes[entries[end]].inodeReference >> 16) == block &&
+                    static_cast<int64_t>(nodes[entries[end]].inodeNumber) - baseNumber <= MAX_INODE_NUMBER_DELTA &&
+                    static_cast<int64_t>(nodes[entries[end]].inodeNumber) - baseNumber >= -MAX_INODE_NUMBER_DELTA)
+                {
+                    ++end;
+                }
+
+                put32(listing, static_cast<uint32_t>(end - first - 1));
+                put32(listing, static_cast<uint32_t>(block));
+                put32(listing, baseNumber);
+                for (size_t i = first; i < end; ++i)
+                {
+                    const Node &entry = nodes[entries[i]];
+                    put16(listing, static_cast<uint16_t>(entry.inodeReference & 0xFFFF));
+                    put16(listing, static_cast<uint16_t>(static_cast<int16_t>(static_cast<int64_t>(entry.inodeNumber) - baseNumber)));
+                    put16(listing, static_cast<uint16_t>(entry.isDirectory ? BASIC_DIRECTORY : BASIC_FILE));
+                    put16(listing, static_cast<uint16_t>(entry.name.size() - 1));
+                    listing += entry.name;
+                }
+                first = end;
+            }
+            return listing;
+        }
+
+        std::string path;
+        Poco::FileOutputStream stream;
+        uint32_t blockSize;
+        uint16_t blockLog;
+
+        // Offset in the image of the next data block.
+        uint64_t position;
+
+        // Nodes of the tree; the root directory is nodes[0].
+        std::vector<Node> nodes;
+        std::vector<Content> contents;
+        std::map<std::string, size_t> contentByDigest;
+
+        // The file being written.
+        size_t currentFile;
+        Content current;
+        uint64_t currentSize;
+        Poco::SHA1Engine digest;
+        std::string buffer;
+        std::deque<DeferredFile> deferredFiles;
+
+        // Blocks are numbered in the order they are submitted and written.
+        uint64_t nextBlock;
+        uint64_t nextBlockToWrite;
+
+        std::vector<Poco::Thread*> workers;
+        WorkerRunner *runner;
+        Poco::RunnableAdapter<Writer> compressor;
+        Poco::Mutex blockLock;
+        Poco::Condition blockQueued;
+        Poco::Condition blockCompressed;
+        std::deque<std::pair<uint64_t, std::string> > queuedBlocks;
+        std::map<uint64_t, CompressedBlock> compressedBlocks;
+
+        // The number of workers that may compress at once, and the number 
+        // compressing (including the writing thread).
+        unsigned int allowedWorkers;
+        unsigned int busyWorkers;
+        bool stopping;
+    };
+}
+
+#endif
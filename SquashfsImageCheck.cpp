@@ -0,0 +1,225 @@
+/*
+ * The Sleuth Kit
+ *
+ * Contact: Brian Carrier [carrier <at> sleuthkit [dot] org]
+ * Copyright (c) 2010-2012 Basis Technology Corporation. All Rights
+ * reserved.
+ *
+ * This software is distributed under the Common Public License 1.0
+ */
+
+/** \file SquashfsImageCheck.cpp
+ * A command line tool that writes a SquashFS image with the SquashFS writer
+ * used by SaveInterestingFilesModule (see SquashfsImage.h), together with the
+ * same tree as plain files, so that the image can be checked against the tree
+ * with an independent reader. The image holds files with duplicate content
+ * and a hard link (stored once), empty files and directories, files of
+ * several blocks (some compressible, some not), a file written while another
+ * was open, and a directory with more entries than fit under one directory
+ * header. Part of the image is compressed with the workers held back, as
+ * under host pressure.
+ *
+ * Usage:
+ *      SquashfsImageCheck folder
+ *
+ * Writes folder/check.sqsh and the tree folder/expected. The check target of
+ * the Makefile then compares them with unsquashfs:
+ *
+ *      unsquashfs -s folder/check.sqsh
+ *      unsquashfs -l folder/check.sqsh
+ *      unsquashfs -d folder/extracted folder/check.sqsh
+ *      diff -r folder/expected folder/extracted
+ */
+
+// Poco includes
+#include "Poco/File.h"
+#include "Poco/FileStream.h"
+#include "Poco/Path.h"
+#include "Poco/NumberFormatter.h"
+#include "Poco/Exception.h"
+
+// Module includes
+#include "SquashfsImage.h"
+
+// System includes
+#include <string>
+#include <iostream>
+#include <ctime>
+
+namespace
+{
+    const unsigned int WORKER_COUNT = 2;
+
+    // More entries than one directory header can hold (256).
+    const unsigned int MANY_ENTRIES = 300;
+
+    /**
+     * Writes an image and the same tree as plain files side by side.
+     */
+    class CheckTree
+    {
+    public:
+        CheckTree(const std::string &imagePath, const std::string &treePath)
+            : image(imagePath, WORKER_COUNT), treePath(treePath), mtime(std::time(NULL))
+        {
+        }
+
+        Squashfs::Writer &getImage()
+        {
+            return image;
+        }
+
+        void addDirectory(const std::string &path)
+        {
+            image.addDirectory(path, mtime);
+            Poco::File(treePath + path).createDirectories();
+        }
+
+        void addFile(const std::string &path, const std::string &data)
+        {
+            image.addFile(path, mtime, data);
+            writeTreeFile(path, data);
+        }
+
+        void addLink(const std::string &path, const std::string &existingPath, const std::string &data)
+        {
+            if (!image.addLink(path, existingPath))
+            {
+                throw Poco::NotFoundException(existingPath);
+            }
+            writeTreeFile(path, data);
+        }
+
+        /**
+         * Writes a file to the image in pieces, adding another file while it
+         * is open.
+         */
+        void addFileAround(const std::string &path, const std::string &data, const std::string &innerPath, const std::string &innerData)
+        {
+            image.beginFile(path, mtime);
+            image.write(data.data(), data.size() / 2);
+            image.addFile(innerPath, mtime, innerData);
+            image.write(data.data() + data.size() / 2, data.size() - data.size() / 2);
+            image.endFile();
+            writeTreeFile(path, data);
+            writeTreeFile(innerPath, innerData);
+        }
+
+    private:
+        void writeTreeFile(const std::string &path, const std::string &data)
+        {
+            Poco::Path filePath(treePath + path);
+            Poco::File(filePath.parent()).createDirectories();
+            Poco::FileOutputStream stream(filePath.toString(), std::ios::out | std::ios::trunc | std::ios::binary);
+            stream.write(data.data(), static_cast<std::streamsize>(data.size()));
+            stream.close();
+            if (!stream)
+            {
+                throw Poco::WriteFileException(filePath.toString());
+            }
+        }
+
+        Squashfs::Writer image;
+        std::string treePath;
+        std::time_t mtime;
+    };
+
+    /**
+     * @return Bytes that zlib cannot compress.
+     */
+    std::string randomData(size_t length, uint32_t seed)
+    {
+        std::string data(length, '\0');
+        for (size_t i = 0; i < length; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            data[i] = static_cast<char>(seed >> 24);
+        }
+        return data;
+    }
+
+    /**
+     * @return Lines of text that compress well.
+     */
+    std::string textData(size_t length)
+    {
+        std::string data;
+        for (unsigned int line = 0; data.size() < length; ++line)
+        {
+            data += "line " + Poco::NumberFormatter::format(line) + " of a compressible file\n";
+        }
+        data.resize(length);
+        return data;
+    }
+
+    void usage()
+    {
+        std::cerr << "Usage: SquashfsImageCheck folder" << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        usage();
+        return 1;
+    }
+
+    try
+    {
+        const std::string folder = Poco::Path::forDirectory(argv[1]).toString();
+        const std::string treePath = folder + "expected/";
+        Poco::File(folder).createDirectories();
+        if (Poco::File(treePath).exists())
+        {
+            Poco::File(treePath).remove(true);
+        }
+        Poco::File(treePath).createDirectories();
+
+        CheckTree tree(folder + "check.sqsh", treePath);
+        const uint32_t blockSize = Squashfs::DEFAULT_BLOCK_SIZE;
+
+        tree.addDirectory("empty");
+        tree.addDirectory("nested/deeper/empty");
+        tree.addFile("empty-file", "");
+        tree.addFile("nested/deeper/empty-file", "");
+
+        const std::string small = "a small file\n";
+        tree.addFile("small.txt", small);
+        tree.addFile("nested/copy-of-small.txt", small);
+
+        // Blocks that compress, blocks that do not, and a partial last block.
+        const std::string multiBlock = textData(2 * blockSize) + randomData(blockSize + blockSize / 2, 1);
+        tree.addFile("multi-block.bin", multiBlock);
+        tree.addFile("nested/deeper/copy-of-multi-block.bin", multiBlock);
+        tree.addLink("link-to-multi-block.bin", "multi-block.bin", multiBlock);
+        tree.addFile("exact-blocks.bin", randomData(3 * blockSize, 2));
+
+        // Compress on the writing thread, as with no workers allowed.
+        tree.getImage().setAllowedWorkers(0);
+        tree.addFile("held-back.bin", textData(blockSize) + randomData(4 * blockSize + 1, 3));
+        tree.getImage().setAllowedWorkers(1);
+        tree.addFileAround("around.bin", randomData(5 * blockSize / 2, 4), "nested/added-while-open.txt", textData(1000));
+        tree.getImage().setAllowedWorkers(WORKER_COUNT);
+
+        for (unsigned int i = 0; i < MANY_ENTRIES; ++i)
+        {
+            tree.addFile("many/file" + Poco::NumberFormatter::format0(i, 3), Poco::NumberFormatter::format(i) + "\n");
+        }
+
+        uint64_t imageSize = tree.getImage().finish();
+        std::cout << "wrote " << tree.getImage().getPath() << " (" << imageSize << " bytes) and " << treePath << std::endl;
+    }
+    catch (Poco::Exception &ex)
+    {
+        std::cerr << "SquashfsImageCheck: " << ex.displayText() << std::endl;
+        return 1;
+    }
+    catch (std::exception &ex)
+    {
+        std::cerr << "SquashfsImageCheck: " << ex.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}